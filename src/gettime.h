@@ -28,7 +28,7 @@ static inline int mono_gettime (struct timespec *ts)
 	rc = clock_gettime (CLOCK_MONOTONIC, ts);
 #endif
 #if (_POSIX_MONOTONIC_CLOCK == 0)
-	if (errno == EINVAL)
+	if (rc && (errno == EINVAL))
 #endif
 #if (_POSIX_MONOTONIC_CLOCK <= 0)
 		rc = clock_gettime (CLOCK_REALTIME, ts);
@@ -52,3 +52,20 @@ static inline int mono_nanosleep (const struct timespec *ts)
 #endif
 	return rc;
 }
+
+
+static inline int mono_sleep_until (const struct timespec *ts)
+{
+	int rc;
+
+#if (_POSIX_MONOTONIC_CLOCK >= 0)
+	rc = clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL);
+#endif
+#if (_POSIX_MONOTONIC_CLOCK == 0)
+	if (rc == EINVAL)
+#endif
+#if (_POSIX_MONOTONIC_CLOCK <= 0)
+		rc = clock_nanosleep (CLOCK_REALTIME, TIMER_ABSTIME, ts, NULL);
+#endif
+	return rc;
+}
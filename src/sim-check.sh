@@ -0,0 +1,48 @@
+#! /bin/sh
+# sim-check.sh - traces through the example simulated network
+
+# This file is distributed under the same license as the ndisc6 package.
+
+set -e
+
+: "${top_srcdir:=.}"
+: "${RLTRACEROUTE6:=./rltraceroute6}"
+topo="$top_srcdir/src/sim-example.topo"
+out="sim-check.$$"
+trap 'rm -f "$out"' EXIT
+
+# Prints the hops as "<ttl> <result> [<address>]", without round-trip times
+trace() {
+	"$RLTRACEROUTE6" -X "$topo" -O json -q 1 -w 1 "$@" > "$out" || true
+	sed -n -e 's/^{"type":"hop","ttl":\([0-9]*\),"probes":\[{"result":"\([a-z]*\)"\(,"addr":"\([0-9a-f:]*\)"\)\{0,1\}.*$/\1 \2 \4/p' \
+		"$out" | sed -e 's/ *$//'
+}
+
+check() {
+	if ! printf '%s\n' "$2" | grep -qx -e "$3"; then
+		echo "FAIL: $1: no hop matching \"$3\" in:" >&2
+		printf '%s\n' "$2" >&2
+		exit 1
+	fi
+}
+
+# Load-balanced path, destination reached
+hops="$(trace 2001:db8:10::1)"
+check "multipath" "$hops" "1 ok 2001:db8:1::1"
+check "multipath" "$hops" "2 ok 2001:db8:2::[12]"
+check "multipath" "$hops" "3 ok 2001:db8:3::1"
+check "multipath" "$hops" "4 ok 2001:db8:10::1"
+
+# Silent hop
+hops="$(trace 2001:db8:20::1)"
+check "silent" "$hops" "2 timeout"
+check "silent" "$hops" "4 ok 2001:db8:20::1"
+
+# Rejecting firewall
+hops="$(trace 2001:db8:30::1)"
+check "reject" "$hops" "3 ok 2001:db8:5::1"
+check "reject" "$hops" "4 admin 2001:db8:5::1"
+
+# Classic TCP SYN probes through the same network
+hops="$(trace -S 2001:db8:10::1)"
+check "tcp" "$hops" "4 closed 2001:db8:10::1"
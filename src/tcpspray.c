@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h> // uint8_t, SIZE_MAX
+#include <inttypes.h> // PRIu32
 #include <limits.h> // SIZE_MAX on Solaris (non-standard)
 #ifndef SIZE_MAX
 # define SIZE_MAX SIZE_T_MAX // FreeBSD 4.x workaround
@@ -42,224 +43,1938 @@
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <locale.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <sched.h> // cpu_set_t
+# include <sys/sendfile.h>
+# include <sys/epoll.h>
+# include <netinet/udp.h> // UDP_SEGMENT, UDP_GRO
+# include <linux/tcp.h> // struct tcp_info
+# include <stddef.h> // offsetof()
+# include <endian.h>
+# include <signal.h>
+# include <linux/errqueue.h>
+#endif
+#if defined (MSG_ZEROCOPY) && defined (SO_ZEROCOPY) \
+ && defined (SO_EE_ORIGIN_ZEROCOPY)
+# define HAVE_ZEROCOPY 1
+#endif
 #ifdef HAVE_GETOPT_H
 # include <getopt.h>
 #endif
 
-#include "gettime.h"
-#ifndef AI_IDN
-# define AI_IDN 0
-#endif
+#include "gettime.h"
+#ifndef AI_IDN
+# define AI_IDN 0
+#endif
+
+#define MAX_STREAMS 1024
+
+static int family = 0;
+static unsigned verbose = 0;
+
+static int tcpconnect (const char *host, const char *serv, bool udp)
+{
+	struct addrinfo hints, *res;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = family;
+	hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+	hints.ai_protocol = udp ? IPPROTO_UDP : IPPROTO_TCP;
+	hints.ai_flags = AI_IDN;
+
+	int val = getaddrinfo (host, serv, &hints, &res);
+	if (val)
+	{
+		fprintf (stderr, _("%s port %s: %s\n"), host, serv,
+		         gai_strerror (val));
+		return -1;
+	}
+
+	val = -1;
+
+	for (struct addrinfo *p = res; (p != NULL) && (val == -1); p = p->ai_next)
+	{
+		val = socket (p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (val == -1)
+		{
+			perror ("socket");
+			continue;
+		}
+
+		setsockopt (val, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof (int));
+		fcntl (val, F_SETFD, FD_CLOEXEC);
+
+		if (connect (val, p->ai_addr, p->ai_addrlen))
+		{
+			fprintf (stderr, _("%s port %s: %s\n"), host, serv,
+			         strerror (errno));
+			close (val);
+			val = -1;
+			continue;
+		}
+	}
+
+	freeaddrinfo (res);
+	return val;
+}
+
+
+static double ts_diff (const struct timespec *end,
+                       const struct timespec *start)
+{
+	return ((double)end->tv_sec)
+	     + ((double)end->tv_nsec) / 1000000000
+	     - ((double)start->tv_sec)
+	     - ((double)start->tv_nsec) / 1000000000;
+}
+
+
+static void
+print_duration (const char *msg,
+                const struct timespec *end, const struct timespec *start,
+                unsigned long bytes)
+{
+	double duration = ts_diff (end, start);
+
+	printf (_("%s %lu %s in %f %s"), gettext (msg),
+	        bytes, ngettext ("byte", "bytes", bytes),
+	        duration, ngettext ("second", "seconds", duration));
+	if (duration > 0)
+		printf (_(" (%0.3f kbytes/s)"), bytes / (duration * 1024));
+}
+
+
+/* Pins the calling thread to a CPU, if any (-a) */
+static void pin_thread (int cpu)
+{
+#ifdef __linux__
+	if (cpu != -1)
+	{
+		cpu_set_t set;
+		int val;
+
+		CPU_ZERO (&set);
+		CPU_SET (cpu, &set);
+		val = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+		if (val)
+			fprintf (stderr, _("CPU %d: %s\n"), cpu, strerror (val));
+	}
+#else
+	(void)cpu;
+#endif
+}
+
+
+#ifdef __linux__
+/*
+ * UDP mode (-u): datagrams start with a header carrying a sequence number
+ * and the sending time, from which the receiver derives loss, reordering,
+ * duplicates and jitter. One-way jitter only depends on differences of
+ * transit times, so that the clocks of both ends need not be synchronized.
+ */
+# define UDP_MAGIC 0x74637370 // "tcsp"
+# define UDP_LAST 1 // end of run marker, carries no data
+# define UDP_MAXLEN 65507 // largest UDP payload over IPv4
+# define UDP_TX_BATCH 64 // datagrams per sendmmsg() call
+# define UDP_RX_BATCH 16 // messages per recvmmsg() call
+# define UDP_WINDOW 4096 // sequence numbers tracked for duplicates
+# define UDP_IDLE_MS 2000
+
+typedef struct udp_header
+{
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t seq;
+	uint64_t sent; // realtime clock, in nanoseconds
+	uint64_t count; // datagrams in the run
+} udp_header_t;
+
+typedef struct udp_stats
+{
+	uint64_t received, duplicates, reordered, bytes;
+	uint64_t next; // highest sequence number seen, plus one
+	uint64_t count; // announced by the sender
+	bool done; // end marker seen
+	double jitter; // RFC 3550 estimator, in nanoseconds
+	int64_t transit;
+	struct timespec first, last;
+	uint64_t window[UDP_WINDOW / 64];
+} udp_stats_t;
+
+
+static void udp_header_write (uint8_t *buf, uint32_t flags, uint64_t seq,
+                              uint64_t sent, uint64_t count)
+{
+	udp_header_t h =
+	{
+		.magic = htonl (UDP_MAGIC),
+		.flags = htonl (flags),
+		.seq = htobe64 (seq),
+		.sent = htobe64 (sent),
+		.count = htobe64 (count),
+	};
+
+	memcpy (buf, &h, sizeof (h));
+}
+
+
+static void udp_stats_add (udp_stats_t *s, const uint8_t *buf, size_t len,
+                           const struct timespec *rcvd)
+{
+	udp_header_t h;
+
+	if (len < sizeof (h))
+		return;
+	memcpy (&h, buf, sizeof (h));
+	if (ntohl (h.magic) != UDP_MAGIC)
+		return;
+
+	s->count = be64toh (h.count);
+	if (ntohl (h.flags) & UDP_LAST)
+	{
+		s->done = true;
+		return;
+	}
+
+	uint64_t seq = be64toh (h.seq);
+	int64_t transit = (int64_t)rcvd->tv_sec * 1000000000 + rcvd->tv_nsec
+	                - (int64_t)be64toh (h.sent);
+
+	if (s->received == 0)
+		s->first = *rcvd;
+	else
+	{
+		int64_t d = transit - s->transit;
+		s->jitter += (((d < 0) ? -d : d) - s->jitter) / 16;
+	}
+	s->transit = transit;
+	s->last = *rcvd;
+	s->received++;
+	s->bytes += len;
+
+	uint64_t *word = s->window + (seq / 64) % (UDP_WINDOW / 64);
+	uint64_t bit = UINT64_C(1) << (seq % 64);
+
+	if (seq >= s->next)
+	{
+		/* Forgets about the slots being reused */
+		if (seq - s->next >= UDP_WINDOW)
+			memset (s->window, 0, sizeof (s->window));
+		else
+			for (uint64_t i = s->next; i < seq; i++)
+				s->window[(i / 64) % (UDP_WINDOW / 64)]
+					&= ~(UINT64_C(1) << (i % 64));
+		*word |= bit;
+		s->next = seq + 1;
+	}
+	else
+	if (s->next - seq > UDP_WINDOW)
+		s->reordered++; // too late to tell duplicates apart
+	else
+	if (*word & bit)
+		s->duplicates++;
+	else
+	{
+		*word |= bit;
+		s->reordered++;
+	}
+}
+
+
+/* Datagrams that were sent, as far as the receiver can tell */
+static uint64_t udp_stats_total (const udp_stats_t *s)
+{
+	return (s->count > s->next) ? s->count : s->next;
+}
+
+
+/* Sums the statistics of several streams, keeping the worst jitter */
+static void udp_stats_merge (udp_stats_t *dst, const udp_stats_t *src)
+{
+	dst->count += udp_stats_total (src);
+	dst->received += src->received;
+	dst->duplicates += src->duplicates;
+	dst->reordered += src->reordered;
+	dst->bytes += src->bytes;
+	if (src->jitter > dst->jitter)
+		dst->jitter = src->jitter;
+}
+
+
+static void udp_stats_print (const udp_stats_t *s)
+{
+	uint64_t total = udp_stats_total (s);
+	uint64_t unique = s->received - s->duplicates;
+	uint64_t lost = (total > unique) ? (total - unique) : 0;
+
+	printf (_("%"PRIu64" of %"PRIu64" %s received, %"PRIu64" lost "
+	          "(%0.3f%%), %"PRIu64" reordered, %"PRIu64" duplicated, "
+	          "jitter %0.3f ms"), unique, total,
+	        ngettext ("datagram", "datagrams", total), lost,
+	        total ? (100. * lost / total) : 0., s->reordered, s->duplicates,
+	        s->jitter / 1000000);
+}
+
+
+/* Receive buffers for a batch of datagrams, or of GRO trains thereof */
+typedef struct udp_rx
+{
+	struct mmsghdr msg[UDP_RX_BATCH];
+	struct iovec iov[UDP_RX_BATCH];
+	struct sockaddr_storage addr[UDP_RX_BATCH];
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE (sizeof (struct timespec))
+		         + CMSG_SPACE (sizeof (int))];
+	} control[UDP_RX_BATCH];
+	uint8_t buf[UDP_RX_BATCH][65536];
+} udp_rx_t;
+
+
+static int udp_rx_recv (udp_rx_t *rx, int fd, int flags)
+{
+	for (unsigned i = 0; i < UDP_RX_BATCH; i++)
+	{
+		struct msghdr *hdr = &rx->msg[i].msg_hdr;
+
+		rx->iov[i].iov_base = rx->buf[i];
+		rx->iov[i].iov_len = sizeof (rx->buf[i]);
+		hdr->msg_name = rx->addr + i;
+		hdr->msg_namelen = sizeof (rx->addr[i]);
+		hdr->msg_iov = rx->iov + i;
+		hdr->msg_iovlen = 1;
+		hdr->msg_control = rx->control[i].buf;
+		hdr->msg_controllen = sizeof (rx->control[i].buf);
+		hdr->msg_flags = 0;
+	}
+	return recvmmsg (fd, rx->msg, UDP_RX_BATCH, flags, NULL);
+}
+
+
+/* Accounts for one received message, split in its GRO segments if any */
+static void udp_rx_parse (const udp_rx_t *rx, unsigned i, udp_stats_t *s)
+{
+	struct msghdr *hdr = (struct msghdr *)&rx->msg[i].msg_hdr;
+	size_t len = rx->msg[i].msg_len, seglen = len;
+	struct timespec ts = { 0, 0 };
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (hdr); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR (hdr, cmsg))
+	{
+		if ((cmsg->cmsg_level == SOL_SOCKET)
+		 && (cmsg->cmsg_type == SCM_TIMESTAMPNS))
+			memcpy (&ts, CMSG_DATA (cmsg), sizeof (ts));
+# ifdef UDP_GRO
+		if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO))
+		{
+			int val;
+
+			memcpy (&val, CMSG_DATA (cmsg), sizeof (val));
+			if (val > 0)
+				seglen = val;
+		}
+# endif
+	}
+
+	if (ts.tv_sec == 0)
+		clock_gettime (CLOCK_REALTIME, &ts);
+
+	for (size_t off = 0; off < len; off += seglen)
+		udp_stats_add (s, rx->buf[i] + off,
+		               (len - off < seglen) ? (len - off) : seglen, &ts);
+}
+
+
+/* Sets up a socket to receive datagrams with their arrival times */
+static void udp_rx_setup (int fd, bool gro)
+{
+	/* Unlike TCP, there is no buffer autotuning to lose */
+	if (setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &(int){ 4 << 20 },
+	                sizeof (int)))
+		setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &(int){ 4 << 20 },
+		            sizeof (int));
+	setsockopt (fd, SOL_SOCKET, SO_TIMESTAMPNS, &(int){ 1 }, sizeof (int));
+# ifdef UDP_GRO
+	if (gro)
+		setsockopt (fd, SOL_UDP, UDP_GRO, &(int){ 1 }, sizeof (int));
+# else
+	(void)gro;
+# endif
+}
+#endif
+
+
+/*
+ * Parallel streams (-P): each connection is driven by its own thread,
+ * optionally pinned to a CPU (-a), plus a receiver thread in Echo mode.
+ * The send buffer is shared, as it is only read.
+ */
+typedef struct spray_run
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	unsigned running; // streams
+} spray_run_t;
+
+typedef struct spray_stream
+{
+	pthread_t thread, receiver;
+	void *(*send) (void *);
+	spray_run_t *run;
+	int fd;
+	int cpu; // -1 if not pinned
+	unsigned long count; // blocks, 0 if only bounded in time
+	size_t blen;
+	const uint8_t *block;
+	const struct timespec *delay;
+	int fillfd; // sendfile() source, -1 if none
+	bool zerocopy;
+	bool echo;
+	bool dots; // verbose progress
+	bool failed;
+	uint32_t sent, completed, copied; // MSG_ZEROCOPY send calls
+	struct timespec start, end, end_recv;
+
+	/* Shared with the reporting thread */
+	pthread_mutex_t lock;
+	uintmax_t sent_bytes, recv_bytes;
+	bool stop; // time is up
+	bool sent_all;
+#ifdef __linux__
+	double rate; // UDP payload bits per second, 0 if unlimited
+	bool gso;
+	udp_stats_t stats; // echoed datagrams
+	struct
+	{
+		uint64_t busy, rwnd, sndbuf; // microseconds
+		uint32_t retrans;
+	} info; // TCP_INFO counters as of the previous sample
+#endif
+} spray_stream_t;
+
+
+/* Accounts for sent data; returns true if the stream must stop */
+static bool spray_sent (spray_stream_t *st, size_t bytes)
+{
+	bool stop;
+
+	pthread_mutex_lock (&st->lock);
+	st->sent_bytes += bytes;
+	stop = st->stop;
+	pthread_mutex_unlock (&st->lock);
+	return stop;
+}
+
+
+static void spray_received (spray_stream_t *st, size_t bytes)
+{
+	pthread_mutex_lock (&st->lock);
+	st->recv_bytes += bytes;
+	pthread_mutex_unlock (&st->lock);
+}
+
+
+static void *spray_recv (void *data)
+{
+	spray_stream_t *st = data;
+	uint8_t *buf = malloc (st->blen);
+
+	if (buf == NULL)
+	{
+		perror ("malloc");
+		st->failed = true;
+		return NULL;
+	}
+
+	/*
+	 * With a block count, everything is echoed once that many blocks are
+	 * received (unless sending stopped early, which shuts the socket down
+	 * on error). Otherwise, the server closes the connection once it has
+	 * echoed everything.
+	 */
+	uintmax_t total = 0, expected = (uintmax_t)st->count * st->blen;
+	ssize_t val = 0;
+
+	while (((expected == 0) || (total < expected))
+	    && ((val = recv (st->fd, buf, st->blen, 0)) > 0))
+	{
+		if (st->dots)
+			for (uintmax_t i = total / st->blen;
+			     i < (total + val) / st->blen; i++)
+				fputs ("\b \b", stdout);
+
+		total += val;
+		spray_received (st, val);
+	}
+
+	if (val == -1)
+	{
+		fprintf (stderr, _("Receive error: %s\n"), strerror (errno));
+		st->failed = true;
+	}
+
+	mono_gettime (&st->end_recv);
+	free (buf);
+	return NULL;
+}
+
+
+#ifdef HAVE_ZEROCOPY
+/*
+ * Reads MSG_ZEROCOPY completion notifications from the error queue. Each
+ * covers a range of send calls, numbered from zero, whose pages the kernel
+ * has released. If wait is true and none is queued, waits for one.
+ */
+static int spray_reap (spray_stream_t *st, bool wait)
+{
+	uint32_t completed = st->completed;
+
+	while (st->completed != st->sent)
+	{
+		char cbuf[CMSG_SPACE (sizeof (struct sock_extended_err)) + 64];
+		struct msghdr hdr =
+		{
+			.msg_control = cbuf,
+			.msg_controllen = sizeof (cbuf),
+		};
+
+		if (recvmsg (st->fd, &hdr, MSG_ERRQUEUE) == -1)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				return -1;
+			if (!wait || (st->completed != completed))
+				break;
+
+			/* Notifications are signaled as POLLERR */
+			struct pollfd ufd = { .fd = st->fd, .events = 0 };
+			if (poll (&ufd, 1, -1) == -1)
+			{
+				if (errno != EINTR)
+					return -1;
+			}
+			else
+			if (!(ufd.revents & POLLERR))
+			{
+				errno = EPIPE;
+				return -1;
+			}
+			continue;
+		}
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&hdr); cmsg != NULL;
+		     cmsg = CMSG_NXTHDR (&hdr, cmsg))
+		{
+			if (((cmsg->cmsg_level != SOL_IP)
+			  || (cmsg->cmsg_type != IP_RECVERR))
+			 && ((cmsg->cmsg_level != SOL_IPV6)
+			  || (cmsg->cmsg_type != IPV6_RECVERR)))
+				continue;
+
+			struct sock_extended_err ee;
+			memcpy (&ee, CMSG_DATA (cmsg), sizeof (ee));
+			if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+			{
+				errno = ee.ee_errno;
+				return -1;
+			}
+
+			/* Range of send calls, from ee_info to ee_data included */
+			uint32_t count = ee.ee_data - ee.ee_info + 1;
+			st->completed += count;
+			if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				st->copied += count;
+		}
+	}
+	return 0;
+}
+#endif
+
+
+/* Sends one block, the way selected by the command line options */
+static ssize_t spray_write (spray_stream_t *st)
+{
+#ifdef __linux__
+	if (st->fillfd != -1)
+	{
+		/* Straight from the page cache, without a user-space copy */
+		off_t off = 0;
+
+		while ((size_t)off < st->blen)
+		{
+			ssize_t val = sendfile (st->fd, st->fillfd, &off, st->blen - off);
+			if (val <= 0)
+				return val;
+		}
+		return off;
+	}
+#endif
+#ifdef HAVE_ZEROCOPY
+	if (st->zerocopy)
+	{
+		for (;;)
+		{
+			ssize_t val = send (st->fd, st->block, st->blen, MSG_ZEROCOPY);
+			if (val > 0)
+			{
+				st->sent++;
+				return val;
+			}
+
+			/* Too many pinned pages: waits for some to be released */
+			if ((val == -1) && (errno == ENOBUFS)
+			 && (st->completed != st->sent) && (spray_reap (st, true) == 0))
+				continue;
+			return val;
+		}
+	}
+#endif
+	return write (st->fd, st->block, st->blen);
+}
+
+
+static void *spray_send (void *data)
+{
+	spray_stream_t *st = data;
+
+	pin_thread (st->cpu);
+	mono_gettime (&st->start);
+
+	if (st->echo)
+	{
+		errno = pthread_create (&st->receiver, NULL, spray_recv, st);
+		if (errno)
+		{
+			perror ("pthread_create");
+			st->failed = true;
+			return NULL;
+		}
+	}
+
+	for (unsigned long i = 0; (st->count == 0) || (i < st->count); i++)
+	{
+		ssize_t val = spray_write (st);
+		if (val != (ssize_t)st->blen)
+		{
+			fprintf (stderr, _("Cannot send data: %s\n"),
+			         (val == -1) ? strerror (errno)
+			                     : _("Connection closed by peer"));
+			st->failed = true;
+			shutdown (st->fd, SHUT_RDWR); // wakes the receiver up
+			break;
+		}
+
+		if (st->dots)
+			fputc ('.', stdout);
+		if (spray_sent (st, val))
+			break;
+
+		if ((st->delay != NULL) && mono_nanosleep (st->delay))
+		{
+			st->failed = true;
+			shutdown (st->fd, SHUT_RDWR);
+			break;
+		}
+	}
+
+	mono_gettime (&st->end);
+
+#ifdef HAVE_ZEROCOPY
+	/* Buffers must not be released before the kernel is done with them */
+	while (st->zerocopy && (st->completed != st->sent))
+		if (spray_reap (st, true))
+		{
+			perror (_("Zero-copy completion"));
+			st->failed = true;
+			break;
+		}
+#endif
+	shutdown (st->fd, SHUT_WR);
+
+	if (st->echo)
+	{
+		pthread_join (st->receiver, NULL);
+		if (!st->failed && (st->recv_bytes != st->sent_bytes))
+		{
+			fprintf (stderr, _("Receive error: %s\n"),
+			         _("Connection closed by peer"));
+			st->failed = true;
+		}
+	}
+	return NULL;
+}
+
+
+/* Runs a stream, and tells the reporting thread when it is over */
+static void *spray_thread (void *data)
+{
+	spray_stream_t *st = data;
+	spray_run_t *run = st->run;
+
+	st->send (st);
+
+	pthread_mutex_lock (&run->lock);
+	run->running--;
+	pthread_cond_signal (&run->wait);
+	pthread_mutex_unlock (&run->lock);
+	return NULL;
+}
+
+
+#ifdef __linux__
+static void *udp_recv (void *data)
+{
+	spray_stream_t *st = data;
+	udp_rx_t *rx = malloc (sizeof (*rx));
+
+	st->end_recv = st->start;
+	if (rx == NULL)
+	{
+		perror ("malloc");
+		st->failed = true;
+		return NULL;
+	}
+
+	while (!st->stats.done)
+	{
+		struct pollfd ufd = { .fd = st->fd, .events = POLLIN };
+		int val = poll (&ufd, 1, UDP_IDLE_MS);
+
+		if (val == 0)
+		{
+			/* Nothing more will come back, not even the end marker */
+			pthread_mutex_lock (&st->lock);
+			bool done = st->sent_all;
+			pthread_mutex_unlock (&st->lock);
+			if (done)
+				break;
+			continue;
+		}
+
+		if (val > 0)
+			val = udp_rx_recv (rx, st->fd, MSG_DONTWAIT);
+		if (val == -1)
+		{
+			if ((errno == EAGAIN) || (errno == EINTR))
+				continue;
+			fprintf (stderr, _("Receive error: %s\n"), strerror (errno));
+			st->failed = true;
+			break;
+		}
+
+		uint64_t bytes = st->stats.bytes;
+		for (int i = 0; i < val; i++)
+			udp_rx_parse (rx, i, &st->stats);
+		if (st->stats.bytes != bytes)
+		{
+			mono_gettime (&st->end_recv);
+			spray_received (st, st->stats.bytes - bytes);
+		}
+	}
+
+	free (rx);
+	return NULL;
+}
+
+
+/* Waits until the given amount of data is due at the target rate */
+static void udp_pace (const spray_stream_t *st, uint64_t bytes)
+{
+	double t = bytes * 8. / st->rate;
+	struct timespec ts = st->start;
+
+	ts.tv_sec += (time_t)t;
+	ts.tv_nsec += (long)((t - (time_t)t) * 1000000000);
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	while (mono_sleep_until (&ts) == EINTR);
+}
+
+
+static void *udp_send (void *data)
+{
+	spray_stream_t *st = data;
+	size_t blen = st->blen;
+	unsigned batch = UDP_TX_BATCH, segs = 1;
+	uint8_t *buf = malloc (UDP_TX_BATCH * blen);
+
+	if (buf == NULL)
+	{
+		perror ("malloc");
+		st->failed = true;
+		return NULL;
+	}
+	for (unsigned i = 0; i < UDP_TX_BATCH; i++)
+		memcpy (buf + i * blen, st->block, blen);
+
+	/* Trains of datagrams are segmented by the kernel (or the NIC) */
+	if (st->gso)
+	{
+		segs = UDP_MAXLEN / blen;
+		if (segs > 64)
+			segs = 64;
+	}
+
+	/* Batches of about one millisecond worth of data at the target rate */
+	if (st->delay != NULL)
+		batch = 1;
+	else
+	if (st->rate > 0)
+	{
+		double n = st->rate / (8000. * blen);
+		batch = (n < 1.) ? 1 : (n < UDP_TX_BATCH) ? (unsigned)n : UDP_TX_BATCH;
+	}
+
+	pin_thread (st->cpu);
+	mono_gettime (&st->start);
+
+	if (st->echo)
+	{
+		errno = pthread_create (&st->receiver, NULL, udp_recv, st);
+		if (errno)
+		{
+			perror ("pthread_create");
+			st->failed = true;
+			free (buf);
+			return NULL;
+		}
+	}
+
+	uint64_t seq = 0;
+
+	while ((st->count == 0) || (seq < st->count))
+	{
+		struct mmsghdr msg[UDP_TX_BATCH];
+		struct iovec iov[UDP_TX_BATCH];
+		struct timespec now;
+		unsigned n = ((st->count == 0) || (st->count - seq >= batch))
+		             ? batch : (st->count - seq);
+		unsigned nmsg = 0;
+
+		if (st->rate > 0)
+			udp_pace (st, seq * blen);
+
+		clock_gettime (CLOCK_REALTIME, &now);
+		for (unsigned i = 0; i < n; i++)
+			udp_header_write (buf + i * blen, 0, seq + i,
+			                  (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+			                  st->count);
+
+		memset (msg, 0, sizeof (msg));
+		for (unsigned i = 0; i < n; i += segs)
+		{
+			iov[nmsg].iov_base = buf + i * blen;
+			iov[nmsg].iov_len = ((n - i < segs) ? (n - i) : segs) * blen;
+			msg[nmsg].msg_hdr.msg_iov = iov + nmsg;
+			msg[nmsg].msg_hdr.msg_iovlen = 1;
+			nmsg++;
+		}
+
+		for (unsigned i = 0; i < nmsg;)
+		{
+			int val = sendmmsg (st->fd, msg + i, nmsg - i, 0);
+			if (val == -1)
+			{
+				if (errno == EINTR)
+					continue;
+				fprintf (stderr, _("Cannot send data: %s\n"),
+				         strerror (errno));
+				st->failed = true;
+				goto out;
+			}
+			i += val;
+		}
+		seq += n;
+		if (spray_sent (st, n * blen))
+			break;
+
+		if ((st->delay != NULL) && mono_nanosleep (st->delay))
+		{
+			st->failed = true;
+			goto out;
+		}
+	}
+
+out:
+	mono_gettime (&st->end);
+
+	/* End markers, spaced out so as not to be all lost together */
+	for (unsigned i = 0; i < 3; i++)
+	{
+		uint8_t marker[sizeof (udp_header_t)];
+
+		if (i > 0)
+			mono_nanosleep (&(struct timespec){ 0, 10000000 });
+		udp_header_write (marker, UDP_LAST, 0, 0, seq);
+		send (st->fd, marker, sizeof (marker), 0);
+	}
+
+	pthread_mutex_lock (&st->lock);
+	st->sent_all = true;
+	pthread_mutex_unlock (&st->lock);
+
+	if (st->echo)
+		pthread_join (st->receiver, NULL);
+	free (buf);
+	return NULL;
+}
+#endif
+
+
+#ifdef __linux__
+/*
+ * Prints the congestion control state of a TCP stream: its window and
+ * round-trip time estimates, and how it fared since the previous sample.
+ * Retransmissions point at the path, while time spent limited by the
+ * receive window resp. the send buffer points at the receiver resp. the
+ * sender itself.
+ */
+static void spray_tcpinfo (spray_stream_t *st, unsigned num)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof (ti);
+
+	memset (&ti, 0, sizeof (ti));
+	if (getsockopt (st->fd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+	{
+		perror ("TCP_INFO");
+		return;
+	}
+
+	if (num > 0)
+		printf (_("Stream %u: "), num);
+
+	uint32_t retrans = ti.tcpi_total_retrans - st->info.retrans;
+
+	printf (_("cwnd %"PRIu32" %s, RTT %0.3f ms (deviation %0.3f ms), "
+	          "%"PRIu32" %s"), ti.tcpi_snd_cwnd,
+	        ngettext ("segment", "segments", ti.tcpi_snd_cwnd),
+	        ti.tcpi_rtt / 1000., ti.tcpi_rttvar / 1000., retrans,
+	        ngettext ("retransmission", "retransmissions", retrans));
+	st->info.retrans = ti.tcpi_total_retrans;
+
+	/* Older kernels return a shorter structure */
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_DELIVERY_RATE
+	if (len >= offsetof (struct tcp_info, tcpi_delivery_rate)
+	           + sizeof (ti.tcpi_delivery_rate))
+		printf (_(", pacing %0.3f kbytes/s, delivery %0.3f kbytes/s"),
+		        ti.tcpi_pacing_rate / 1024., ti.tcpi_delivery_rate / 1024.);
+#endif
+
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_SNDBUF_LIMITED
+	if (len >= offsetof (struct tcp_info, tcpi_sndbuf_limited)
+	           + sizeof (ti.tcpi_sndbuf_limited))
+	{
+		uint64_t busy = ti.tcpi_busy_time - st->info.busy;
+		uint64_t rwnd = ti.tcpi_rwnd_limited - st->info.rwnd;
+		uint64_t sndbuf = ti.tcpi_sndbuf_limited - st->info.sndbuf;
+
+		printf (_(", busy %0.3f s"), busy / 1e6);
+		if (busy > 0)
+			printf (_(" (%0.1f%% receive window limited, "
+			          "%0.1f%% send buffer limited)"),
+			        100. * rwnd / busy, 100. * sndbuf / busy);
+
+		st->info.busy = ti.tcpi_busy_time;
+		st->info.rwnd = ti.tcpi_rwnd_limited;
+		st->info.sndbuf = ti.tcpi_sndbuf_limited;
+	}
+#endif
+	puts ("");
+}
+#endif
+
+
+/* Prints the throughput of all streams since the previous report */
+static void spray_interval (spray_stream_t *tab, unsigned streams,
+                            double from, double to, bool echo,
+                            uintmax_t *sent, uintmax_t *rcvd)
+{
+	uintmax_t s = 0, r = 0;
+
+	for (unsigned i = 0; i < streams; i++)
+	{
+		pthread_mutex_lock (&tab[i].lock);
+		s += tab[i].sent_bytes;
+		r += tab[i].recv_bytes;
+		pthread_mutex_unlock (&tab[i].lock);
+	}
+
+	double d = (to - from) * 1024;
+
+	printf (_("%7.3f-%7.3f s: "), from, to);
+	printf (_("Transmitted %ju %s (%0.3f kbytes/s)"), s - *sent,
+	        ngettext ("byte", "bytes", s - *sent), (s - *sent) / d);
+	if (echo)
+		printf (_(", Received %ju %s (%0.3f kbytes/s)"), r - *rcvd,
+		        ngettext ("byte", "bytes", r - *rcvd), (r - *rcvd) / d);
+	puts ("");
+	*sent = s;
+	*rcvd = r;
+}
+
+
+/*
+ * Waits for the streams to complete, reporting their throughput every
+ * interval (-i) and stopping them once the duration is over (-t). This is
+ * driven by the clock, not by the data, and only costs the streams an
+ * uncontended lock per block.
+ */
+static void spray_wait (spray_stream_t *tab, unsigned streams,
+                        spray_run_t *run, double interval, double duration,
+                        bool echo, bool tcpinfo)
+{
+	/* Verbose progress dots are flushed a few times per second */
+	double tick = (interval > 0.) ? interval : verbose ? 0.25 : 0.;
+	double next = tick, last = 0.;
+	uintmax_t sent = 0, rcvd = 0;
+	bool stopped = duration <= 0.;
+	struct timespec t0, now;
+
+	mono_gettime (&t0);
+
+	for (;;)
+	{
+		double wake = (tick > 0.) ? next : -1.;
+		if (!stopped && ((wake < 0.) || (duration < wake)))
+			wake = duration;
+
+		struct timespec ts = t0;
+		ts.tv_sec += (time_t)wake;
+		ts.tv_nsec += (long)((wake - (time_t)wake) * 1000000000);
+		if (ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock (&run->lock);
+		for (int val = 0; (run->running > 0) && (val != ETIMEDOUT);)
+			val = (wake >= 0.)
+				? pthread_cond_timedwait (&run->wait, &run->lock, &ts)
+				: pthread_cond_wait (&run->wait, &run->lock);
+		bool done = run->running == 0;
+		pthread_mutex_unlock (&run->lock);
+
+		mono_gettime (&now);
+
+		double t = ts_diff (&now, &t0);
+
+		if (!stopped && (t >= duration))
+		{
+			for (unsigned i = 0; i < streams; i++)
+			{
+				pthread_mutex_lock (&tab[i].lock);
+				tab[i].stop = true;
+				pthread_mutex_unlock (&tab[i].lock);
+			}
+			stopped = true;
+		}
+
+		/* The tail after the last report is reported too, unless it is
+		 * too short to give a meaningful rate */
+		if ((interval > 0.)
+		 && (done ? ((t - last) > ((last > 0.) ? (interval / 10.) : 0.))
+		          : (t >= next)))
+		{
+			spray_interval (tab, streams, last, t, echo, &sent, &rcvd);
+#ifdef __linux__
+			for (unsigned i = 0; tcpinfo && (i < streams); i++)
+				spray_tcpinfo (tab + i, (streams > 1) ? (i + 1) : 0);
+#else
+			(void)tcpinfo;
+#endif
+			last = t;
+		}
+
+		if ((tick > 0.) && (t >= next))
+		{
+			fflush (stdout);
+			while (next <= t)
+				next += tick;
+		}
+
+		if (done)
+			break;
+	}
+}
+
+
+static int
+tcpspray (const char *host, const char *serv, unsigned long n, size_t blen,
+          unsigned delay_us, const char *fillname, bool echo,
+          unsigned streams, const int *cpus, unsigned ncpus, bool zerocopy,
+          bool udp, double rate, bool gso, double duration, double interval,
+          bool tcpinfo)
+{
+	if (serv == NULL)
+		serv = echo ? "echo" : "discard";
+
+	uint8_t *block = calloc (1, blen ? blen : 1);
+	spray_stream_t *tab = calloc (streams, sizeof (*tab));
+	if ((block == NULL) || (tab == NULL))
+	{
+		perror ("calloc");
+		free (block);
+		free (tab);
+		return -1;
+	}
+
+	int fillfd = -1;
+
+	if (fillname != NULL)
+	{
+		FILE *stream = fopen (fillname, "r");
+		if (stream == NULL)
+		{
+			perror (fillname);
+			free (block);
+			free (tab);
+			return -1;
+		}
+
+		size_t res = fread (block, 1, blen, stream);
+		if (res < blen)
+		{
+			fprintf (stderr, _("Warning: \"%s\" is too small (%zu %s) "
+			           "to fill block of %zu %s.\n"), fillname,
+			         res, ngettext ("byte", "bytes", res),
+			         blen, ngettext ("byte", "bytes", blen));
+		}
+#ifdef __linux__
+		else
+		if (zerocopy)
+			fillfd = dup (fileno (stream));
+#endif
+		fclose (stream);
+	}
+
+	struct timespec delay_ts = { 0, 0 };
+	if (delay_us)
+	{
+		div_t d = div (delay_us, 1000000);
+		delay_ts.tv_sec = d.quot;
+		delay_ts.tv_nsec = d.rem * 1000;
+	}
+
+	spray_run_t run = { .running = 0 };
+	pthread_condattr_t attr;
+
+	pthread_mutex_init (&run.lock, NULL);
+	pthread_condattr_init (&attr);
+#if (_POSIX_MONOTONIC_CLOCK >= 0)
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+#endif
+	pthread_cond_init (&run.wait, &attr);
+	pthread_condattr_destroy (&attr);
+
+	/* Connects all streams before sending anything */
+	int ret = -1;
+	unsigned started = 0, i;
+
+	for (i = 0; i < streams; i++)
+	{
+		spray_stream_t *st = tab + i;
+
+		st->fd = tcpconnect (host, serv, udp);
+		if (st->fd == -1)
+			goto out;
+		if (!echo && !udp)
+			shutdown (st->fd, SHUT_RD);
+
+		st->cpu = (ncpus > 0) ? cpus[i % ncpus] : -1;
+		st->count = n;
+		st->blen = blen;
+		st->block = block;
+		st->delay = delay_us ? &delay_ts : NULL;
+		st->fillfd = fillfd;
+		st->echo = echo;
+		st->dots = verbose && (interval <= 0.);
+		st->run = &run;
+		st->send = spray_send;
+		pthread_mutex_init (&st->lock, NULL);
+
+#ifdef __linux__
+		st->rate = rate / streams;
+		st->gso = gso;
+		if (udp)
+			st->send = udp_send;
+		if (udp)
+		{
+			if (echo)
+				udp_rx_setup (st->fd, true);
+# ifdef UDP_SEGMENT
+			if (gso && setsockopt (st->fd, SOL_UDP, UDP_SEGMENT,
+			                       &(int){ blen }, sizeof (int)))
+			{
+				perror ("UDP_SEGMENT");
+				close (st->fd);
+				goto out;
+			}
+# endif
+			continue;
+		}
+#endif
+
+#ifdef HAVE_ZEROCOPY
+		/* Blocks padded from a short file cannot be sent from it */
+		st->zerocopy = zerocopy && (fillfd == -1);
+		if (st->zerocopy
+		 && setsockopt (st->fd, SOL_SOCKET, SO_ZEROCOPY, &(int){ 1 },
+		                sizeof (int)))
+		{
+			perror ("SO_ZEROCOPY");
+			close (st->fd);
+			goto out;
+		}
+#else
+		if (zerocopy && (fillfd == -1))
+		{
+			fputs (_("MSG_ZEROCOPY is not supported.\n"), stderr);
+			close (st->fd);
+			goto out;
+		}
+#endif
+	}
+
+	if (verbose)
+	{
+		if (n > 0)
+			printf (_("Sending %ju %s with blocksize %zu %s\n"),
+			        (uintmax_t)n * blen * streams,
+			        ngettext ("byte", "bytes", n * blen * streams),
+			        blen, ngettext ("byte", "bytes", blen));
+		else
+			printf (_("Sending for %g %s with blocksize %zu %s\n"),
+			        duration, ngettext ("second", "seconds", duration),
+			        blen, ngettext ("byte", "bytes", blen));
+		if (streams > 1)
+			printf (ngettext ("over %u stream\n", "over %u streams\n",
+			                  streams), streams);
+	}
+
+	for (; started < streams; started++)
+	{
+		pthread_mutex_lock (&run.lock);
+		errno = pthread_create (&tab[started].thread, NULL, spray_thread,
+		                        tab + started);
+		if (errno == 0)
+			run.running++;
+		pthread_mutex_unlock (&run.lock);
+		if (errno)
+		{
+			perror ("pthread_create");
+			break;
+		}
+	}
+
+	spray_wait (tab, started, &run, interval, duration, echo, tcpinfo);
+
+	bool failed = started < streams;
+	uint32_t copied = 0;
+	for (unsigned j = 0; j < started; j++)
+	{
+		pthread_join (tab[j].thread, NULL);
+		failed |= tab[j].failed;
+		copied += tab[j].copied;
+	}
+
+	/* The kernel falls back to copying, e.g. for loopback */
+	if (copied > 0)
+		fprintf (stderr, _("Warning: %"PRIu32" zero-copy %s copied "
+		                   "by the kernel.\n"), copied,
+		         ngettext ("block was", "blocks were", copied));
+
+	if (failed)
+		goto out;
+
+	/* Per-stream and aggregate results */
+	struct timespec start = tab[0].start, end = tab[0].end;
+	struct timespec end_recv = tab[0].end_recv;
+	uintmax_t bytes = 0, rbytes = 0;
+#ifdef __linux__
+	udp_stats_t stats;
+
+	memset (&stats, 0, sizeof (stats));
+#endif
+
+	for (unsigned j = 0; j < streams; j++)
+	{
+		const spray_stream_t *st = tab + j;
+
+#ifdef __linux__
+		if (udp)
+			udp_stats_merge (&stats, &st->stats);
+#endif
+		bytes += st->sent_bytes;
+		rbytes += st->recv_bytes;
+
+		if (streams > 1)
+		{
+			printf (_("Stream %u: "), j + 1);
+			if (echo)
+			{
+				print_duration (N_("Received"), &st->end_recv, &st->start,
+				                st->recv_bytes);
+				fputs (", ", stdout);
+			}
+			print_duration (N_("Transmitted"), &st->end, &st->start,
+			                st->sent_bytes);
+			puts ("");
+#ifdef __linux__
+			if (udp && echo)
+			{
+				printf (_("Stream %u: "), j + 1);
+				udp_stats_print (&st->stats);
+				puts ("");
+			}
+#endif
+		}
+
+		if (ts_diff (&st->start, &start) < 0)
+			start = st->start;
+		if (ts_diff (&st->end, &end) > 0)
+			end = st->end;
+		if (ts_diff (&st->end_recv, &end_recv) > 0)
+			end_recv = st->end_recv;
+	}
+
+	if (echo)
+		print_duration (N_("Received"), &end_recv, &start, rbytes);
+	puts ("");
+#ifdef __linux__
+	if (udp && echo)
+	{
+		udp_stats_print (&stats);
+		puts ("");
+	}
+#endif
+
+	print_duration (N_("Transmitted"), &end, &start, bytes);
+	puts ("");
+
+#ifdef __linux__
+	/* Over the whole run, unless already sampled at every interval */
+	for (unsigned j = 0; tcpinfo && (interval <= 0.) && (j < streams); j++)
+		spray_tcpinfo (tab + j, (streams > 1) ? (j + 1) : 0);
+#endif
+	ret = 0;
+
+out:
+	for (unsigned j = 0; j < i; j++)
+	{
+		close (tab[j].fd);
+		pthread_mutex_destroy (&tab[j].lock);
+	}
+	pthread_cond_destroy (&run.wait);
+	pthread_mutex_destroy (&run.lock);
+	if (fillfd != -1)
+		close (fillfd);
+	free (tab);
+	free (block);
+	return ret;
+}
+
+
+#ifdef __linux__
+/*
+ * Server mode (-s): every worker thread has its own listening sockets,
+ * bound with SO_REUSEPORT so that the kernel spreads connections among
+ * workers, and serves its connections from an epoll loop. Discarded data
+ * is dropped by the kernel (MSG_TRUNC), echoed data is spliced back
+ * through a pipe; neither is copied to user space.
+ */
+# define SERVER_BUFSIZE (4 << 20)
+# define SERVER_EVENTS 64
+# define SERVER_FLOWS 64 // UDP senders per thread
+
+typedef struct server_conn
+{
+	int fd;
+	int pipe[2]; // Echo only
+	bool listening;
+	bool eof;
+	size_t pending; // bytes in the pipe
+	size_t pipesize;
+	uintmax_t bytes;
+	char peer[NI_MAXHOST + NI_MAXSERV + 8];
+} server_conn_t;
+
+typedef struct server_worker
+{
+	pthread_t thread;
+	int epfd;
+	int cpu;
+	bool echo;
+	bool udp;
+	server_conn_t *listeners;
+	unsigned count;
+	udp_rx_t *rx;
+	struct server_flow *flows;
+	unsigned nflows;
+} server_worker_t;
+
+
+static void format_peer (const struct sockaddr *addr, socklen_t addrlen,
+                         char *buf, size_t buflen)
+{
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+
+	if (getnameinfo (addr, addrlen, host, sizeof (host), serv, sizeof (serv),
+	                 NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+		snprintf (buf, buflen, "[%s]:%s", host, serv);
+	else
+		snprintf (buf, buflen, "?");
+}
+
+
+static void server_close (server_conn_t *c)
+{
+	if (verbose)
+		printf (_("%s: %ju %s\n"), c->peer, c->bytes,
+		        ngettext ("byte", "bytes", c->bytes));
+
+	close (c->fd); // also removes it from the epoll set
+	if (c->pipe[0] != -1)
+	{
+		close (c->pipe[0]);
+		close (c->pipe[1]);
+	}
+	free (c);
+}
+
+
+/* Selects the events of a connection according to the pipe fill level */
+static int server_watch (server_worker_t *w, server_conn_t *c, int op)
+{
+	struct epoll_event ev = { .data.ptr = c };
+
+	if (!c->eof && (c->pending < c->pipesize))
+		ev.events |= EPOLLIN;
+	if (c->pending > 0)
+		ev.events |= EPOLLOUT;
+	return epoll_ctl (w->epfd, op, c->fd, &ev);
+}
+
+
+static void server_accept (server_worker_t *w, server_conn_t *l)
+{
+	for (;;)
+	{
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof (addr);
+		int fd = accept4 (l->fd, (struct sockaddr *)&addr, &addrlen,
+		                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)
+			 && (errno != ECONNABORTED) && (errno != EINTR))
+				perror ("accept");
+			return;
+		}
+
+		server_conn_t *c = malloc (sizeof (*c));
+		int val;
+
+		if (c == NULL)
+		{
+			close (fd);
+			continue;
+		}
+
+		c->fd = fd;
+		c->pipe[0] = c->pipe[1] = -1;
+		c->listening = c->eof = false;
+		c->pending = c->bytes = 0;
+		c->pipesize = SIZE_MAX;
+
+		format_peer ((struct sockaddr *)&addr, addrlen, c->peer,
+		             sizeof (c->peer));
+
+		if (w->echo)
+		{
+			if (pipe2 (c->pipe, O_NONBLOCK | O_CLOEXEC))
+			{
+				perror ("pipe");
+				c->pipe[0] = -1;
+				server_close (c);
+				continue;
+			}
+			fcntl (c->pipe[1], F_SETPIPE_SZ, 1 << 20); // best effort
+			val = fcntl (c->pipe[1], F_GETPIPE_SZ);
+			c->pipesize = (val > 0) ? val : 65536;
+		}
+
+		if (server_watch (w, c, EPOLL_CTL_ADD))
+		{
+			perror ("epoll_ctl");
+			server_close (c);
+		}
+	}
+}
+
+
+/* Handles readiness of a connection; returns false once it is done with */
+static bool server_serve (server_worker_t *w, server_conn_t *c)
+{
+	if (!w->echo)
+	{
+		ssize_t val;
+
+		/* TCP drops the data without copying it with MSG_TRUNC */
+		while ((val = recv (c->fd, NULL, SERVER_BUFSIZE,
+		                    MSG_TRUNC | MSG_DONTWAIT)) > 0)
+			c->bytes += val;
+		return (val == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)
+		                    || (errno == EINTR));
+	}
+
+	if (!c->eof && (c->pending < c->pipesize))
+	{
+		ssize_t val = splice (c->fd, NULL, c->pipe[1], NULL,
+		                      c->pipesize - c->pending,
+		                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (val > 0)
+		{
+			c->pending += val;
+			c->bytes += val;
+		}
+		else
+		if (val == 0)
+			c->eof = true;
+		else
+		if ((errno != EAGAIN) && (errno != EINTR))
+			return false;
+	}
 
-static int family = 0;
-static unsigned verbose = 0;
+	if (c->pending > 0)
+	{
+		ssize_t val = splice (c->pipe[0], NULL, c->fd, NULL, c->pending,
+		                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (val > 0)
+			c->pending -= val;
+		else
+		if ((errno != EAGAIN) && (errno != EINTR))
+			return false;
+	}
+
+	if (c->eof && (c->pending == 0))
+		return false;
+	return server_watch (w, c, EPOLL_CTL_MOD) == 0;
+}
 
-static int tcpconnect (const char *host, const char *serv)
+
+/* UDP senders are told apart by their address, and served by one worker */
+typedef struct server_flow
 {
-	struct addrinfo hints, *res;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct timespec seen;
+	udp_stats_t stats;
+} server_flow_t;
 
-	memset (&hints, 0, sizeof (hints));
-	hints.ai_family = family;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_flags = AI_IDN;
 
-	int val = getaddrinfo (host, serv, &hints, &res);
-	if (val)
+static void server_report (server_worker_t *w, unsigned i)
+{
+	server_flow_t *f = w->flows + i;
+
+	if (verbose)
 	{
-		fprintf (stderr, _("%s port %s: %s\n"), host, serv,
-		         gai_strerror (val));
-		return -1;
+		char peer[NI_MAXHOST + NI_MAXSERV + 8];
+
+		format_peer ((struct sockaddr *)&f->addr, f->addrlen, peer,
+		             sizeof (peer));
+
+		flockfile (stdout);
+		printf ("%s: ", peer);
+		print_duration (N_("Received"), &f->stats.last, &f->stats.first,
+		                f->stats.bytes);
+		printf ("\n%s: ", peer);
+		udp_stats_print (&f->stats);
+		puts ("");
+		funlockfile (stdout);
 	}
 
-	val = -1;
+	w->flows[i] = w->flows[--w->nflows];
+}
 
-	for (struct addrinfo *p = res; (p != NULL) && (val == -1); p = p->ai_next)
+
+static server_flow_t *server_flow (server_worker_t *w,
+                                   const struct sockaddr_storage *addr,
+                                   socklen_t addrlen)
+{
+	for (unsigned i = 0; i < w->nflows; i++)
+		if ((w->flows[i].addrlen == addrlen)
+		 && !memcmp (&w->flows[i].addr, addr, addrlen))
+			return w->flows + i;
+
+	if (w->nflows == SERVER_FLOWS)
 	{
-		val = socket (p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (val == -1)
+		/* Evicts the least recently active sender */
+		unsigned oldest = 0;
+
+		for (unsigned i = 1; i < w->nflows; i++)
+			if (ts_diff (&w->flows[i].seen, &w->flows[oldest].seen) < 0)
+				oldest = i;
+		server_report (w, oldest);
+	}
+
+	server_flow_t *f = w->flows + w->nflows++;
+	memset (f, 0, sizeof (*f));
+	memcpy (&f->addr, addr, addrlen);
+	f->addrlen = addrlen;
+	return f;
+}
+
+
+/* Reports senders that stopped without their end marker getting through */
+static void server_expire (server_worker_t *w)
+{
+	struct timespec now;
+
+	mono_gettime (&now);
+	for (unsigned i = 0; i < w->nflows;)
+		if (ts_diff (&now, &w->flows[i].seen) * 1000 >= UDP_IDLE_MS)
+			server_report (w, i);
+		else
+			i++;
+}
+
+
+static void server_recv (server_worker_t *w, server_conn_t *l)
+{
+	int n;
+
+	while ((n = udp_rx_recv (w->rx, l->fd, MSG_DONTWAIT)) > 0)
+	{
+		struct timespec now;
+
+		mono_gettime (&now);
+		for (int i = 0; i < n; i++)
 		{
-			perror ("socket");
-			continue;
+			struct msghdr *hdr = &w->rx->msg[i].msg_hdr;
+			server_flow_t *f = server_flow (w, hdr->msg_name,
+			                                hdr->msg_namelen);
+
+			f->seen = now;
+			udp_rx_parse (w->rx, i, &f->stats);
+			if (f->stats.done)
+			{
+				if (f->stats.received > 0)
+					server_report (w, f - w->flows);
+				else
+					w->flows[f - w->flows] = w->flows[--w->nflows];
+			}
+
+			/* Echoes the datagram, with neither GRO nor ancillary data */
+			hdr->msg_iov->iov_len = w->rx->msg[i].msg_len;
+			hdr->msg_control = NULL;
+			hdr->msg_controllen = 0;
 		}
 
-		setsockopt (val, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof (int));
-		fcntl (val, F_SETFD, FD_CLOEXEC);
+		if (w->echo)
+			for (int i = 0; i < n;)
+			{
+				int val = sendmmsg (l->fd, w->rx->msg + i, n - i,
+				                    MSG_DONTWAIT);
+				if (val <= 0)
+					break; // datagrams can be dropped
+				i += val;
+			}
+	}
+}
 
-		if (connect (val, p->ai_addr, p->ai_addrlen))
+
+static void *server_thread (void *data)
+{
+	server_worker_t *w = data;
+
+	pin_thread (w->cpu);
+
+	for (;;)
+	{
+		struct epoll_event ev[SERVER_EVENTS];
+		int n = epoll_wait (w->epfd, ev, SERVER_EVENTS,
+		                    w->udp ? UDP_IDLE_MS / 2 : -1);
+
+		if (n == -1)
 		{
-			fprintf (stderr, _("%s port %s: %s\n"), host, serv,
-			         strerror (errno));
-			close (val);
-			val = -1;
-			continue;
+			if (errno == EINTR)
+				continue;
+			perror ("epoll_wait");
+			break;
 		}
-	}
 
-	freeaddrinfo (res);
-	return val;
+		for (int i = 0; i < n; i++)
+		{
+			server_conn_t *c = ev[i].data.ptr;
+
+			if (w->udp)
+				server_recv (w, c);
+			else
+			if (c->listening)
+				server_accept (w, c);
+			else
+			if (!server_serve (w, c))
+				server_close (c);
+		}
+
+		if (w->udp)
+			server_expire (w);
+	}
+	return NULL;
 }
 
 
-static void
-print_duration (const char *msg,
-                const struct timespec *end, const struct timespec *start,
-                unsigned long bytes)
+/* Opens the listening sockets of a worker, one per local address */
+static int server_listen (server_worker_t *w, const struct addrinfo *res)
 {
-	double duration = ((double)end->tv_sec)
-	                + ((double)end->tv_nsec) / 1000000000
-	                - ((double)start->tv_sec)
-	                - ((double)start->tv_nsec) / 1000000000;
+	for (const struct addrinfo *p = res; p != NULL; p = p->ai_next)
+	{
+		int fd = socket (p->ai_family, p->ai_socktype | SOCK_NONBLOCK
+		                 | SOCK_CLOEXEC, p->ai_protocol);
+		if (fd == -1)
+		{
+			perror ("socket");
+			continue;
+		}
 
-	printf (_("%s %lu %s in %f %s"), gettext (msg),
-	        bytes, ngettext ("byte", "bytes", bytes),
-	        duration, ngettext ("second", "seconds", duration));
-	if (duration > 0)
-		printf (_(" (%0.3f kbytes/s)"), bytes / (duration * 1024));
+		setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof (int));
+		setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof (int));
+		if (p->ai_family == AF_INET6)
+			setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){ 1 },
+			            sizeof (int));
+
+		if (w->udp)
+			udp_rx_setup (fd, !w->echo); // GRO trains cannot be echoed
+		else
+		{
+			/*
+			 * Accepted sockets inherit the buffer sizes. SO_RCVBUF and
+			 * SO_SNDBUF would cap them at rmem_max and wmem_max, below
+			 * what autotuning reaches by default, so only the privileged
+			 * variants are used.
+			 */
+			setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE,
+			            &(int){ SERVER_BUFSIZE }, sizeof (int));
+			setsockopt (fd, SOL_SOCKET, SO_SNDBUFFORCE,
+			            &(int){ SERVER_BUFSIZE }, sizeof (int));
+		}
+
+		server_conn_t *l = w->listeners + w->count;
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = l };
+
+		l->fd = fd;
+		l->listening = true;
+		if (bind (fd, p->ai_addr, p->ai_addrlen)
+		 || (!w->udp && listen (fd, SOMAXCONN))
+		 || epoll_ctl (w->epfd, EPOLL_CTL_ADD, fd, &ev))
+		{
+			char host[NI_MAXHOST], serv[NI_MAXSERV];
+			int errnum = errno;
+
+			if (getnameinfo (p->ai_addr, p->ai_addrlen, host, sizeof (host),
+			                 serv, sizeof (serv),
+			                 NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+				fprintf (stderr, _("%s port %s: %s\n"), host, serv,
+				         strerror (errnum));
+			else
+				perror ("bind");
+			close (fd);
+			continue;
+		}
+		w->count++;
+	}
+	return (w->count > 0) ? 0 : -1;
 }
 
 
 static int
-tcpspray (const char *host, const char *serv, unsigned long n, size_t blen,
-          unsigned delay_us, const char *fillname, bool echo)
+tcpspray_server (const char *host, const char *serv, bool echo, bool udp,
+                 unsigned workers, const int *cpus, unsigned ncpus)
 {
 	if (serv == NULL)
 		serv = echo ? "echo" : "discard";
 
-	int fd = tcpconnect (host, serv);
-	if (fd == -1)
-		return -1;
+	struct addrinfo hints, *res;
 
-	uint8_t block[blen];
-	memset (block, 0, blen);
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = family;
+	hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+	hints.ai_protocol = udp ? IPPROTO_UDP : IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE | AI_IDN;
 
-	if (fillname != NULL)
+	int val = getaddrinfo (host, serv, &hints, &res);
+	if (val)
 	{
-		FILE *stream = fopen (fillname, "r");
-		if (stream == NULL)
-		{
-			perror (fillname);
-			close (fd);
-			return -1;
-		}
+		fprintf (stderr, _("%s port %s: %s\n"), (host != NULL) ? host : "*",
+		         serv, gai_strerror (val));
+		return -1;
+	}
 
-		size_t res = fread (block, 1, blen, stream);
-		if (res < blen)
-		{
-			fprintf (stderr, _("Warning: \"%s\" is too small (%zu %s) "
-			           "to fill block of %zu %s.\n"), fillname,
-			         res, ngettext ("byte", "bytes", res),
-			         blen, ngettext ("byte", "bytes", blen));
-		}
-		fclose (stream);
+	unsigned naddr = 0;
+	for (const struct addrinfo *p = res; p != NULL; p = p->ai_next)
+		naddr++;
+
+	if (workers == 0)
+	{
+		long ncores = sysconf (_SC_NPROCESSORS_ONLN);
+		workers = (ncores > 0) ? ((ncores < MAX_STREAMS) ? ncores
+		                                                 : MAX_STREAMS) : 1;
 	}
 
-	if (verbose)
+	server_worker_t *tab = calloc (workers, sizeof (*tab));
+	server_conn_t *listeners = calloc (workers * naddr, sizeof (*listeners));
+	unsigned started = 0;
+
+	signal (SIGPIPE, SIG_IGN);
+
+	if ((tab == NULL) || (listeners == NULL))
 	{
-		printf (_("Sending %ju %s with blocksize %zu %s\n"),
-		        (uintmax_t)n * blen, ngettext ("byte", "bytes", n * blen),
-		        blen, ngettext ("byte", "bytes", n * blen));
+		perror ("calloc");
+		goto out;
 	}
 
-	pid_t child = -1;
-	if (echo)
+	for (; started < workers; started++)
 	{
-		child = fork ();
-		switch (child)
-		{
-			case 0:
-				for (unsigned i = 0; i < n; i++)
-				{
-					ssize_t val = recv (fd, block, blen, MSG_WAITALL);
-					if (val != (ssize_t)blen)
-					{
-						fprintf (stderr, _("Receive error: %s\n"),
-								 (val == -1) ? strerror (errno)
-							: _("Connection closed by peer"));
-						exit (1);
-					}
-
-					if (verbose)
-						fputs ("\b \b", stdout);
-				}
-				exit (0);
+		server_worker_t *w = tab + started;
 
-			case -1:
-				perror ("fork");
-				close (fd);
-				return -1;
+		w->epfd = epoll_create1 (EPOLL_CLOEXEC);
+		if (w->epfd == -1)
+		{
+			perror ("epoll_create1");
+			break;
 		}
-	}
-	else
-		shutdown (fd, SHUT_RD);
+		w->cpu = (ncpus > 0) ? cpus[started % ncpus] : -1;
+		w->echo = echo;
+		w->udp = udp;
+		w->listeners = listeners + started * naddr;
 
-	struct timespec delay_ts = { 0, 0 };
-	if (delay_us)
-	{
-		div_t d = div (delay_us, 1000000);
-		delay_ts.tv_sec = d.quot;
-		delay_ts.tv_nsec = d.rem * 1000;
-	}
+		if (udp)
+		{
+			w->rx = malloc (sizeof (*w->rx));
+			w->flows = calloc (SERVER_FLOWS, sizeof (*w->flows));
+			if ((w->rx == NULL) || (w->flows == NULL))
+			{
+				perror ("malloc");
+				close (w->epfd);
+				break;
+			}
+		}
 
-	struct timespec start, end;
-	mono_gettime (&start);
+		if (server_listen (w, res))
+		{
+			close (w->epfd);
+			break;
+		}
 
-	for (unsigned i = 0; i < n; i++)
-	{
-		ssize_t val = write (fd, block, blen);
-		if (val != (ssize_t)blen)
+		errno = pthread_create (&w->thread, NULL, server_thread, w);
+		if (errno)
 		{
-			fprintf (stderr, _("Cannot send data: %s\n"),
-			         (val == -1) ? strerror (errno)
-			                     : _("Connection closed by peer"));
-			goto abort;
+			perror ("pthread_create");
+			for (unsigned j = 0; j < w->count; j++)
+				close (w->listeners[j].fd);
+			close (w->epfd);
+			break;
 		}
+	}
 
+	if (started > 0)
+	{
 		if (verbose)
-			fputc ('.', stdout);
+			printf (ngettext ("Serving %s%s with %u worker\n",
+			                  "Serving %s%s with %u workers\n", started),
+			        udp ? "UDP " : "", echo ? "Echo" : "Discard", started);
+
+		/* Workers only return on fatal errors */
+		for (unsigned j = 0; j < started; j++)
+			pthread_join (tab[j].thread, NULL);
+	}
 
-		if (delay_us && mono_nanosleep (&delay_ts))
-			goto abort;
+out:
+	freeaddrinfo (res);
+	free (listeners);
+	for (unsigned j = 0; (tab != NULL) && (j < workers); j++)
+	{
+		free (tab[j].rx);
+		free (tab[j].flows);
 	}
+	free (tab);
+	return -1;
+}
+#endif
 
-	mono_gettime (&end);
-	shutdown (fd, SHUT_WR);
-	close (fd);
 
-	if (child != -1)
+/* Parses a list of CPU numbers and ranges, such as "0,2-5" */
+static int parse_cpus (const char *str, int *cpus, unsigned max)
+{
+	unsigned count = 0;
+
+	do
 	{
-		int status;
-		while (wait (&status) == -1);
+		char *end;
+		unsigned long first = strtoul (str, &end, 10), last = first;
 
-		if (!WIFEXITED (status) || WEXITSTATUS (status))
-		{
-			fprintf (stderr, _("Child process returned an error"));
+		if (end == str)
 			return -1;
+		if (*end == '-')
+		{
+			str = end + 1;
+			last = strtoul (str, &end, 10);
+			if ((end == str) || (last < first))
+				return -1;
 		}
+		if ((*end != ',') && (*end != '\0'))
+			return -1;
 
-		struct timespec end_recv;
-		mono_gettime (&end_recv);
-
-		print_duration (N_("Received"), &end_recv, &start, blen * n);
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+		{
+			if ((count >= max) || (cpu > INT_MAX))
+				return -1;
+			cpus[count++] = cpu;
+		}
+		str = end + 1;
 	}
-	puts ("");
+	while (str[-1] == ',');
 
-	print_duration (N_("Transmitted"), &end, &start, blen * n);
-	puts ("");
+	return count;
+}
 
-	return 0;
 
-abort:
-	close (fd);
-	if (child != -1)
+/* Parses a bit rate, with an optional k, M or G (decimal) multiplier */
+static double parse_rate (const char *str)
+{
+	char *end;
+	double rate = strtod (str, &end);
+
+	if (end == str)
+		return -1.;
+	switch (*end)
 	{
-		kill (child, SIGTERM);
-		while (wait (NULL) == -1);
+		case 'k':
+		case 'K':
+			rate *= 1e3;
+			end++;
+			break;
+		case 'M':
+			rate *= 1e6;
+			end++;
+			break;
+		case 'G':
+			rate *= 1e9;
+			end++;
+			break;
 	}
-	return -1;
+	return *end ? -1. : rate;
 }
 
 
@@ -276,21 +1991,33 @@ usage (const char *path)
 {
 	printf (_(
 "Usage: %s [options] <hostname/address> [service/port number]\n"
+"       %s -s [options] [local address] [service/port number]\n"
 "Use the discard TCP service at the specified host\n"
 "(the default host is the local system, the default service is discard)\n"),
-	        path);
+	        path, path);
 
 	puts (_("\n"
 "  -4  force usage of the IPv4 protocols family\n"
 "  -6  force usage of the IPv6 protocols family\n"
+"  -a  pin streams to the listed CPUs, in turn (e.g. 0,2-5)\n"
 "  -b  specify the block bytes size (default: 1024)\n"
 "  -d  wait for given delay (usec) between each block (default: 0)\n"
 "  -e  perform a duplex test (TCP Echo instead of TCP Discard)\n"
 "  -f  fill sent data blocks with the specified file content\n"
+"  -g  let the kernel segment UDP datagrams (UDP GSO)\n"
 "  -h  display this help and exit\n"
+"  -i  report throughput every given number of seconds\n"
 "  -n  specify the number of blocks to send (default: 100)\n"
+"  -r  send UDP datagrams at this many bits per second (e.g. 100M)\n"
+"  -s  run a Discard (or Echo with -e) server instead of a client\n"
+"  -T  report TCP congestion control information (at every -i report)\n"
+"  -t  send for the given number of seconds (and at most -n blocks)\n"
+"  -P  open this many parallel connections (default: 1),\n"
+"      or run this many server threads (default: one per CPU)\n"
+"  -u  use UDP datagrams, and measure their loss, reordering and jitter\n"
 "  -V  display program version and exit\n"
 "  -v  enable verbose output\n"
+"  -z  send without copying data (sendfile with -f, or MSG_ZEROCOPY)\n"
 	));
 
 	return 0;
@@ -318,19 +2045,29 @@ static const struct option opts[] =
 {
 	{ "ipv4",     no_argument,       NULL, '4' },
 	{ "ipv6",     no_argument,       NULL, '6' },
+	{ "affinity", required_argument, NULL, 'a' },
 	{ "bsize",    required_argument, NULL, 'b' },
 	{ "delay",    required_argument, NULL, 'd' },
 	{ "echo",     no_argument,       NULL, 'e' },
 	{ "file",     required_argument, NULL, 'f' },
 	{ "fill",     required_argument, NULL, 'f' },
+	{ "gso",      no_argument,       NULL, 'g' },
 	{ "help",     no_argument,       NULL, 'h' },
+	{ "interval", required_argument, NULL, 'i' },
 	{ "count",    required_argument, NULL, 'n' },
+	{ "parallel", required_argument, NULL, 'P' },
+	{ "rate",     required_argument, NULL, 'r' },
+	{ "server",   no_argument,       NULL, 's' },
+	{ "tcp-info", no_argument,       NULL, 'T' },
+	{ "time",     required_argument, NULL, 't' },
+	{ "udp",      no_argument,       NULL, 'u' },
 	{ "version",  no_argument,       NULL, 'V' },
 	{ "verbose",  no_argument,       NULL, 'v' },
+	{ "zerocopy", no_argument,       NULL, 'z' },
 	{ NULL,       0,                 NULL, 0   }
 };
 
-static const char optstr[] = "46b:d:ef:hn:Vv";
+static const char optstr[] = "46a:b:d:ef:ghi:n:P:r:sTt:uVvz";
 
 int main (int argc, char *argv[])
 {
@@ -338,11 +2075,19 @@ int main (int argc, char *argv[])
 	bindtextdomain (PACKAGE, LOCALEDIR);
 	textdomain (PACKAGE);
 
-	unsigned long block_count = 100;
+	unsigned long block_count = 0; // 100 unless bounded in time
 	size_t block_length = 1024;
 	unsigned delay_ms = 0;
 	bool echo = false;
 	const char *fillname = NULL;
+	unsigned streams = 0; // default depends on the mode
+	bool server = false;
+	int cpus[1024];
+	int ncpus = 0;
+	bool zerocopy = false;
+	bool udp = false, gso = false;
+	double rate = 0., duration = 0., interval = 0.;
+	bool tcpinfo = false;
 
 	int c;
 	while ((c = getopt_long (argc, argv, optstr, opts, NULL)) != EOF)
@@ -357,6 +2102,16 @@ int main (int argc, char *argv[])
 				family = AF_INET6;
 				break;
 
+			case 'a':
+				ncpus = parse_cpus (optarg, cpus,
+				                    sizeof (cpus) / sizeof (cpus[0]));
+				if (ncpus <= 0)
+				{
+					fprintf (stderr, _("%s: invalid CPU list\n"), optarg);
+					return 2;
+				}
+				break;
+
 			case 'b':
 			{
 				char *end;
@@ -401,23 +2156,108 @@ int main (int argc, char *argv[])
 				fillname = optarg;
 				break;
 
+			case 'g':
+#ifdef UDP_SEGMENT
+				gso = true;
+				break;
+#else
+				fprintf (stderr, _("UDP GSO is not supported on this "
+				                   "system.\n"));
+				return 2;
+#endif
+
 			case 'h':
 				return usage (argv[0]);
 
+			case 'i':
+			case 't':
+			{
+				char *end;
+				double value = strtod (optarg, &end);
+				/* Also rejects NaN and infinity */
+				if (*end || !(value > 0.) || !(value <= INT_MAX))
+				{
+					fprintf (stderr, _("%s: invalid duration\n"), optarg);
+					return 2;
+				}
+				*((c == 'i') ? &interval : &duration) = value;
+				break;
+			}
+
 			case 'n':
 			{
 				char *end;
 				block_count = strtoul (optarg, &end, 0);
 				if (*end)
 					errno = EINVAL;
+				else
+				if (block_count == 0)
+					errno = ERANGE;
+				if (errno)
+				{
+					perror (optarg);
+					return 2;
+				}
+				break;
+			}
+
+			case 'P':
+			{
+				char *end;
+				unsigned long value = strtoul (optarg, &end, 0);
+				if (*end)
+					errno = EINVAL;
+				else
+				if ((value == 0) || (value > MAX_STREAMS))
+					errno = ERANGE;
 				if (errno)
 				{
 					perror (optarg);
 					return 2;
 				}
+				streams = value;
 				break;
 			}
 
+			case 'r':
+				rate = parse_rate (optarg);
+				if (rate <= 0.)
+				{
+					fprintf (stderr, _("%s: invalid rate\n"), optarg);
+					return 2;
+				}
+				break;
+
+			case 's':
+#ifdef __linux__
+				server = true;
+				break;
+#else
+				fprintf (stderr, _("Server mode is not supported on this "
+				                   "system.\n"));
+				return 2;
+#endif
+
+			case 'T':
+#ifdef __linux__
+				tcpinfo = true;
+				break;
+#else
+				fprintf (stderr, _("TCP information is not available on "
+				                   "this system.\n"));
+				return 2;
+#endif
+
+			case 'u':
+#ifdef __linux__
+				udp = true;
+				break;
+#else
+				fprintf (stderr, _("UDP mode is not supported on this "
+				                   "system.\n"));
+				return 2;
+#endif
+
 			case 'V':
 				return version ();
 
@@ -426,20 +2266,69 @@ int main (int argc, char *argv[])
 					verbose++;
 				break;
 
+			case 'z':
+#ifdef __linux__
+				zerocopy = true;
+				break;
+#else
+				fprintf (stderr, _("Zero-copy is not supported on this "
+				                   "system.\n"));
+				return 2;
+#endif
+
 			case '?':
 			default:
 				return quick_usage (argv[0]);
 		}
 	}
 
-	if (optind >= argc)
+	if ((optind >= argc) && !server)
 		return quick_usage (argv[0]);
 
-	const char *hostname = argv[optind++];
+	if (!udp && (gso || (rate > 0.)))
+	{
+		fputs (_("Options -g and -r require UDP mode (-u).\n"), stderr);
+		return 2;
+	}
+#ifdef __linux__
+	if (udp && ((block_length < sizeof (udp_header_t))
+	         || (block_length > UDP_MAXLEN)))
+	{
+		fprintf (stderr, _("UDP block size must be between %zu and %u "
+		                   "bytes.\n"), sizeof (udp_header_t), UDP_MAXLEN);
+		return 2;
+	}
+#endif
+	if (udp && zerocopy)
+	{
+		fputs (_("Zero-copy is not supported in UDP mode.\n"), stderr);
+		return 2;
+	}
+	if (udp && tcpinfo)
+	{
+		fputs (_("TCP information is not available in UDP mode.\n"),
+		       stderr);
+		return 2;
+	}
+
+	const char *hostname = (optind < argc) ? argv[optind++] : NULL;
 	const char *servname = (optind < argc) ? argv[optind++] : NULL;
 
-	setvbuf (stdout, NULL, _IONBF, 0);
+	if ((block_count == 0) && (duration <= 0.))
+		block_count = 100;
+
+#ifdef __linux__
+	if (server)
+	{
+		setvbuf (stdout, NULL, _IOLBF, 0);
+		c = tcpspray_server (hostname, servname, echo, udp, streams, cpus,
+		                     ncpus);
+	}
+	else
+#endif
 	c = tcpspray (hostname, servname, block_count, block_length,
-	              delay_ms, fillname, echo);
+	              delay_ms, fillname, echo, streams ? streams : 1, cpus,
+	              ncpus, zerocopy, udp, rate, gso, duration, interval,
+	              tcpinfo);
 	return c ? 1 : 0;
 }
@@ -0,0 +1,600 @@
+/*
+ * trace-asn.c - offline prefix to AS number table for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * The table is a path-compressed binary radix trie over IPv6 prefixes,
+ * stored as an array of fixed-size nodes so that the very same layout can
+ * be written to a file and memory-mapped back as is. The first node is
+ * the root (::/0). Children are referenced by array index; index zero
+ * means no child since the root is nobody's child. Every child has a
+ * strictly longer prefix than its parent, so that lookups terminate.
+ *
+ * As the upper levels of the trie are dense, a direct-indexed table on
+ * the first 16 bits of the address (level compression) gives the node
+ * from which to resume the lookup, and the best match found so far.
+ *
+ * The binary image is a header, the stride table and the nodes, in host
+ * byte order: it is a cache meant to be compiled on the machine that
+ * uses it.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gettext.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> /* strncasecmp() */
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> /* inet_pton() */
+
+#include "traceroute.h"
+
+typedef struct asn_node
+{
+	uint8_t  prefix[16];
+	uint8_t  plen;
+	uint8_t  has_asn;
+	uint16_t reserved;
+	uint32_t asn;
+	uint32_t child[2];
+} asn_node_t;
+
+#define ASN_STRIDE_BITS 16
+#define ASN_NONE UINT32_MAX
+
+typedef struct asn_stride
+{
+	uint32_t node; // first node with a prefix of at least 16 bits
+	uint32_t best; // longest matching prefix shorter than 16 bits
+} asn_stride_t;
+
+typedef struct asn_image_header
+{
+	char     magic[8];
+	uint32_t byte_order; // ASN_BYTE_ORDER in host byte order
+	uint32_t node_size;  // sizeof (asn_node_t)
+	uint64_t count;      // number of nodes
+} asn_image_header_t;
+
+static const char asn_magic[8] = "ND6ASN\0\2";
+#define ASN_BYTE_ORDER 0x01020304
+
+struct asn_table
+{
+	const asn_node_t *nodes;
+	size_t count;
+	const asn_stride_t *stride;
+	asn_node_t *heap; // table built from text (or NULL)
+	asn_stride_t *stride_heap;
+	void *map; // memory-mapped image (or NULL)
+	size_t maplen;
+};
+
+
+static inline unsigned getbit (const uint8_t *addr, unsigned bit)
+{
+	return (addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+
+/* Number of leading bits in common, up to max */
+static unsigned common_bits (const uint8_t *a, const uint8_t *b, unsigned max)
+{
+	unsigned n = 0;
+
+	while ((n < max) && (a[n >> 3] == b[n >> 3]))
+		n += 8;
+	while ((n < max) && (getbit (a, n) == getbit (b, n)))
+		n++;
+	return (n < max) ? n : max;
+}
+
+
+static void mask_prefix (uint8_t *addr, unsigned plen)
+{
+	for (unsigned i = plen; i < 128; i++)
+		addr[i >> 3] &= ~(0x80 >> (i & 7));
+}
+
+
+/* Appends a node to a table being built */
+static uint32_t new_node (struct asn_table *t, size_t *size,
+                          const uint8_t *prefix, unsigned plen)
+{
+	if (t->count >= *size)
+	{
+		size_t n = *size ? 2 * *size : 1024;
+		asn_node_t *tab = realloc (t->heap, n * sizeof (*tab));
+		if (tab == NULL)
+			return 0;
+		t->heap = tab;
+		t->nodes = tab;
+		*size = n;
+	}
+
+	asn_node_t *node = t->heap + t->count;
+	memset (node, 0, sizeof (*node));
+	memcpy (node->prefix, prefix, 16);
+	mask_prefix (node->prefix, plen);
+	node->plen = plen;
+	return t->count++;
+}
+
+
+static int insert (struct asn_table *t, size_t *size,
+                   const uint8_t *prefix, unsigned plen, uint32_t asn)
+{
+	uint32_t parent = 0, cur = 0;
+	unsigned side = 0;
+
+	for (;;)
+	{
+		asn_node_t *node = t->heap + cur;
+		unsigned common = common_bits (prefix, node->prefix,
+		                               (plen < node->plen) ? plen : node->plen);
+
+		if (common < node->plen)
+		{
+			/* Split the edge toward the current node */
+			uint32_t mid = new_node (t, size, prefix, common);
+			if (mid == 0)
+				return -1;
+
+			node = t->heap + cur;
+			t->heap[mid].child[getbit (node->prefix, common)] = cur;
+			t->heap[parent].child[side] = mid;
+
+			if (common == plen)
+			{
+				t->heap[mid].has_asn = 1;
+				t->heap[mid].asn = asn;
+				return 0;
+			}
+
+			uint32_t leaf = new_node (t, size, prefix, plen);
+			if (leaf == 0)
+				return -1;
+			t->heap[leaf].has_asn = 1;
+			t->heap[leaf].asn = asn;
+			t->heap[mid].child[getbit (prefix, common)] = leaf;
+			return 0;
+		}
+
+		if (plen == node->plen)
+		{
+			node->has_asn = 1; // latest entry wins
+			node->asn = asn;
+			return 0;
+		}
+
+		side = getbit (prefix, node->plen);
+		parent = cur;
+		cur = node->child[side];
+		if (cur == 0)
+		{
+			uint32_t leaf = new_node (t, size, prefix, plen);
+			if (leaf == 0)
+				return -1;
+			t->heap[leaf].has_asn = 1;
+			t->heap[leaf].asn = asn;
+			t->heap[parent].child[side] = leaf;
+			return 0;
+		}
+	}
+}
+
+
+/**
+ * Parses one "prefix/length ASN" line.
+ * @return 1 if an entry was parsed, 0 if the line must be ignored,
+ * -1 if it is malformed.
+ */
+static int parse_line (char *line, uint8_t *prefix, unsigned *plen,
+                       uint32_t *asn)
+{
+	char *p = strchr (line, '#');
+	if (p != NULL)
+		*p = '\0';
+
+	char *addr = strtok_r (line, " \t\r\n", &p);
+	if (addr == NULL)
+		return 0; // blank line or comment
+	if (strchr (addr, ':') == NULL)
+		return 0; // not IPv6 (IPv4 entries from mixed tables)
+
+	char *str = strtok_r (NULL, " \t\r\n", &p);
+	if (str == NULL)
+		return -1;
+	if (!strncasecmp (str, "AS", 2))
+		str += 2;
+
+	char *slash = strchr (addr, '/'), *end;
+	if (slash == NULL)
+		return -1;
+	*slash++ = '\0';
+
+	unsigned long l = strtoul (slash, &end, 10);
+	if (*end || (end == slash) || (l > 128))
+		return -1;
+	*plen = l;
+
+	if (inet_pton (AF_INET6, addr, prefix) != 1)
+		return -1;
+
+	/* Only the first origin AS of a set is kept */
+	unsigned long long u = strtoull (str, &end, 10);
+	if ((end == str) || (*end && !strchr (",_{}", *end))
+	 || (u > UINT32_MAX) || !isdigit ((unsigned char)*str))
+		return -1;
+	*asn = u;
+	return 1;
+}
+
+
+/*
+ * Renumbers nodes in breadth-first order, so that the upper levels of the
+ * trie, which every lookup goes through, share as few cache lines as
+ * possible.
+ */
+static int reorder (asn_table_t *t)
+{
+	asn_node_t *tab = malloc (t->count * sizeof (*tab));
+	if (tab == NULL)
+		return -1;
+
+	size_t head = 0, tail = 1;
+	tab[0] = t->heap[0];
+
+	while (head < tail)
+	{
+		asn_node_t *node = tab + head++;
+
+		for (unsigned i = 0; i < 2; i++)
+			if (node->child[i])
+			{
+				tab[tail] = t->heap[node->child[i]];
+				node->child[i] = tail++;
+			}
+	}
+
+	free (t->heap);
+	t->heap = tab;
+	t->nodes = tab;
+	return 0;
+}
+
+
+static int build_stride (asn_table_t *t)
+{
+	asn_stride_t *stride = malloc (sizeof (*stride) << ASN_STRIDE_BITS);
+	if (stride == NULL)
+		return -1;
+
+	for (uint32_t v = 0; v < (1 << ASN_STRIDE_BITS); v++)
+	{
+		const uint8_t key[16] = { v >> 8, v & 0xff };
+		uint32_t cur = 0;
+
+		stride[v].node = stride[v].best = ASN_NONE;
+
+		for (;;)
+		{
+			const asn_node_t *node = t->nodes + cur;
+
+			if (node->plen >= ASN_STRIDE_BITS)
+			{
+				stride[v].node = cur;
+				break;
+			}
+			if (common_bits (key, node->prefix, node->plen) < node->plen)
+				break;
+			if (node->has_asn)
+				stride[v].best = cur;
+
+			cur = node->child[getbit (key, node->plen)];
+			if (cur == 0)
+				break;
+		}
+	}
+
+	t->stride_heap = stride;
+	t->stride = stride;
+	return 0;
+}
+
+
+static asn_table_t *asn_load_text (FILE *stream, const char *path)
+{
+	asn_table_t *t = calloc (1, sizeof (*t));
+	size_t size = 0;
+	char buf[256];
+	unsigned lineno = 0;
+	static const uint8_t any[16];
+
+	if ((t == NULL) || (new_node (t, &size, any, 0) != 0)
+	 || (t->count == 0))
+	{
+		perror (path);
+		asn_close (t);
+		return NULL;
+	}
+
+	while (fgets (buf, sizeof (buf), stream) != NULL)
+	{
+		uint8_t prefix[16];
+		unsigned plen;
+		uint32_t asn;
+
+		lineno++;
+		switch (parse_line (buf, prefix, &plen, &asn))
+		{
+			case 1:
+				if (insert (t, &size, prefix, plen, asn))
+					goto error;
+				break;
+
+			case -1:
+				fprintf (stderr, _("%s: line %u: invalid prefix entry\n"),
+				         path, lineno);
+				asn_close (t);
+				return NULL;
+		}
+	}
+
+	if (ferror (stream) || reorder (t) || build_stride (t))
+		goto error;
+	return t;
+
+error:
+	perror (path);
+	asn_close (t);
+	return NULL;
+}
+
+
+static asn_table_t *asn_load_image (int fd, const char *path)
+{
+	struct stat st;
+	asn_table_t *t = calloc (1, sizeof (*t));
+
+	if ((t == NULL) || fstat (fd, &st))
+	{
+		perror (path);
+		free (t);
+		return NULL;
+	}
+
+	t->maplen = st.st_size;
+	t->map = mmap (NULL, t->maplen, PROT_READ, MAP_SHARED, fd, 0);
+	if (t->map == MAP_FAILED)
+	{
+		perror (path);
+		free (t);
+		return NULL;
+	}
+
+	/* Checks the image, as lookups trust it */
+	const asn_image_header_t *hdr = t->map;
+	if (t->maplen < sizeof (*hdr))
+		goto error;
+
+	const size_t stride_size = sizeof (asn_stride_t) << ASN_STRIDE_BITS;
+	t->stride = (const asn_stride_t *)(hdr + 1);
+	t->nodes = (const asn_node_t *)(t->stride + (1 << ASN_STRIDE_BITS));
+	t->count = hdr->count;
+
+	if ((hdr->byte_order != ASN_BYTE_ORDER)
+	 || (hdr->node_size != sizeof (asn_node_t))
+	 || (hdr->count == 0)
+	 || (t->maplen < sizeof (*hdr) + stride_size)
+	 || (hdr->count > (t->maplen - sizeof (*hdr) - stride_size)
+	                  / sizeof (asn_node_t))
+	 || (t->maplen != sizeof (*hdr) + stride_size
+	                  + hdr->count * sizeof (asn_node_t)))
+		goto error;
+
+	for (size_t i = 0; i < (1 << ASN_STRIDE_BITS); i++)
+	{
+		const asn_stride_t *e = t->stride + i;
+
+		if (((e->node != ASN_NONE) && ((e->node >= t->count)
+		  || (t->nodes[e->node].plen < ASN_STRIDE_BITS)))
+		 || ((e->best != ASN_NONE) && (e->best >= t->count)))
+			goto error;
+	}
+
+	for (size_t i = 0; i < t->count; i++)
+	{
+		const asn_node_t *node = t->nodes + i;
+
+		if (node->plen > 128)
+			goto error;
+		for (unsigned j = 0; j < 2; j++)
+			if (node->child[j]
+			 && ((node->child[j] >= t->count)
+			  || (t->nodes[node->child[j]].plen <= node->plen)))
+				goto error;
+	}
+	return t;
+
+error:
+	fprintf (stderr, _("%s: invalid prefix table image\n"), path);
+	asn_close (t);
+	return NULL;
+}
+
+
+/**
+ * Loads a prefix to AS number table, either from text ("prefix/length ASN"
+ * lines) or from an image written by asn_compile().
+ */
+asn_table_t *asn_open (const char *path)
+{
+	int fd = open (path, O_RDONLY);
+	if (fd == -1)
+	{
+		perror (path);
+		return NULL;
+	}
+
+	char magic[sizeof (asn_magic)];
+	asn_table_t *t;
+
+	if ((read (fd, magic, sizeof (magic)) == sizeof (magic))
+	 && !memcmp (magic, asn_magic, sizeof (magic)))
+	{
+		t = asn_load_image (fd, path);
+		close (fd); // the mapping remains
+		return t;
+	}
+
+	FILE *stream = (lseek (fd, 0, SEEK_SET) == 0) ? fdopen (fd, "r") : NULL;
+	if (stream == NULL)
+	{
+		perror (path);
+		close (fd);
+		return NULL;
+	}
+
+	t = asn_load_text (stream, path);
+	fclose (stream);
+	return t;
+}
+
+
+void asn_close (asn_table_t *t)
+{
+	if (t == NULL)
+		return;
+	if (t->map != NULL)
+		munmap (t->map, t->maplen);
+	free (t->stride_heap);
+	free (t->heap);
+	free (t);
+}
+
+
+/**
+ * Writes a table as a binary image, that asn_open() memory-maps.
+ */
+int asn_compile (const asn_table_t *t, const char *path)
+{
+	asn_image_header_t hdr;
+	FILE *stream = fopen (path, "wb");
+
+	if (stream == NULL)
+	{
+		perror (path);
+		return -1;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, asn_magic, sizeof (hdr.magic));
+	hdr.byte_order = ASN_BYTE_ORDER;
+	hdr.node_size = sizeof (asn_node_t);
+	hdr.count = t->count;
+
+	if ((fwrite (&hdr, sizeof (hdr), 1, stream) != 1)
+	 || (fwrite (t->stride, sizeof (asn_stride_t), 1 << ASN_STRIDE_BITS,
+	             stream) != (1 << ASN_STRIDE_BITS))
+	 || (fwrite (t->nodes, sizeof (asn_node_t), t->count, stream)
+	      != t->count))
+	{
+		perror (path);
+		fclose (stream);
+		return -1;
+	}
+
+	if (fclose (stream))
+	{
+		perror (path);
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Finds the longest prefix matching an address.
+ * @return true if found, false otherwise.
+ */
+bool asn_lookup (const asn_table_t *t, const struct in6_addr *addr,
+                 uint32_t *asn, struct in6_addr *prefix, unsigned *plen)
+{
+	const uint8_t *a = addr->s6_addr;
+	const asn_stride_t *e = t->stride + ((a[0] << 8) | a[1]);
+	const asn_node_t *best = NULL;
+
+	if (e->node != ASN_NONE)
+	{
+		const asn_node_t *node = t->nodes + e->node, *path[129];
+		unsigned depth = 0;
+
+		/*
+		 * Descends testing only one bit per node. Every node prefix extends
+		 * its parent's, so a single comparison with the deepest node then
+		 * tells which of the prefixes along the path actually match.
+		 */
+		for (;;)
+		{
+			if (node->has_asn)
+				path[depth++] = node;
+			if (node->plen >= 128)
+				break;
+
+			uint32_t next = node->child[getbit (a, node->plen)];
+			if (next == 0)
+				break;
+			node = t->nodes + next;
+		}
+
+		unsigned common = common_bits (a, node->prefix, node->plen);
+
+		while (depth > 0)
+			if (path[--depth]->plen <= common)
+			{
+				best = path[depth];
+				break;
+			}
+	}
+
+	if ((best == NULL) && (e->best != ASN_NONE))
+		best = t->nodes + e->best;
+	if (best == NULL)
+		return false;
+
+	*asn = best->asn;
+	memcpy (prefix->s6_addr, best->prefix, 16);
+	*plen = best->plen;
+	return true;
+}
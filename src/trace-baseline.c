@@ -0,0 +1,389 @@
+/*
+ * trace-baseline.c - stored traces for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * A baseline is the output of a previous run, in any output format:
+ * binary records, JSON lines or text (preferably with -n). Only the hop
+ * addresses and round-trip times are kept, for every destination, sorted
+ * by destination address.
+ *
+ * The JSON and text parsers are deliberately lax: they only look for
+ * what the output functions write, and ignore anything else.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> /* inet_pton() */
+
+#include "traceroute.h"
+
+struct trace_baseline
+{
+	trace_path_t *tab;
+	size_t count;
+};
+
+
+static trace_path_t *path_new (trace_baseline_t *b,
+                               const struct in6_addr *dst)
+{
+	trace_path_t *tab = realloc (b->tab, (b->count + 1) * sizeof (*tab));
+	if (tab == NULL)
+		return NULL;
+	b->tab = tab;
+
+	trace_path_t *p = tab + b->count++;
+	memset (p, 0, sizeof (*p));
+	p->dst = *dst;
+	return p;
+}
+
+
+/* Returns the hop at the given hop limit, extending the path if needed */
+static trace_path_hop_t *path_hop (trace_path_t *p, unsigned hlim)
+{
+	if ((hlim == 0) || (hlim > 255))
+		return NULL;
+
+	if (hlim > p->hops)
+	{
+		trace_path_hop_t *hop = realloc (p->hop, hlim * sizeof (*hop));
+		if (hop == NULL)
+			return NULL;
+
+		for (unsigned i = p->hops; i < hlim; i++)
+		{
+			hop[i].count = 0;
+			hop[i].rtt = -1;
+		}
+		p->hop = hop;
+		p->hops = hlim;
+	}
+	return p->hop + (hlim - 1);
+}
+
+
+static void path_add (trace_path_t *p, unsigned hlim,
+                      const struct in6_addr *addr, int64_t rtt)
+{
+	trace_path_hop_t *hop = path_hop (p, hlim);
+	if (hop == NULL)
+		return;
+	if (addr == NULL)
+		return; // no response
+
+	if (!path_hop_has (hop, addr) && (hop->count < TRACE_PATH_ADDRS))
+		hop->addr[hop->count++] = *addr;
+	if ((rtt >= 0) && ((hop->rtt < 0) || (rtt < hop->rtt)))
+		hop->rtt = rtt;
+	if (!memcmp (addr, &p->dst, 16) && ((p->reached == 0)
+	                                 || (hlim < p->reached)))
+		p->reached = hlim;
+}
+
+
+bool path_hop_has (const trace_path_hop_t *hop, const struct in6_addr *addr)
+{
+	for (unsigned i = 0; i < hop->count; i++)
+		if (!memcmp (hop->addr + i, addr, 16))
+			return true;
+	return false;
+}
+
+
+static int read_binary (trace_baseline_t *b, FILE *in)
+{
+	trace_path_t *p = NULL;
+	trace_record_t rec;
+	int val;
+
+	while ((val = trace_record_read (in, &rec)) > 0)
+		switch (rec.kind)
+		{
+			case TRACE_RECORD_TRACE:
+				p = path_new (b, &rec.addr);
+				if (p == NULL)
+					return -1;
+				break;
+
+			case TRACE_RECORD_HOP:
+				if (p == NULL)
+					break;
+				if (rec.result == TRACE_TIMEOUT)
+					path_add (p, rec.hlim, NULL, -1);
+				else
+					path_add (p, rec.hlim, &rec.addr, rec.rcvd - rec.sent);
+				break;
+		}
+
+	return val;
+}
+
+
+/**
+ * Parses a time in milliseconds with decimals, as printed by the output
+ * functions, regardless of the locale.
+ * @return the time in nanoseconds, or -1 if there is no such number.
+ */
+static int64_t parse_ms (const char *str, char **end)
+{
+	unsigned long ms = strtoul (str, end, 10);
+	if ((*end == str) || (**end != '.') || !isdigit ((unsigned char)(*end)[1]))
+		return -1;
+
+	int64_t ns = (int64_t)ms * 1000000;
+	unsigned scale = 100000;
+	const char *p = *end + 1;
+
+	for (; isdigit ((unsigned char)*p); p++)
+	{
+		ns += (*p - '0') * scale;
+		scale /= 10;
+	}
+	*end = (char *)p;
+	return ns;
+}
+
+
+/* Parses the quoted IPv6 address after a JSON member name */
+static bool json_addr (const char *str, const char *name,
+                       struct in6_addr *addr)
+{
+	const char *s = strstr (str, name);
+	if (s == NULL)
+		return false;
+	s += strlen (name);
+
+	char buf[INET6_ADDRSTRLEN];
+	size_t len = strcspn (s, "\"");
+	if (len >= sizeof (buf))
+		return false;
+	memcpy (buf, s, len);
+	buf[len] = '\0';
+	return inet_pton (AF_INET6, buf, addr) == 1;
+}
+
+
+static int read_json (trace_baseline_t *b, trace_path_t **pp, char *line)
+{
+	struct in6_addr addr;
+
+	if (strstr (line, "\"type\":\"trace\"") != NULL)
+	{
+		if (!json_addr (line, "\"dst\":\"", &addr))
+			return 0;
+		*pp = path_new (b, &addr);
+		return (*pp != NULL) ? 0 : -1;
+	}
+
+	const char *s = strstr (line, "\"ttl\":");
+	if ((strstr (line, "\"type\":\"hop\"") == NULL) || (s == NULL)
+	 || (*pp == NULL))
+		return 0;
+
+	unsigned hlim = strtoul (s + 6, NULL, 10);
+
+	/* One probe per "result" member, with its own address first */
+	s = strstr (line, "\"result\":\"");
+	while (s != NULL)
+	{
+		char *next = strstr (s + 1, "\"result\":\"");
+		if (next != NULL)
+			*next = '\0';
+
+		if (json_addr (s, "\"addr\":\"", &addr))
+		{
+			const char *r = strstr (s, "\"rtt\":");
+			char *end;
+			path_add (*pp, hlim, &addr, (r != NULL) ? parse_ms (r + 6, &end)
+			                                        : -1);
+		}
+		else
+			path_add (*pp, hlim, NULL, -1);
+
+		if (next != NULL)
+			*next = '"';
+		s = next;
+	}
+	return 0;
+}
+
+
+static int read_text (trace_baseline_t *b, trace_path_t **pp, char *line)
+{
+	struct in6_addr addr;
+	char *s, *end;
+
+	if (!isspace ((unsigned char)*line) && !isdigit ((unsigned char)*line))
+	{
+		/* "traceroute to name (address) ..." in whatever language */
+		s = strchr (line, '(');
+		end = (s != NULL) ? strchr (s, ')') : NULL;
+		if (end == NULL)
+			return 0;
+		*end = '\0';
+		if (inet_pton (AF_INET6, s + 1, &addr) != 1)
+			return 0;
+		*pp = path_new (b, &addr);
+		return (*pp != NULL) ? 0 : -1;
+	}
+
+	unsigned long hlim = strtoul (line, &end, 10);
+	if ((end == line) || (*pp == NULL))
+		return 0;
+
+	bool known = false;
+	int depth = 0;
+	char *tok, *saveptr;
+
+	for (tok = strtok_r (end, " \t\n", &saveptr); tok != NULL;
+	     tok = strtok_r (NULL, " \t\n", &saveptr))
+	{
+		/* Skips extensions <...> and AS numbers [...] */
+		if ((*tok == '<') || (*tok == '['))
+			depth++;
+		if (depth > 0)
+		{
+			size_t len = strlen (tok);
+			if ((tok[len - 1] == '>') || (tok[len - 1] == ']'))
+				depth--;
+			continue;
+		}
+
+		if (!strcmp (tok, "*"))
+		{
+			path_add (*pp, hlim, NULL, -1);
+			continue;
+		}
+
+		/* Either "address" or "name (address)" */
+		if (*tok == '(')
+		{
+			tok++;
+			tok[strcspn (tok, ")")] = '\0';
+			if (inet_pton (AF_INET6, tok, &addr) == 1)
+				known = true;
+			continue; // or a received hop limit
+		}
+		if (inet_pton (AF_INET6, tok, &addr) == 1)
+		{
+			known = true;
+			continue;
+		}
+
+		/* Round-trip times are the only numbers with decimals */
+		int64_t rtt = parse_ms (tok, &end);
+		if ((rtt >= 0) && (*end == '\0') && known)
+			path_add (*pp, hlim, &addr, rtt);
+	}
+	return 0;
+}
+
+
+static int cmp_path (const void *a, const void *b)
+{
+	const trace_path_t *pa = a, *pb = b;
+	return memcmp (&pa->dst, &pb->dst, 16);
+}
+
+
+trace_baseline_t *baseline_open (const char *path)
+{
+	FILE *in = strcmp (path, "-") ? fopen (path, "rb") : stdin;
+	if (in == NULL)
+		return NULL;
+
+	trace_baseline_t *b = malloc (sizeof (*b));
+	if (b == NULL)
+		goto error;
+	b->tab = NULL;
+	b->count = 0;
+
+	int c = getc (in);
+	ungetc (c, in);
+
+	if (c == TRACE_RECORD_VERSION)
+	{
+		if (read_binary (b, in))
+			goto error;
+	}
+	else
+	{
+		trace_path_t *p = NULL;
+		char *line = NULL;
+		size_t size = 0;
+
+		while (getline (&line, &size, in) != -1)
+		{
+			int val = (*line == '{') ? read_json (b, &p, line)
+			                         : read_text (b, &p, line);
+			if (val)
+			{
+				free (line);
+				goto error;
+			}
+		}
+		free (line);
+		if (ferror (in))
+			goto error;
+	}
+
+	if (in != stdin)
+		fclose (in);
+	if (b->count > 0)
+		qsort (b->tab, b->count, sizeof (*b->tab), cmp_path);
+	return b;
+
+error:
+	if (b != NULL)
+		baseline_close (b);
+	if (in != stdin)
+		fclose (in);
+	return NULL;
+}
+
+
+void baseline_close (trace_baseline_t *b)
+{
+	for (size_t i = 0; i < b->count; i++)
+		free (b->tab[i].hop);
+	free (b->tab);
+	free (b);
+}
+
+
+const trace_path_t *baseline_lookup (const trace_baseline_t *b,
+                                     const struct in6_addr *dst)
+{
+	trace_path_t key = { .dst = *dst };
+
+	if (b->count == 0)
+		return NULL;
+	return bsearch (&key, b->tab, b->count, sizeof (*b->tab), cmp_path);
+}
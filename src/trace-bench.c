@@ -0,0 +1,449 @@
+/*
+ * trace-bench.c - benchmark and fuzzing harness for traceroute parsers
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * This program feeds ICMPv6 errors and probe responses to the rltraceroute6
+ * receive path, without any socket. Each sample is framed as follows:
+ *  - one byte selecting the probe type (see types[] below),
+ *  - one byte of flags (bit 0 set for a response from the destination,
+ *    clear for an ICMPv6 error from an intermediate hop),
+ *  - the received packet, starting with the ICMPv6 or upper-layer header.
+ * The destination is always 2001:db8::1, port 33434.
+ *
+ * Without arguments, a built-in corpus is synthesized from the real probe
+ * senders, including extension headers chains and truncated quotes.
+ * Sample files can be specified on the command line instead.
+ *
+ * When built with -DFUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION and
+ * -fsanitize=fuzzer, this is a libFuzzer target; use -w to write the
+ * built-in corpus as seed files.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+
+#include "gettime.h"
+#include "traceroute.h"
+
+bool ecn = false;
+uint16_t sport, ident;
+
+static const tracetype *const types[] =
+{
+	&udp_type, &udplite_type, &echo_type, &syn_type, &ack_type,
+};
+#define NTYPES (sizeof (types) / sizeof (types[0]))
+
+static struct sockaddr_in6 dst =
+{
+	.sin6_family = AF_INET6,
+	.sin6_addr = { { { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+	                   0, 0, 0, 0, 0, 0, 0, 1 } } },
+};
+
+#define MAX_SAMPLE 1242
+
+typedef struct
+{
+	size_t len;
+	uint8_t data[MAX_SAMPLE];
+} sample_t;
+
+static sample_t *corpus = NULL;
+static size_t corpus_len = 0, corpus_size = 0;
+
+
+/* Captures probes instead of sending them */
+static uint8_t probe_buf[1232];
+static size_t probe_len;
+
+ssize_t send_payload (int fd, const void *payload, size_t length, int hlim)
+{
+	(void)fd; (void)hlim;
+
+	if (length > sizeof (probe_buf))
+		length = sizeof (probe_buf);
+	memcpy (probe_buf, payload, length);
+	probe_len = length;
+	return 0;
+}
+
+
+static int run_sample (const uint8_t *data, size_t len)
+{
+	if ((len < 2) || (len > MAX_SAMPLE))
+		return 0;
+
+	const tracetype *type = types[data[0] % NTYPES];
+	bool resp = data[1] & 1;
+	union
+	{
+		struct icmp6_hdr hdr;
+		uint8_t buf[MAX_SAMPLE];
+	} pkt;
+	tracetest_t res;
+	int id = -1, hlim = -1;
+
+	len -= 2;
+	memcpy (&pkt, data + 2, len);
+	memset (&res, 0, sizeof (res));
+	res.addr = dst;
+	res.addr.sin6_addr.s6_addr[15] = 0xfe;
+
+	if (resp)
+		return proto_parse (type, &pkt, len, &res, &id, &hlim, &dst);
+	return icmp_parse (type, &pkt, len, &res, &id, &hlim, &dst);
+}
+
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t len)
+{
+	if (sport == 0)
+	{
+		sport = htons (34567);
+		ident = 0xbeef;
+		dst.sin6_port = htons (33434);
+	}
+	run_sample (data, len);
+	return 0;
+}
+
+
+static sample_t *add_sample (unsigned typeidx, bool resp)
+{
+	if (corpus_len >= corpus_size)
+	{
+		size_t n = corpus_size ? (2 * corpus_size) : 256;
+		sample_t *tab = realloc (corpus, n * sizeof (*tab));
+		if (tab == NULL)
+		{
+			perror ("realloc");
+			exit (1);
+		}
+		corpus = tab;
+		corpus_size = n;
+	}
+
+	sample_t *s = corpus + corpus_len++;
+	s->data[0] = typeidx;
+	s->data[1] = resp;
+	s->len = 2;
+	return s;
+}
+
+
+static void append (sample_t *s, const void *data, size_t len)
+{
+	if (len > MAX_SAMPLE - s->len)
+		len = MAX_SAMPLE - s->len;
+	memcpy (s->data + s->len, data, len);
+	s->len += len;
+}
+
+
+/* Appends an ICMPv6 error header and the quoted IPv6 header */
+static void
+append_error (sample_t *s, uint8_t type, uint8_t code, uint8_t nxt,
+              const struct in6_addr *qdst, size_t qlen)
+{
+	struct icmp6_hdr ih;
+	struct ip6_hdr ip6;
+
+	memset (&ih, 0, sizeof (ih));
+	ih.icmp6_type = type;
+	ih.icmp6_code = code;
+	append (s, &ih, sizeof (ih));
+
+	memset (&ip6, 0, sizeof (ip6));
+	ip6.ip6_vfc = 0x60;
+	ip6.ip6_plen = htons (qlen);
+	ip6.ip6_nxt = nxt;
+	ip6.ip6_hlim = 1;
+	ip6.ip6_dst = *qdst;
+	append (s, &ip6, sizeof (ip6));
+}
+
+
+static void build_corpus (void)
+{
+	for (unsigned t = 0; t < NTYPES; t++)
+	{
+		const tracetype *type = types[t];
+		uint8_t proto = type->protocol;
+
+		for (unsigned ttl = 1; ttl <= 16; ttl++)
+			for (unsigned n = 0; n < 3; n++)
+			{
+				type->send_probe (-1, ttl, (ttl << 8) | n, 32,
+				                  dst.sin6_port);
+
+				/* Time exceeded, full quote */
+				sample_t *s = add_sample (t, false);
+				append_error (s, ICMP6_TIME_EXCEEDED,
+				              ICMP6_TIME_EXCEED_TRANSIT, proto,
+				              &dst.sin6_addr, probe_len);
+				append (s, probe_buf, probe_len);
+
+				/* Port unreachable from the destination */
+				s = add_sample (t, false);
+				append_error (s, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOPORT,
+				              proto, &dst.sin6_addr, probe_len);
+				append (s, probe_buf, probe_len);
+
+				/* Truncated quotes */
+				static const size_t cuts[] = { 8, 4, 0 };
+				for (unsigned i = 0; i < 3; i++)
+				{
+					s = add_sample (t, false);
+					append_error (s, ICMP6_TIME_EXCEEDED,
+					              ICMP6_TIME_EXCEED_TRANSIT, proto,
+					              &dst.sin6_addr, probe_len);
+					append (s, probe_buf, cuts[i]);
+				}
+
+				/* Extension headers chain: Hop-by-hop, Destination,
+				 * Type 0 Routing (one segment left) and Fragment */
+				struct in6_addr mid = dst.sin6_addr;
+				mid.s6_addr[15] = 0x80 + ttl;
+
+				uint8_t ext[8 + 8 + 24 + 8];
+				memset (ext, 0, sizeof (ext));
+				ext[0] = IPPROTO_DSTOPTS;
+				ext[8] = IPPROTO_ROUTING;
+				ext[16] = IPPROTO_FRAGMENT;
+				ext[17] = 2;
+				ext[19] = 1;
+				memcpy (ext + 24, &dst.sin6_addr, 16);
+				ext[40] = proto;
+
+				s = add_sample (t, false);
+				append_error (s, ICMP6_TIME_EXCEEDED,
+				              ICMP6_TIME_EXCEED_TRANSIT, IPPROTO_HOPOPTS,
+				              &mid, sizeof (ext) + probe_len);
+				append (s, ext, sizeof (ext));
+				append (s, probe_buf, probe_len);
+
+				/* Same chain, truncated within the Routing header */
+				s = add_sample (t, false);
+				append_error (s, ICMP6_TIME_EXCEEDED,
+				              ICMP6_TIME_EXCEED_TRANSIT, IPPROTO_HOPOPTS,
+				              &mid, sizeof (ext) + probe_len);
+				append (s, ext, 28);
+
+				/* Same chain, with more segments left than Routing header
+				 * addresses, so that the last one would be read from past
+				 * the end of the sample buffer */
+				ext[19] = (MAX_SAMPLE - 56) / 16;
+				s = add_sample (t, false);
+				append_error (s, ICMP6_TIME_EXCEEDED,
+				              ICMP6_TIME_EXCEED_TRANSIT, IPPROTO_HOPOPTS,
+				              &mid, sizeof (ext) + probe_len);
+				append (s, ext, sizeof (ext));
+				append (s, probe_buf, probe_len);
+
+				/* Extended time exceeded (RFC 4884) with an MPLS label
+				 * stack (RFC 4950), quote padded to 128 bytes */
+				static const uint8_t mpls[] =
+				{
+					0x20, 0, 0, 0, /* version 2, no checksum */
+					0, 12, 1, 1, /* MPLS Label Stack object */
+					0x05, 0xdc, 0x60, 0x01, 0x00, 0x00, 0x31, 0xff,
+				};
+				uint8_t pad[128 - sizeof (struct ip6_hdr)];
+
+				memset (pad, 0, sizeof (pad));
+				memcpy (pad, probe_buf,
+				        (probe_len < sizeof (pad)) ? probe_len : sizeof (pad));
+
+				s = add_sample (t, false);
+				append_error (s, ICMP6_TIME_EXCEEDED,
+				              ICMP6_TIME_EXCEED_TRANSIT, proto,
+				              &dst.sin6_addr, probe_len);
+				s->data[2 + 4] = 128 >> 3; /* original datagram length */
+				append (s, pad, sizeof (pad));
+				append (s, mpls, sizeof (mpls));
+
+				/* Responses from the destination */
+				if (type->parse_resp == NULL)
+					continue;
+
+				s = add_sample (t, true);
+				if (proto == IPPROTO_ICMPV6)
+				{
+					struct icmp6_hdr *ih = (void *)probe_buf;
+					ih->icmp6_type = ICMP6_ECHO_REPLY;
+				}
+				else
+				{
+					struct tcphdr *th = (void *)probe_buf;
+					uint16_t port = th->th_sport;
+
+					th->th_sport = th->th_dport;
+					th->th_dport = port;
+					if (th->th_flags & TH_SYN)
+					{
+						th->th_ack = htonl (ntohl (th->th_seq) + 1);
+						th->th_flags = TH_SYN | TH_ACK;
+					}
+					else
+					{
+						th->th_seq = th->th_ack;
+						th->th_flags = TH_RST;
+					}
+				}
+				append (s, probe_buf, probe_len);
+			}
+	}
+}
+
+
+static int load_sample (const char *path)
+{
+	FILE *stream = fopen (path, "rb");
+	if (stream == NULL)
+	{
+		perror (path);
+		return -1;
+	}
+
+	sample_t *s = add_sample (0, false);
+	s->len = fread (s->data, 1, sizeof (s->data), stream);
+	fclose (stream);
+	return 0;
+}
+
+
+static int write_corpus (const char *dir)
+{
+	for (size_t i = 0; i < corpus_len; i++)
+	{
+		char path[strlen (dir) + 16];
+		snprintf (path, sizeof (path), "%s/%06zu", dir, i);
+
+		FILE *stream = fopen (path, "wb");
+		if (stream == NULL)
+		{
+			perror (path);
+			return -1;
+		}
+		fwrite (corpus[i].data, 1, corpus[i].len, stream);
+		fclose (stream);
+	}
+	return 0;
+}
+
+
+static int usage (const char *path)
+{
+	printf (
+"Usage: %s [options] [sample files...]\n"
+"Benchmark the rltraceroute6 receive path parsers\n"
+"\n"
+"  -h  display this help and exit\n"
+"  -n  number of passes over the corpus (default: 10000)\n"
+"  -w  write the built-in corpus to the specified directory and exit\n",
+	        path);
+	return 0;
+}
+
+
+#ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+int main (int argc, char *argv[])
+{
+	unsigned long passes = 10000;
+	const char *outdir = NULL;
+	int c;
+
+	sport = htons (34567);
+	ident = 0xbeef;
+	dst.sin6_port = htons (33434);
+
+	while ((c = getopt (argc, argv, "hn:w:")) != -1)
+		switch (c)
+		{
+			case 'h':
+				return usage (argv[0]);
+
+			case 'n':
+				passes = strtoul (optarg, NULL, 0);
+				break;
+
+			case 'w':
+				outdir = optarg;
+				break;
+
+			default:
+				return 2;
+		}
+
+	if (optind < argc)
+	{
+		while (optind < argc)
+			if (load_sample (argv[optind++]))
+				return 1;
+	}
+	else
+		build_corpus ();
+
+	if (outdir != NULL)
+		return write_corpus (outdir) ? 1 : 0;
+
+	unsigned long results[4] = { 0, 0, 0, 0 };
+	for (size_t i = 0; i < corpus_len; i++)
+		results[run_sample (corpus[i].data, corpus[i].len) & 3]++;
+
+	struct timespec start, end;
+	mono_gettime (&start);
+	for (unsigned long p = 0; p < passes; p++)
+		for (size_t i = 0; i < corpus_len; i++)
+			run_sample (corpus[i].data, corpus[i].len);
+	mono_gettime (&end);
+
+	double total = (double)passes * corpus_len;
+	double secs = (end.tv_sec - start.tv_sec)
+	            + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf ("%zu samples: %lu ignored, %lu accepted, %lu final\n",
+	        corpus_len, results[0], results[1], results[2] + results[3]);
+	if (secs > 0 && total > 0)
+		printf ("%.0f packets in %f seconds: %.0f packets/s, "
+		        "%.1f ns/packet\n", total, secs, total / secs,
+		        secs * 1e9 / total);
+	free (corpus);
+	return 0;
+}
+#endif
@@ -0,0 +1,470 @@
+/*
+ * trace-graph.c - topology graph aggregation for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * Nodes are hop addresses, edges link the responding hops of consecutive
+ * hop limits (or across silent hops) within a trace. Both are stored in
+ * arrays, indexed by open addressing hash tables of 32-bits indices.
+ *
+ * Every traversal of an edge logs one sample: the smallest round-trip
+ * time to the far end of the edge within that trace. The samples are
+ * sorted by edge once, when the graph is written, to get exact medians.
+ *
+ * The binary format is a sequence of 24-bytes units in network byte order:
+ *  - header: "ND6GRAPH", version (1), node count, edge count, zero;
+ *  - one per node: IPv6 address, index of the first outgoing edge, and
+ *    number of outgoing edges;
+ *  - one per edge, grouped by origin node: destination node index, trace
+ *    count, hop count, minimum and median round-trip times in
+ *    microseconds, zero.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> /* inet_ntop() */
+
+#include "traceroute.h"
+
+typedef struct graph_edge
+{
+	uint32_t from, to;
+	uint32_t count;
+	uint32_t hops; // smallest hop limit difference (> 1 across silent hops)
+	uint32_t rtt_min; // microseconds
+	uint32_t median; // microseconds (only computed for output)
+} graph_edge_t;
+
+typedef struct graph_index
+{
+	uint32_t *tab; // element index plus one, zero if free
+	size_t size; // power of two
+} graph_index_t;
+
+struct trace_graph
+{
+	struct in6_addr *nodes;
+	size_t node_count, node_size;
+	graph_index_t node_index;
+
+	graph_edge_t *edges;
+	size_t edge_count, edge_size;
+	graph_index_t edge_index;
+
+	uint64_t *samples; // edge index << 32 | round-trip time
+	size_t sample_count, sample_size;
+};
+
+
+static size_t hash_addr (const struct in6_addr *addr)
+{
+	uint64_t a, b;
+
+	memcpy (&a, addr->s6_addr, 8);
+	memcpy (&b, addr->s6_addr + 8, 8);
+	a = (a ^ (b * UINT64_C(0x9e3779b97f4a7c15)))
+	    * UINT64_C(0xff51afd7ed558ccd);
+	return a ^ (a >> 32);
+}
+
+
+static size_t hash_edge (uint32_t from, uint32_t to)
+{
+	uint64_t a = (((uint64_t)from << 32) | to) * UINT64_C(0x9e3779b97f4a7c15);
+	return a ^ (a >> 29);
+}
+
+
+static size_t edge_hash (const trace_graph_t *g, uint32_t i)
+{
+	return hash_edge (g->edges[i].from, g->edges[i].to);
+}
+
+
+static size_t node_hash (const trace_graph_t *g, uint32_t i)
+{
+	return hash_addr (g->nodes + i);
+}
+
+
+/* Grows an array by doubling */
+static int grow (void *parray, size_t *size, size_t count, size_t elsize)
+{
+	void **array = parray;
+
+	if (count < *size)
+		return 0;
+
+	size_t n = *size ? 2 * *size : 256;
+	void *p = realloc (*array, n * elsize);
+	if (p == NULL)
+		return -1;
+	*array = p;
+	*size = n;
+	return 0;
+}
+
+
+/* Rebuilds an index when it would be more than half full */
+static int reindex (const trace_graph_t *g, graph_index_t *idx, size_t count,
+                    size_t (*hash) (const trace_graph_t *, uint32_t))
+{
+	if (2 * (count + 1) <= idx->size)
+		return 0;
+
+	size_t size = idx->size ? 2 * idx->size : 1024;
+	uint32_t *tab = calloc (size, sizeof (*tab));
+	if (tab == NULL)
+		return -1;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		size_t h = hash (g, i) & (size - 1);
+
+		while (tab[h])
+			h = (h + 1) & (size - 1);
+		tab[h] = i + 1;
+	}
+
+	free (idx->tab);
+	idx->tab = tab;
+	idx->size = size;
+	return 0;
+}
+
+
+static int64_t get_node (trace_graph_t *g, const struct in6_addr *addr)
+{
+	if (reindex (g, &g->node_index, g->node_count, node_hash))
+		return -1;
+
+	size_t mask = g->node_index.size - 1, h = hash_addr (addr) & mask;
+	uint32_t *slot;
+
+	while (*(slot = g->node_index.tab + h))
+	{
+		if (!memcmp (g->nodes + *slot - 1, addr, 16))
+			return *slot - 1;
+		h = (h + 1) & mask;
+	}
+
+	if (grow (&g->nodes, &g->node_size, g->node_count, sizeof (*g->nodes)))
+		return -1;
+
+	g->nodes[g->node_count] = *addr;
+	*slot = ++g->node_count;
+	return *slot - 1;
+}
+
+
+static graph_edge_t *get_edge (trace_graph_t *g, uint32_t from, uint32_t to)
+{
+	if (reindex (g, &g->edge_index, g->edge_count, edge_hash))
+		return NULL;
+
+	size_t mask = g->edge_index.size - 1, h = hash_edge (from, to) & mask;
+	uint32_t *slot;
+
+	while (*(slot = g->edge_index.tab + h))
+	{
+		graph_edge_t *e = g->edges + *slot - 1;
+		if ((e->from == from) && (e->to == to))
+			return e;
+		h = (h + 1) & mask;
+	}
+
+	if (grow (&g->edges, &g->edge_size, g->edge_count, sizeof (*g->edges)))
+		return NULL;
+
+	graph_edge_t *e = g->edges + g->edge_count;
+	memset (e, 0, sizeof (*e));
+	e->from = from;
+	e->to = to;
+	e->hops = UINT32_MAX;
+	e->rtt_min = UINT32_MAX;
+	*slot = ++g->edge_count;
+	return e;
+}
+
+
+trace_graph_t *graph_create (void)
+{
+	return calloc (1, sizeof (trace_graph_t));
+}
+
+
+void graph_destroy (trace_graph_t *g)
+{
+	free (g->nodes);
+	free (g->node_index.tab);
+	free (g->edges);
+	free (g->edge_index.tab);
+	free (g->samples);
+	free (g);
+}
+
+
+static uint32_t rtt_us (const tracetest_t *t)
+{
+	int64_t ns = (int64_t)(t->rcvd.tv_sec - t->sent.tv_sec) * 1000000000
+	             + (t->rcvd.tv_nsec - t->sent.tv_nsec);
+
+	if (ns < 0)
+		return 0;
+	if (ns / 1000 >= UINT32_MAX)
+		return UINT32_MAX - 1;
+	return ns / 1000;
+}
+
+
+/**
+ * Adds the hops of one trace to the graph.
+ * tab holds retries results for every hop limit from first to last.
+ * If src is not NULL, it is linked to the first hop.
+ */
+int graph_add_trace (trace_graph_t *g, const struct in6_addr *src,
+                     const tracetest_t *tab, unsigned first, unsigned last,
+                     unsigned retries)
+{
+	uint32_t prev[retries ? retries : 1], cur[retries ? retries : 1];
+	uint32_t rtt[retries ? retries : 1];
+	unsigned prevc = 0, prev_hlim = 0;
+
+	if (src != NULL)
+	{
+		int64_t id = get_node (g, src);
+		if (id < 0)
+			return -1;
+		prev[prevc++] = id;
+		prev_hlim = first - 1;
+	}
+
+	for (unsigned hlim = first; hlim <= last; hlim++)
+	{
+		const tracetest_t *line = tab + (hlim - first) * retries;
+		unsigned curc = 0;
+
+		/* Distinct responding addresses, with their smallest RTT */
+		for (unsigned col = 0; col < retries; col++)
+		{
+			if (line[col].result == TRACE_TIMEOUT)
+				continue;
+
+			int64_t id = get_node (g, &line[col].addr.sin6_addr);
+			if (id < 0)
+				return -1;
+
+			unsigned i = 0;
+			while ((i < curc) && (cur[i] != id))
+				i++;
+			if (i == curc)
+			{
+				cur[curc++] = id;
+				rtt[i] = UINT32_MAX;
+			}
+			if (rtt_us (line + col) < rtt[i])
+				rtt[i] = rtt_us (line + col);
+		}
+
+		if (curc == 0)
+			continue; // silent hop
+
+		for (unsigned i = 0; i < prevc; i++)
+			for (unsigned j = 0; j < curc; j++)
+			{
+				graph_edge_t *e = get_edge (g, prev[i], cur[j]);
+				if ((e == NULL)
+				 || grow (&g->samples, &g->sample_size, g->sample_count,
+				          sizeof (*g->samples)))
+					return -1;
+
+				e->count++;
+				if (hlim - prev_hlim < e->hops)
+					e->hops = hlim - prev_hlim;
+				if (rtt[j] < e->rtt_min)
+					e->rtt_min = rtt[j];
+				g->samples[g->sample_count++] =
+					((uint64_t)(e - g->edges) << 32) | rtt[j];
+			}
+
+		memcpy (prev, cur, curc * sizeof (*cur));
+		prevc = curc;
+		prev_hlim = hlim;
+	}
+	return 0;
+}
+
+
+static int cmp_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+static void put_ms (FILE *out, uint32_t us)
+{
+	fprintf (out, "%"PRIu32".%03"PRIu32, us / 1000, us % 1000);
+}
+
+
+static void put32 (uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+
+static int cmp_edge (const void *a, const void *b)
+{
+	const graph_edge_t *x = a, *y = b;
+
+	if (x->from != y->from)
+		return (x->from > y->from) - (x->from < y->from);
+	return (x->to > y->to) - (x->to < y->to);
+}
+
+
+/**
+ * Writes the graph, with edges sorted by origin.
+ */
+int graph_write (trace_graph_t *g, FILE *out, enum graph_format fmt)
+{
+	graph_edge_t *edges = malloc ((g->edge_count ? g->edge_count : 1)
+	                              * sizeof (*edges));
+	if (edges == NULL)
+		return -1;
+	memcpy (edges, g->edges, g->edge_count * sizeof (*edges));
+
+	/* Computes medians: samples of an edge are as many as its count */
+	qsort (g->samples, g->sample_count, sizeof (*g->samples), cmp_u64);
+	for (size_t i = 0; i < g->sample_count;)
+	{
+		graph_edge_t *e = edges + (g->samples[i] >> 32);
+		size_t n = e->count;
+		uint64_t lo = (uint32_t)g->samples[i + (n - 1) / 2];
+		uint64_t hi = (uint32_t)g->samples[i + n / 2];
+
+		e->median = (lo + hi) / 2;
+		i += n;
+	}
+
+	qsort (edges, g->edge_count, sizeof (*edges), cmp_edge);
+
+	char from[INET6_ADDRSTRLEN], to[INET6_ADDRSTRLEN];
+
+	switch (fmt)
+	{
+		case GRAPH_FORMAT_DOT:
+			fputs ("digraph traceroute {\n", out);
+			for (size_t i = 0; i < g->node_count; i++)
+			{
+				inet_ntop (AF_INET6, g->nodes + i, from, sizeof (from));
+				fprintf (out, "\t\"%s\";\n", from);
+			}
+			for (size_t i = 0; i < g->edge_count; i++)
+			{
+				const graph_edge_t *e = edges + i;
+
+				inet_ntop (AF_INET6, g->nodes + e->from, from, sizeof (from));
+				inet_ntop (AF_INET6, g->nodes + e->to, to, sizeof (to));
+				fprintf (out, "\t\"%s\" -> \"%s\" [count=%"PRIu32
+				         ", hops=%"PRIu32", rtt_min=", from, to, e->count,
+				         e->hops);
+				put_ms (out, e->rtt_min);
+				fputs (", rtt_median=", out);
+				put_ms (out, e->median);
+				fprintf (out, ", label=\"%"PRIu32"\"];\n", e->count);
+			}
+			fputs ("}\n", out);
+			break;
+
+		case GRAPH_FORMAT_CSV:
+			fputs ("from,to,count,hops,rtt_min_ms,rtt_median_ms\n", out);
+			for (size_t i = 0; i < g->edge_count; i++)
+			{
+				const graph_edge_t *e = edges + i;
+
+				inet_ntop (AF_INET6, g->nodes + e->from, from, sizeof (from));
+				inet_ntop (AF_INET6, g->nodes + e->to, to, sizeof (to));
+				fprintf (out, "%s,%s,%"PRIu32",%"PRIu32",", from, to,
+				         e->count, e->hops);
+				put_ms (out, e->rtt_min);
+				putc (',', out);
+				put_ms (out, e->median);
+				putc ('\n', out);
+			}
+			break;
+
+		case GRAPH_FORMAT_BINARY:
+		{
+			uint8_t buf[24];
+
+			memcpy (buf, "ND6GRAPH", 8);
+			put32 (buf + 8, 1);
+			put32 (buf + 12, g->node_count);
+			put32 (buf + 16, g->edge_count);
+			put32 (buf + 20, 0);
+			fwrite (buf, 24, 1, out);
+
+			/* Nodes, with the range of their outgoing edges */
+			for (size_t i = 0, e = 0; i < g->node_count; i++)
+			{
+				size_t n = 0;
+				while ((e + n < g->edge_count) && (edges[e + n].from == i))
+					n++;
+
+				memcpy (buf, g->nodes + i, 16);
+				put32 (buf + 16, e);
+				put32 (buf + 20, n);
+				fwrite (buf, 24, 1, out);
+				e += n;
+			}
+
+			for (size_t i = 0; i < g->edge_count; i++)
+			{
+				const graph_edge_t *e = edges + i;
+
+				put32 (buf, e->to);
+				put32 (buf + 4, e->count);
+				put32 (buf + 8, e->hops);
+				put32 (buf + 12, e->rtt_min);
+				put32 (buf + 16, e->median);
+				put32 (buf + 20, 0);
+				fwrite (buf, 24, 1, out);
+			}
+			break;
+		}
+	}
+
+	free (edges);
+	return ferror (out) ? -1 : 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * trace-hist.c - round-trip time histograms for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * Logarithmic buckets, in the manner of HDR histograms: round-trip times
+ * in microseconds below TRACE_HIST_SUB have a bucket each, then every
+ * power of two is split in TRACE_HIST_SUB linear sub-buckets. Percentiles
+ * are thus within 1/TRACE_HIST_SUB (about 3%) of the exact values, in
+ * constant memory whatever the number of samples.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "traceroute.h"
+
+#define SUB_BITS 5 // log2 (TRACE_HIST_SUB)
+
+static unsigned hist_index (uint64_t us)
+{
+	if (us < TRACE_HIST_SUB)
+		return us;
+
+	unsigned e = 63 - __builtin_clzll (us); // >= SUB_BITS
+	unsigned idx = (e - SUB_BITS + 1) * TRACE_HIST_SUB
+	             + (us >> (e - SUB_BITS)) - TRACE_HIST_SUB;
+
+	return (idx < TRACE_HIST_BUCKETS) ? idx : (TRACE_HIST_BUCKETS - 1);
+}
+
+
+/* Returns the middle of a bucket, in microseconds */
+static uint64_t hist_value (unsigned idx)
+{
+	if (idx < TRACE_HIST_SUB)
+		return idx;
+
+	unsigned shift = idx / TRACE_HIST_SUB - 1;
+	uint64_t low = (uint64_t)(idx % TRACE_HIST_SUB + TRACE_HIST_SUB) << shift;
+
+	return low + ((UINT64_C(1) << shift) >> 1);
+}
+
+
+void hist_add (trace_hist_t *h, int64_t rtt)
+{
+	if (rtt < 0)
+		rtt = 0;
+
+	h->count[hist_index (rtt / 1000)]++;
+	h->answered++;
+	if (rtt > h->max)
+		h->max = rtt;
+}
+
+
+int64_t hist_percentile (const trace_hist_t *h, unsigned pct)
+{
+	if (h->answered == 0)
+		return -1;
+
+	/* Rank of the sample, rounded up, from 1 to answered */
+	uint64_t rank = ((uint64_t)h->answered * pct + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < TRACE_HIST_BUCKETS; i++)
+	{
+		seen += h->count[i];
+		if (seen >= rank)
+		{
+			int64_t ns = hist_value (i) * 1000;
+			return (ns < h->max) ? ns : h->max;
+		}
+	}
+	return h->max;
+}
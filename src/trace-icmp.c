@@ -26,7 +26,6 @@
 #include <stdbool.h>
 #include <stdint.h> // uint16_t
 
-#include <unistd.h> // getpid()
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/icmp6.h>
@@ -36,7 +35,8 @@
 
 /* ICMPv6 Echo probes */
 static ssize_t
-send_echo_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
+send_echo_probe (int fd, unsigned ttl, uint16_t id, size_t plen,
+                 uint16_t port)
 {
 	if (plen < sizeof (struct icmp6_hdr))
 		plen = sizeof (struct icmp6_hdr);
@@ -50,8 +50,8 @@ send_echo_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
 
 	memset(packet, 0, plen);
 	packet->ih.icmp6_type = ICMP6_ECHO_REQUEST;
-	packet->ih.icmp6_id = htons(getpid ());
-	packet->ih.icmp6_seq = htons((ttl << 8) | (n & 0xff));
+	packet->ih.icmp6_id = htons(ident);
+	packet->ih.icmp6_seq = htons(id);
 	(void)port;
 
 	return send_payload(fd, packet, plen, ttl);
@@ -59,39 +59,39 @@ send_echo_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
 
 
 static ssize_t
-parse_echo_reply (const void *data, size_t len, int *ttl, unsigned *n,
+parse_echo_reply (const void *data, size_t len, int *ttl, int *id,
                   uint16_t port)
 {
 	const struct icmp6_hdr *pih = (const struct icmp6_hdr *)data;
 
 	if ((len < sizeof (*pih))
 	 || (pih->icmp6_type != ICMP6_ECHO_REPLY)
-	 || (pih->icmp6_id != htons (getpid ())))
+	 || (pih->icmp6_id != htons (ident)))
 		return -1;
 
+	(void)ttl;
 	(void)port;
 
-	*ttl = ntohs (pih->icmp6_seq) >> 8;
-	*n = ntohs (pih->icmp6_seq) & 0xff;
+	*id = ntohs (pih->icmp6_seq);
 	return 0;
 }
 
 
 static ssize_t
-parse_echo_error (const void *data, size_t len, int *ttl, unsigned *n,
+parse_echo_error (const void *data, size_t len, int *ttl, int *id,
                   uint16_t port)
 {
 	const struct icmp6_hdr *pih = (const struct icmp6_hdr *)data;
 
 	if ((len < sizeof (*pih))
 	 || (pih->icmp6_type != ICMP6_ECHO_REQUEST) || (pih->icmp6_code)
-	 || (pih->icmp6_id != htons (getpid ())))
+	 || (pih->icmp6_id != htons (ident)))
 		return -1;
 
+	(void)ttl;
 	(void)port;
 
-	*ttl = ntohs (pih->icmp6_seq) >> 8;
-	*n = ntohs (pih->icmp6_seq) & 0xff;
+	*id = ntohs (pih->icmp6_seq);
 	return 0;
 }
 
@@ -99,3 +99,76 @@ parse_echo_error (const void *data, size_t len, int *ttl, unsigned *n,
 const tracetype echo_type =
 	{ SOCK_DGRAM, IPPROTO_ICMPV6, -1 /* checksum auto-set for ICMPv6 */,
 	  send_echo_probe, parse_echo_reply, parse_echo_error };
+
+
+/*
+ * ICMPv6 Echo probes from a datagram ("ping") socket. The kernel
+ * overwrites the Echo identifier with that of the socket, so the payload
+ * carries the process identifier instead, and only the sequence number
+ * identifies the probe.
+ */
+static ssize_t
+send_echo_dgram_probe (int fd, unsigned ttl, uint16_t id, size_t plen,
+                       uint16_t port)
+{
+	if (plen < sizeof (struct icmp6_hdr) + 2)
+		plen = sizeof (struct icmp6_hdr) + 2;
+
+	alignas (struct icmp6_hdr) char buf[plen];
+	struct
+	{
+		struct icmp6_hdr ih;
+		uint8_t payload[];
+	} *packet = (void *)buf;
+
+	memset (packet, 0, plen);
+	packet->ih.icmp6_type = ICMP6_ECHO_REQUEST;
+	packet->ih.icmp6_seq = htons (id);
+	packet->payload[0] = ident >> 8;
+	packet->payload[1] = ident;
+	(void)port;
+
+	return send_payload (fd, packet, plen, ttl);
+}
+
+
+static ssize_t
+parse_echo_dgram (const void *data, size_t len, int *id, uint8_t icmp_type)
+{
+	const struct icmp6_hdr *pih = (const struct icmp6_hdr *)data;
+	const uint8_t *payload = (const uint8_t *)(pih + 1);
+
+	if ((len < sizeof (*pih) + 2)
+	 || (pih->icmp6_type != icmp_type) || (pih->icmp6_code)
+	 || (((payload[0] << 8) | payload[1]) != ident))
+		return -1;
+
+	*id = ntohs (pih->icmp6_seq);
+	return 0;
+}
+
+
+static ssize_t
+parse_echo_dgram_reply (const void *data, size_t len, int *ttl, int *id,
+                        uint16_t port)
+{
+	(void)ttl;
+	(void)port;
+	return parse_echo_dgram (data, len, id, ICMP6_ECHO_REPLY);
+}
+
+
+static ssize_t
+parse_echo_dgram_error (const void *data, size_t len, int *ttl, int *id,
+                        uint16_t port)
+{
+	(void)ttl;
+	(void)port;
+	return parse_echo_dgram (data, len, id, ICMP6_ECHO_REQUEST);
+}
+
+
+const tracetype echo_dgram_type =
+	{ SOCK_DGRAM, IPPROTO_ICMPV6, -1 /* checksum auto-set for ICMPv6 */,
+	  send_echo_dgram_probe, parse_echo_dgram_reply,
+	  parse_echo_dgram_error };
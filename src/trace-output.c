@@ -0,0 +1,457 @@
+/*
+ * trace-output.c - machine-readable output for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> /* inet_ntop() */
+
+#include "traceroute.h"
+
+
+/* Binary records */
+static void put16 (uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32 (uint8_t *p, uint32_t v)
+{
+	put16 (p, v >> 16);
+	put16 (p + 2, v);
+}
+
+static void put64 (uint8_t *p, uint64_t v)
+{
+	put32 (p, v >> 32);
+	put32 (p + 4, v);
+}
+
+static uint16_t get16 (const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32 (const uint8_t *p)
+{
+	return ((uint32_t)get16 (p) << 16) | get16 (p + 2);
+}
+
+static uint64_t get64 (const uint8_t *p)
+{
+	return ((uint64_t)get32 (p) << 32) | get32 (p + 4);
+}
+
+
+int trace_record_write (FILE *out, const trace_record_t *rec)
+{
+	uint8_t buf[TRACE_RECORD_SIZE];
+
+	memset (buf, 0, sizeof (buf));
+	buf[0] = TRACE_RECORD_VERSION;
+	buf[1] = rec->kind;
+	buf[2] = rec->hlim;
+	put16 (buf + 4, rec->attempt);
+	put16 (buf + 6, rec->result);
+	memcpy (buf + 8, &rec->addr, 16);
+	put16 (buf + 24, (rec->rhlim >= 0) ? rec->rhlim : 0xffff);
+	put16 (buf + 26, rec->port);
+	put32 (buf + 28, rec->extra);
+	put64 (buf + 32, rec->sent);
+	put64 (buf + 40, rec->rcvd);
+
+	return (fwrite (buf, sizeof (buf), 1, out) == 1) ? 0 : -1;
+}
+
+
+/**
+ * Reads one binary record.
+ * @return 1 on success, 0 at end of file, -1 on error.
+ */
+int trace_record_read (FILE *in, trace_record_t *rec)
+{
+	uint8_t buf[TRACE_RECORD_SIZE];
+
+	size_t len = fread (buf, 1, sizeof (buf), in);
+	if (len == 0)
+		return ferror (in) ? -1 : 0;
+	if ((len < sizeof (buf)) || (buf[0] != TRACE_RECORD_VERSION))
+		return -1;
+
+	rec->kind = buf[1];
+	rec->hlim = buf[2];
+	rec->attempt = get16 (buf + 4);
+	rec->result = get16 (buf + 6);
+	memcpy (&rec->addr, buf + 8, 16);
+	rec->rhlim = get16 (buf + 24);
+	if (rec->rhlim == 0xffff)
+		rec->rhlim = -1;
+	rec->port = get16 (buf + 26);
+	rec->extra = get32 (buf + 28);
+	rec->sent = get64 (buf + 32);
+	rec->rcvd = get64 (buf + 40);
+	return 1;
+}
+
+
+static uint64_t ts2ns (const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+
+int binary_write_trace (FILE *out, const struct sockaddr_in6 *dst,
+                        int protocol, unsigned min_ttl, unsigned max_ttl,
+                        unsigned retries, size_t plen)
+{
+	struct timespec now;
+	trace_record_t rec;
+
+	clock_gettime (CLOCK_REALTIME, &now);
+	memset (&rec, 0, sizeof (rec));
+	rec.kind = TRACE_RECORD_TRACE;
+	rec.hlim = max_ttl;
+	rec.attempt = retries;
+	rec.result = protocol;
+	rec.addr = dst->sin6_addr;
+	rec.rhlim = min_ttl;
+	rec.port = ntohs (dst->sin6_port);
+	rec.extra = plen;
+	rec.sent = ts2ns (&now);
+
+	return trace_record_write (out, &rec);
+}
+
+
+int binary_write_hop (FILE *out, const tracetest_t *line, unsigned ttl,
+                      unsigned retries)
+{
+	for (unsigned col = 0; col < retries; col++)
+	{
+		const tracetest_t *test = line + col;
+		trace_record_t rec;
+
+		memset (&rec, 0, sizeof (rec));
+		rec.kind = TRACE_RECORD_HOP;
+		rec.hlim = ttl;
+		rec.attempt = col;
+		rec.result = test->result;
+		rec.rhlim = test->rhlim;
+		rec.extra = test->mtu;
+		rec.sent = ts2ns (&test->sent);
+		if (test->result != TRACE_TIMEOUT)
+		{
+			rec.addr = test->addr.sin6_addr;
+			rec.rcvd = ts2ns (&test->rcvd);
+		}
+
+		if (trace_record_write (out, &rec))
+			return -1;
+
+		for (unsigned i = 0; i < test->mpls_count; i++)
+		{
+			memset (&rec, 0, sizeof (rec));
+			rec.kind = TRACE_RECORD_MPLS;
+			rec.hlim = ttl;
+			rec.attempt = col;
+			rec.rhlim = -1;
+			rec.extra = test->mpls[i];
+
+			if (trace_record_write (out, &rec))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* JSON lines */
+static void json_puts (FILE *out, const char *str)
+{
+	putc ('"', out);
+	for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+	{
+		if ((*p == '"') || (*p == '\\'))
+			fprintf (out, "\\%c", *p);
+		else
+		if (*p < 0x20)
+			fprintf (out, "\\u%04x", *p);
+		else
+			putc (*p, out);
+	}
+	putc ('"', out);
+}
+
+
+static void json_addr (FILE *out, const struct in6_addr *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (inet_ntop (AF_INET6, addr, buf, sizeof (buf)) == NULL)
+		strcpy (buf, "??");
+	json_puts (out, buf);
+}
+
+
+static const char *result_name (unsigned result)
+{
+	switch (result)
+	{
+		case TRACE_TIMEOUT:
+			return "timeout";
+		case TRACE_OK:
+			return "ok";
+		case TRACE_CLOSED:
+			return "closed";
+		case TRACE_OPEN:
+			return "open";
+		case TRACE_NOROUTE:
+			return "noroute";
+		case TRACE_ADMIN:
+			return "admin";
+		case TRACE_BSCOPE:
+			return "beyondscope";
+		case TRACE_NOHOST:
+			return "nohost";
+		case TRACE_NOPROTO:
+			return "noproto";
+		case TRACE_TOOBIG:
+			return "toobig";
+	}
+	return "unknown";
+}
+
+
+void json_write_trace (FILE *out, const char *name,
+                       const struct sockaddr_in6 *dst,
+                       const struct in6_addr *segv, unsigned segc,
+                       int protocol, unsigned min_ttl, unsigned max_ttl,
+                       unsigned retries, size_t plen)
+{
+	fputs ("{\"type\":\"trace\",\"dst\":", out);
+	json_addr (out, &dst->sin6_addr);
+	if (name != NULL)
+	{
+		fputs (",\"name\":", out);
+		json_puts (out, name);
+	}
+	if (segc > 0)
+	{
+		fputs (",\"segments\":[", out);
+		for (unsigned i = 0; i < segc; i++)
+		{
+			if (i > 0)
+				putc (',', out);
+			json_addr (out, segv + i);
+		}
+		putc (']', out);
+	}
+	fprintf (out, ",\"protocol\":%d,\"port\":%u,\"first\":%u,\"max\":%u,"
+	         "\"probes\":%u,\"length\":%zu}\n", protocol,
+	         ntohs (dst->sin6_port), min_ttl, max_ttl, retries, plen);
+}
+
+
+static void json_write_asn (FILE *out, const asn_table_t *asn,
+                            const struct in6_addr *addr)
+{
+	struct in6_addr prefix;
+	uint32_t as;
+	unsigned plen;
+	char buf[INET6_ADDRSTRLEN];
+
+	if (!asn_lookup (asn, addr, &as, &prefix, &plen))
+		return;
+
+	inet_ntop (AF_INET6, &prefix, buf, sizeof (buf));
+	fprintf (out, ",\"asn\":%"PRIu32",\"prefix\":\"%s/%u\"", as, buf, plen);
+}
+
+
+static void json_write_ext (FILE *out, const tracetest_t *test)
+{
+	if (test->mpls_count > 0)
+	{
+		fputs (",\"mpls\":[", out);
+		for (unsigned i = 0; i < test->mpls_count; i++)
+		{
+			uint32_t lse = test->mpls[i];
+
+			fprintf (out, "%s{\"label\":%"PRIu32",\"tc\":%u,\"s\":%u,"
+			         "\"ttl\":%u}", (i > 0) ? "," : "", lse >> 12,
+			         (unsigned)(lse >> 9) & 7, (unsigned)(lse >> 8) & 1,
+			         (unsigned)lse & 0xff);
+		}
+		putc (']', out);
+	}
+
+	const trace_iface_t *iface = &test->iface;
+	if (iface->ctype != 0)
+	{
+		static const char roles[][9] =
+			{ "incoming", "sub-ip", "outgoing", "nexthop" };
+
+		fprintf (out, ",\"iface\":{\"role\":\"%s\"",
+		         roles[TRACE_IFACE_ROLE (iface->ctype)]);
+		if (iface->ctype & TRACE_IFACE_INDEX)
+			fprintf (out, ",\"index\":%"PRIu32, iface->index);
+		if (iface->ctype & TRACE_IFACE_ADDR)
+		{
+			fputs (",\"addr\":", out);
+			json_addr (out, &iface->addr);
+		}
+		if (iface->ctype & TRACE_IFACE_NAME)
+		{
+			fputs (",\"name\":", out);
+			json_puts (out, iface->name);
+		}
+		if (iface->ctype & TRACE_IFACE_MTU)
+			fprintf (out, ",\"mtu\":%"PRIu32, iface->mtu);
+		putc ('}', out);
+	}
+}
+
+
+void json_write_hop (FILE *out, const tracetest_t *line, unsigned ttl,
+                     unsigned retries, const asn_table_t *asn)
+{
+	fprintf (out, "{\"type\":\"hop\",\"ttl\":%u,\"probes\":[", ttl);
+
+	for (unsigned col = 0; col < retries; col++)
+	{
+		const tracetest_t *test = line + col;
+
+		if (col > 0)
+			putc (',', out);
+		fprintf (out, "{\"result\":\"%s\"", result_name (test->result));
+		if (test->mtu)
+			fprintf (out, ",\"size\":%u", test->mtu);
+
+		if (test->result != TRACE_TIMEOUT)
+		{
+			uint64_t rtt = ts2ns (&test->rcvd) - ts2ns (&test->sent);
+
+			fputs (",\"addr\":", out);
+			json_addr (out, &test->addr.sin6_addr);
+			fprintf (out, ",\"rtt\":%"PRIu64".%03u",
+			         rtt / 1000000, (unsigned)((rtt / 1000) % 1000));
+			if (test->rhlim != -1)
+				fprintf (out, ",\"rhlim\":%d", test->rhlim);
+			if (asn != NULL)
+				json_write_asn (out, asn, &test->addr.sin6_addr);
+			json_write_ext (out, test);
+		}
+		putc ('}', out);
+	}
+	fputs ("]}\n", out);
+}
+
+
+static void json_write_ms (FILE *out, int64_t ns)
+{
+	if (ns < 0)
+		fputs ("null", out);
+	else
+		fprintf (out, "%"PRIu64".%03u", (uint64_t)ns / 1000000,
+		         (unsigned)((ns / 1000) % 1000));
+}
+
+
+void json_write_change (FILE *out, const trace_change_t *c)
+{
+	static const char kinds[][8] =
+		{ "none", "new", "gone", "rtt", "reached" };
+
+	fprintf (out, "{\"type\":\"change\",\"change\":\"%s\"", kinds[c->kind]);
+	switch (c->kind)
+	{
+		case TRACE_CHANGE_NONE:
+			fprintf (out, ",\"hops\":%u", c->ttl);
+			break;
+
+		case TRACE_CHANGE_NEW:
+		case TRACE_CHANGE_GONE:
+			fprintf (out, ",\"ttl\":%u,\"addr\":", c->ttl);
+			json_addr (out, &c->addr);
+			break;
+
+		case TRACE_CHANGE_RTT:
+			fprintf (out, ",\"ttl\":%u,\"before\":", c->ttl);
+			json_write_ms (out, c->before);
+			fputs (",\"after\":", out);
+			json_write_ms (out, c->after);
+			break;
+
+		case TRACE_CHANGE_REACHED:
+			fprintf (out, ",\"before\":%"PRId64",\"after\":%"PRId64,
+			         c->before, c->after);
+			break;
+	}
+	fputs ("}\n", out);
+}
+
+
+void json_write_summary (FILE *out, unsigned ttl,
+                         const trace_path_hop_t *hop, const trace_hist_t *h)
+{
+	static const unsigned pcts[] = { 50, 90, 99 };
+
+	fprintf (out, "{\"type\":\"summary\",\"ttl\":%u,\"addrs\":[", ttl);
+	for (unsigned i = 0; i < hop->count; i++)
+	{
+		if (i > 0)
+			putc (',', out);
+		json_addr (out, hop->addr + i);
+	}
+	fprintf (out, "],\"sent\":%lu,\"lost\":%lu", h->answered + h->lost,
+	         h->lost);
+
+	for (unsigned i = 0; i < sizeof (pcts) / sizeof (pcts[0]); i++)
+	{
+		fprintf (out, ",\"p%u\":", pcts[i]);
+		json_write_ms (out, hist_percentile (h, pcts[i]));
+	}
+	fputs (",\"max\":", out);
+	json_write_ms (out, (h->answered > 0) ? h->max : -1);
+	fputs ("}\n", out);
+}
+
+
+void json_write_end (FILE *out, const char *status, const char *error)
+{
+	fputs ("{\"type\":\"end\",\"status\":", out);
+	json_puts (out, status);
+	if (error != NULL)
+	{
+		fputs (",\"error\":", out);
+		json_puts (out, error);
+	}
+	fputs ("}\n", out);
+}
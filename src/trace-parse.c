@@ -0,0 +1,492 @@
+/*
+ * trace-parse.c - received packets parsing for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  Copyright © 2005-2007 Rémi Denis-Courmont.                           *
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+
+#include "traceroute.h"
+
+#ifndef ICMP6_DST_UNREACH_BEYONDSCOPE
+# define ICMP6_DST_UNREACH_BEYONDSCOPE 2
+#endif
+
+
+static ssize_t
+parse (trace_parser_t func, const void *data, size_t len,
+       int *hlim, int *id, uint16_t port)
+{
+	*hlim = *id = -1;
+	if (func == NULL)
+		return -1;
+
+	ssize_t rc = func (data, len, hlim, id, port);
+	if ((rc < 0) || ((*hlim == -1) && (*id == -1)))
+	{
+		*hlim = *id = -1;
+		return -1;
+	}
+	return rc;
+}
+
+
+static const void *
+skip_exthdrs (struct ip6_hdr *ip6, size_t *plen)
+{
+	const uint8_t *payload = (const uint8_t *)(ip6 + 1);
+	size_t len = *plen;
+	uint8_t nxt = ip6->ip6_nxt;
+
+	for (;;)
+	{
+		uint16_t hlen;
+
+		switch (nxt)
+		{
+			case IPPROTO_HOPOPTS:
+			case IPPROTO_DSTOPTS:
+			case IPPROTO_ROUTING:
+				if (len < 2)
+					return NULL;
+
+				hlen = (1 + (uint16_t)payload[1]) << 3;
+				break;
+
+			case IPPROTO_FRAGMENT:
+				hlen = 8;
+				break;
+
+			case IPPROTO_AH:
+				if (len < 2)
+					return NULL;
+
+				hlen = (2 + (uint16_t)payload[1]) << 2;
+				break;
+
+			default: // THE END
+				goto out;
+		}
+
+		if (len < hlen)
+			return NULL; // too short;
+
+		switch (nxt)
+		{
+			case IPPROTO_ROUTING:
+			{
+				/* Extract real destination */
+				if (payload[3] > 0) // segments left
+				{
+					if (16 * payload[3] > hlen - 8)
+						return NULL; // more segments left than addresses
+
+					switch (payload[2])
+					{
+						case 0: /* Handle Routing Type 0 */
+							if ((hlen & 8) != 8)
+								return NULL; // != 8[16] -> invalid length
+
+							memcpy (&ip6->ip6_dst,
+							        payload + (16 * payload[3]) - 8, 16);
+							break;
+
+						case TRACE_RTHDR_SRH:
+							/* Segments are listed backward */
+							if (payload[3] > payload[4])
+								return NULL; // beyond the last entry
+
+							memcpy (&ip6->ip6_dst, payload + 8, 16);
+							break;
+
+						default:
+							return NULL; // unknown type
+					}
+				}
+				break;
+			}
+
+			case IPPROTO_FRAGMENT:
+			{
+				uint16_t offset;
+				memcpy (&offset, payload + 2, 2);
+				if (ntohs (offset) >> 3)
+					return NULL; // non-first fragment
+				break;
+			}
+		}
+
+		nxt = payload[0];
+		len -= hlen;
+		payload += hlen;
+	}
+
+out:
+	ip6->ip6_nxt = nxt;
+	*plen = len;
+	return payload;
+}
+
+
+static uint32_t get32 (const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+/**
+ * Checks an ICMP extension structure header and checksum (RFC 4884).
+ */
+static bool check_ext (const uint8_t *ext, size_t extlen)
+{
+	if ((extlen < 4) || ((ext[0] >> 4) != 2))
+		return false; // no ext / unknown version
+
+	uint32_t sum = 0;
+	if (ext[2] | ext[3]) // zero checksum means none (RFC 4884 §7)
+	{
+		for (size_t i = 0; i + 1 < extlen; i += 2)
+			sum += (ext[i] << 8) | ext[i + 1];
+		if (extlen & 1)
+			sum += ext[extlen - 1] << 8;
+		while (sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+		if (sum != 0xffff)
+			return false; // bad checksum
+	}
+	return true;
+}
+
+
+/**
+ * Parses an RFC 5837 Interface Information object.
+ */
+static void parse_iface (uint8_t ctype, const uint8_t *obj, size_t len,
+                         trace_iface_t *iface)
+{
+	if (iface->ctype != 0)
+		return; // keep the first object only
+
+	memset (iface, 0, sizeof (*iface));
+
+	if (ctype & TRACE_IFACE_INDEX)
+	{
+		if (len < 4)
+			return;
+		iface->index = get32 (obj);
+		obj += 4;
+		len -= 4;
+	}
+
+	if (ctype & TRACE_IFACE_ADDR)
+	{
+		if (len < 4)
+			return;
+
+		switch ((obj[0] << 8) | obj[1]) // AFI
+		{
+			case 1: // IPv4
+				if (len < 8)
+					return;
+				iface->addr.s6_addr[10] = iface->addr.s6_addr[11] = 0xff;
+				memcpy (iface->addr.s6_addr + 12, obj + 4, 4);
+				obj += 8;
+				len -= 8;
+				break;
+
+			case 2: // IPv6
+				if (len < 20)
+					return;
+				memcpy (&iface->addr, obj + 4, 16);
+				obj += 20;
+				len -= 20;
+				break;
+
+			default:
+				return;
+		}
+	}
+
+	if (ctype & TRACE_IFACE_NAME)
+	{
+		if ((len < 1) || (obj[0] > len) || (obj[0] & 3) || (obj[0] == 0))
+			return;
+
+		size_t namelen = obj[0] - 1;
+		if (namelen >= sizeof (iface->name))
+			namelen = sizeof (iface->name) - 1;
+		memcpy (iface->name, obj + 1, namelen);
+		iface->name[namelen] = '\0'; // name is NUL-padded
+		for (char *p = iface->name; *p; p++)
+			if ((unsigned char)*p < 0x20)
+				*p = '?'; // do not print control characters
+		len -= obj[0];
+		obj += obj[0];
+	}
+
+	if (ctype & TRACE_IFACE_MTU)
+	{
+		if (len < 4)
+			return;
+		iface->mtu = get32 (obj);
+	}
+
+	iface->ctype = ctype;
+}
+
+
+/**
+ * Parses the objects of an ICMP extension structure (RFC 4884).
+ */
+static void parse_ext (const uint8_t *ext, size_t extlen, tracetest_t *res)
+{
+	while (extlen >= 4)
+	{
+		uint16_t objlen = (ext[0] << 8) | ext[1];
+		if ((objlen & 3) || (objlen < 4) // malformatted object
+		 || (objlen > extlen)) // incomplete object
+			break;
+
+		const uint8_t *obj = ext + 4;
+		size_t len = objlen - 4;
+
+		switch (ext[2]) // Class-Num
+		{
+			case 1: // MPLS Label Stack (RFC 4950)
+				if (ext[3] != 1)
+					break;
+				for (; (len >= 4) && (res->mpls_count < TRACE_MPLS_MAX);
+				     obj += 4, len -= 4)
+					res->mpls[res->mpls_count++] = get32 (obj);
+				break;
+
+			case 2: // Interface Information (RFC 5837)
+				parse_iface (ext[3], obj, len, &res->iface);
+				break;
+		}
+
+		ext += objlen;
+		extlen -= objlen;
+	}
+}
+
+
+/**
+ * Sets the result of a probe from the type and code of an ICMPv6 error.
+ * @return 1 for an intermediary response, 0 for a final response, -1 if
+ * the error is not interesting.
+ */
+static int icmp_result (unsigned type, unsigned code, uint32_t mtu,
+                        tracetest_t *res)
+{
+	switch (type)
+	{
+		case ICMP6_DST_UNREACH:
+			switch (code)
+			{
+				case ICMP6_DST_UNREACH_NOROUTE:
+				case ICMP6_DST_UNREACH_ADMIN:
+				case ICMP6_DST_UNREACH_BEYONDSCOPE:
+				case ICMP6_DST_UNREACH_ADDR:
+					res->result = 0x100 | code;
+					break;
+				case ICMP6_DST_UNREACH_NOPORT:
+					res->result = TRACE_OK;
+					break;
+				case 5: // ingress/egress policy failure
+				case 6: // reject route
+					res->result = TRACE_ADMIN;
+					break;
+			}
+			return 0;
+
+		case ICMP6_PACKET_TOO_BIG:
+			res->result = TRACE_TOOBIG;
+			res->mtu = mtu;
+			return 1;
+
+		case ICMP6_PARAM_PROB:
+			switch (code)
+			{
+				case ICMP6_PARAMPROB_NEXTHEADER:
+					res->result = 0x400 | code;
+			}
+			return 0;
+
+		case ICMP6_TIME_EXCEEDED:
+			if (code == ICMP6_TIME_EXCEED_TRANSIT)
+			{
+				res->result = TRACE_OK;
+				return 1; // intermediary reponse
+			}
+	}
+	return -1; // should not happen (ICMPv6 filter)
+}
+
+
+/**
+ * Parses an ICMPv6 error packet quoting one of our probes.
+ * The packet buffer is modified: the quoted IPv6 header is rewritten with
+ * the final destination of the probe (after any Routing header).
+ * res->addr must already hold the sender address.
+ * If the destination address is unspecified, any destination is accepted,
+ * and final responses are reported as unreachable (2).
+ *
+ * @return 0 if the packet is not interesting, 1 for an intermediary hop,
+ * 2 if the destination is unreachable, 3 if the destination was reached.
+ */
+int icmp_parse (const tracetype *type, void *data, size_t len,
+                tracetest_t *res, int *id, int *hlim,
+                const struct sockaddr_in6 *dst)
+{
+	struct
+	{
+		struct icmp6_hdr hdr;
+		struct ip6_hdr inhdr;
+		uint8_t buf[];
+	} *pkt = data;
+
+	if (len < sizeof (pkt->hdr) + sizeof (pkt->inhdr))
+		return 0; // too small
+
+	len -= sizeof (pkt->hdr) + sizeof (pkt->inhdr);
+
+	/* "Extended" ICMP detection (RFC 4884) */
+	const uint8_t *ext = NULL;
+	size_t extlen = 0;
+	switch (pkt->hdr.icmp6_type)
+	{
+		case ICMP6_DST_UNREACH:
+		case ICMP6_TIME_EXCEEDED:
+		{
+			size_t origlen = pkt->hdr.icmp6_data8[0] << 3;
+
+			if (origlen == 0)
+			{
+				/*
+				 * Non-compliant (RFC 4950 before RFC 4884) routers append
+				 * the extension after exactly 128 bytes of original
+				 * datagram, leaving the length field unset.
+				 */
+				if ((len + sizeof (pkt->inhdr) < 128 + 4)
+				 || !check_ext (pkt->buf + 128 - sizeof (pkt->inhdr),
+				                len + sizeof (pkt->inhdr) - 128))
+					break;
+				origlen = 128;
+			}
+			else
+			if ((origlen < sizeof (pkt->inhdr))
+			 || (origlen > len + sizeof (pkt->inhdr)))
+				return 0; // malformatted extended ICMP
+
+			ext = pkt->buf - sizeof (pkt->inhdr) + origlen;
+			extlen = len + sizeof (pkt->inhdr) - origlen;
+			len = origlen - sizeof (pkt->inhdr);
+
+			if (!check_ext (ext, extlen))
+				extlen = 0; // no ext / unknown version / bad checksum
+		}
+	}
+
+	const void *buf = skip_exthdrs (&pkt->inhdr, &len);
+	if (buf == NULL)
+		return 0; // malformed extension headers
+
+	if (!IN6_IS_ADDR_UNSPECIFIED (&dst->sin6_addr)
+	 && memcmp (&pkt->inhdr.ip6_dst, &dst->sin6_addr, 16))
+		return 0; // wrong destination
+
+	if (pkt->inhdr.ip6_nxt != type->protocol)
+		return 0; // wrong protocol
+
+	if (parse (type->parse_err, buf, len, hlim, id, dst->sin6_port) < 0)
+		return 0;
+
+	/* interesting ICMPv6 error */
+	int val = icmp_result (pkt->hdr.icmp6_type, pkt->hdr.icmp6_code,
+	                       ntohl (pkt->hdr.icmp6_mtu), res);
+	if (val < 0)
+		return 0;
+
+	/* "Extended" ICMP handling */
+	if (extlen > 0)
+		parse_ext (ext + 4, extlen - 4, res);
+
+	if (val > 0)
+		return 1; // intermediary response
+
+	// final response received
+	return memcmp (&res->addr.sin6_addr, &dst->sin6_addr, 16) ? 2 : 3;
+}
+
+
+/**
+ * Parses an ICMPv6 error queued by the kernel for a datagram socket
+ * (IPV6_RECVERR). The kernel already matched the error with the socket,
+ * and extracted the sender address to res->addr; data is the payload of
+ * the probe, as quoted in the error.
+ *
+ * @return same as icmp_parse().
+ */
+int err_parse (const tracetype *type, unsigned icmp_type, unsigned icmp_code,
+               uint32_t info, const void *data, size_t len,
+               tracetest_t *res, int *id, int *hlim,
+               const struct sockaddr_in6 *dst)
+{
+	if (parse (type->parse_err, data, len, hlim, id, dst->sin6_port) < 0)
+		return 0;
+
+	int val = icmp_result (icmp_type, icmp_code, info, res);
+	if (val < 0)
+		return 0;
+	if (val > 0)
+		return 1; // intermediary response
+
+	return memcmp (&res->addr.sin6_addr, &dst->sin6_addr, 16) ? 2 : 3;
+}
+
+
+/**
+ * Parses a response packet from the destination.
+ * @return 0 if the packet is not interesting, 1 otherwise.
+ */
+int proto_parse (const tracetype *type, const void *data, size_t len,
+                 tracetest_t *res, int *id, int *hlim,
+                 const struct sockaddr_in6 *dst)
+{
+	ssize_t val = parse (type->parse_resp, data, len, hlim, id,
+	                     dst->sin6_port);
+	if (val < 0)
+		return 0;
+
+	/* Route determination complete! */
+	memcpy (&res->addr, dst, sizeof (res->addr));
+	res->result = 1 + val;
+	return 1; // response received
+}
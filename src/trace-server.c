@@ -0,0 +1,486 @@
+/*
+ * trace-server.c - request socket for IPv6 traceroute service mode
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * Clients connect to a Unix stream socket and write one request per line:
+ *   <destination> [udp|udplite|icmp|syn|ack] [port <port>] [first <hlim>]
+ *                 [max <hlim>] [probes <count>] [wait <seconds>]
+ * Unspecified parameters take the values given on the command line.
+ * Requests are queued in order of arrival, and answered on the same
+ * connection, possibly out of order. A connection is only closed once
+ * all of its requests were answered, so that its file descriptor cannot
+ * be reused by another client meanwhile.
+ * Replies are queued and written as the client socket accepts them, so
+ * that a client that does not read cannot block the others. A client with
+ * too much unread output, or too many unanswered requests, is
+ * disconnected.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+#include "traceroute.h"
+
+#define SERVER_LINE 512 // longest request line
+#define SERVER_CLIENTS 256 // connections at once
+#define SERVER_OUTPUT (1 << 20) // largest unread output per client
+#define SERVER_PENDING 256 // unanswered requests per client
+
+typedef struct server_client
+{
+	int fd;
+	unsigned pending; // requests not answered yet
+	unsigned rejected; // requests to answer with an error
+	bool eof;
+	bool broken; // replies cannot be written anymore
+	size_t len;
+	char buf[SERVER_LINE];
+	char *out; // unwritten replies
+	size_t outlen, outsize;
+} server_client_t;
+
+struct trace_server
+{
+	int fd;
+	char *path;
+	trace_request_t defaults;
+	server_client_t *clients[SERVER_CLIENTS];
+	unsigned count;
+	trace_request_t *queue;
+	unsigned head, tail, size; // circular buffer
+};
+
+
+trace_server_t *server_open (const char *path,
+                             const trace_request_t *defaults)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen (path) >= sizeof (addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	strcpy (addr.sun_path, path);
+
+	trace_server_t *s = malloc (sizeof (*s));
+	if (s == NULL)
+		return NULL;
+
+	memset (s, 0, sizeof (*s));
+	s->defaults = *defaults;
+	s->path = strdup (path);
+	s->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((s->path == NULL) || (s->fd == -1))
+		goto error;
+
+	unlink (path); // stale socket from a previous run
+	if (bind (s->fd, (struct sockaddr *)&addr, sizeof (addr))
+	 || listen (s->fd, 64))
+		goto error;
+	return s;
+
+error:
+	if (s->fd != -1)
+		close (s->fd);
+	free (s->path);
+	free (s);
+	return NULL;
+}
+
+
+void server_close (trace_server_t *s)
+{
+	for (unsigned i = 0; i < s->count; i++)
+	{
+		close (s->clients[i]->fd);
+		free (s->clients[i]->out);
+		free (s->clients[i]);
+	}
+	close (s->fd);
+	unlink (s->path);
+	free (s->path);
+	free (s->queue);
+	free (s);
+}
+
+
+static server_client_t *server_find (trace_server_t *s, int fd)
+{
+	for (unsigned i = 0; i < s->count; i++)
+		if (s->clients[i]->fd == fd)
+			return s->clients[i];
+	return NULL;
+}
+
+
+/* Closes a connection once it is done with */
+static bool server_drop (trace_server_t *s, server_client_t *c)
+{
+	if (!c->eof || (c->pending > 0) || (c->outlen > 0))
+		return false;
+
+	for (unsigned i = 0; i < s->count; i++)
+		if (s->clients[i] == c)
+		{
+			s->clients[i] = s->clients[--s->count];
+			break;
+		}
+	close (c->fd);
+	free (c->out);
+	free (c);
+	return true;
+}
+
+
+/* Gives up on a client that cannot take its replies */
+static bool server_break (trace_server_t *s, server_client_t *c)
+{
+	c->eof = c->broken = true;
+	c->len = c->outlen = 0;
+	shutdown (c->fd, SHUT_RDWR);
+	return server_drop (s, c);
+}
+
+
+/**
+ * Writes as much of the queued replies as the client socket accepts.
+ * @return true if the connection was closed.
+ */
+static bool server_write (trace_server_t *s, server_client_t *c)
+{
+	size_t done = 0;
+
+	while (done < c->outlen)
+	{
+		ssize_t val = send (c->fd, c->out + done, c->outlen - done,
+		                    MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (val < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+
+			return server_break (s, c);
+		}
+		done += val;
+	}
+
+	c->outlen -= done;
+	memmove (c->out, c->out + done, c->outlen);
+	return server_drop (s, c);
+}
+
+
+static int server_push (trace_server_t *s, const trace_request_t *req)
+{
+	if (s->tail - s->head == s->size)
+	{
+		unsigned size = s->size ? (2 * s->size) : 64;
+		trace_request_t *q = malloc (size * sizeof (*q));
+		if (q == NULL)
+			return -1;
+
+		for (unsigned i = 0; i < s->size; i++)
+			q[i] = s->queue[(s->head + i) % s->size];
+		free (s->queue);
+		s->queue = q;
+		s->tail -= s->head;
+		s->head = 0;
+		s->size = size;
+	}
+
+	s->queue[s->tail++ % s->size] = *req;
+	return 0;
+}
+
+
+static bool parse_uint (const char *str, unsigned max, unsigned *res)
+{
+	char *end;
+	unsigned long l;
+
+	if (str == NULL)
+		return false;
+	l = strtoul (str, &end, 10);
+	if ((end == str) || *end || (l > max))
+		return false;
+	*res = l;
+	return true;
+}
+
+
+static void server_parse (trace_server_t *s, int fd, char *line)
+{
+	static const struct
+	{
+		char name[8];
+		const tracetype *type;
+	} types[] =
+	{
+		{ "udp",     &udp_type },
+		{ "udplite", &udplite_type },
+		{ "icmp",    &echo_type },
+		{ "syn",     &syn_type },
+		{ "ack",     &ack_type },
+	};
+	trace_request_t req = s->defaults;
+	char *tok, *saveptr;
+
+	req.fd = fd;
+	req.error = NULL;
+
+	tok = strtok_r (line, " \t\r\n", &saveptr);
+	if (tok == NULL)
+		return; // blank line
+	if (strlen (tok) >= sizeof (req.host))
+		req.error = "invalid destination";
+	else
+		strcpy (req.host, tok);
+
+	while ((req.error == NULL)
+	    && ((tok = strtok_r (NULL, " \t\r\n", &saveptr)) != NULL))
+	{
+		bool ok = false;
+
+		for (unsigned i = 0; i < sizeof (types) / sizeof (types[0]); i++)
+			if (!strcmp (tok, types[i].name))
+			{
+				req.type = types[i].type;
+				ok = true;
+			}
+
+		if (ok)
+			continue;
+
+		char *arg = strtok_r (NULL, " \t\r\n", &saveptr);
+
+		if (!strcmp (tok, "port"))
+		{
+			ok = (arg != NULL) && (strlen (arg) < sizeof (req.port));
+			if (ok)
+				strcpy (req.port, arg);
+		}
+		else
+		if (!strcmp (tok, "first"))
+			ok = parse_uint (arg, 255, &req.min_ttl) && (req.min_ttl > 0);
+		else
+		if (!strcmp (tok, "max"))
+			ok = parse_uint (arg, 255, &req.max_ttl) && (req.max_ttl > 0);
+		else
+		if (!strcmp (tok, "probes"))
+			ok = parse_uint (arg, 255, &req.retries) && (req.retries > 0);
+		else
+		if (!strcmp (tok, "wait"))
+			ok = parse_uint (arg, 60, &req.timeout);
+
+		if (!ok)
+			req.error = "invalid request";
+	}
+
+	server_client_t *c = server_find (s, fd);
+	if (c->pending >= SERVER_PENDING)
+	{
+		server_break (s, c); // not reading its replies
+		return;
+	}
+
+	c->pending++;
+	if (server_push (s, &req))
+		c->rejected++; // answered by server_pop()
+}
+
+
+/* Reads requests from a client, one per line */
+static void server_read (trace_server_t *s, server_client_t *c)
+{
+	ssize_t val = recv (c->fd, c->buf + c->len, sizeof (c->buf) - c->len,
+	                    MSG_DONTWAIT);
+	if (val <= 0)
+	{
+		if ((val == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+		{
+			c->eof = true;
+			shutdown (c->fd, SHUT_RD);
+			server_drop (s, c);
+		}
+		return;
+	}
+	c->len += val;
+
+	char *line = c->buf, *nl;
+	while ((nl = memchr (line, '\n', c->buf + c->len - line)) != NULL)
+	{
+		*nl = '\0';
+		server_parse (s, c->fd, line);
+		if (c->broken)
+			return;
+		line = nl + 1;
+	}
+
+	c->len -= line - c->buf;
+	memmove (c->buf, line, c->len);
+
+	if (c->len == sizeof (c->buf))
+	{
+		/* Line too long: the connection cannot be trusted anymore */
+		c->eof = true;
+		c->len = 0;
+		shutdown (c->fd, SHUT_RD);
+		server_drop (s, c);
+	}
+}
+
+
+int server_poll (trace_server_t *s, int timeout)
+{
+	struct pollfd ufd[1 + SERVER_CLIENTS];
+	server_client_t *tab[SERVER_CLIENTS];
+	unsigned n = 0;
+
+	ufd[0].fd = s->fd;
+	ufd[0].events = (s->count < SERVER_CLIENTS) ? POLLIN : 0;
+	for (unsigned i = 0; i < s->count; i++)
+	{
+		server_client_t *c = s->clients[i];
+		short events = (c->eof ? 0 : POLLIN) | (c->outlen ? POLLOUT : 0);
+
+		if (events)
+		{
+			tab[n] = c;
+			ufd[1 + n].fd = c->fd;
+			ufd[1 + n].events = events;
+			n++;
+		}
+	}
+
+	if (poll (ufd, 1 + n, timeout) < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		short revents = ufd[1 + i].revents;
+
+		if ((revents & ~POLLIN) && (tab[i]->outlen > 0)
+		 && server_write (s, tab[i]))
+			continue; // closed
+		if ((revents & (POLLIN | POLLHUP | POLLERR)) && !tab[i]->eof)
+			server_read (s, tab[i]);
+	}
+
+	if (ufd[0].revents & POLLIN)
+	{
+		int fd = accept4 (s->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (fd == -1)
+			return 0;
+
+		server_client_t *c = malloc (sizeof (*c));
+		if (c == NULL)
+		{
+			close (fd);
+			return 0;
+		}
+		memset (c, 0, sizeof (*c));
+		c->fd = fd;
+		s->clients[s->count++] = c;
+	}
+	return 0;
+}
+
+
+bool server_pop (trace_server_t *s, trace_request_t *req)
+{
+	if (s->head != s->tail)
+	{
+		*req = s->queue[s->head++ % s->size];
+		return true;
+	}
+
+	/* Requests that could not be queued */
+	for (unsigned i = 0; i < s->count; i++)
+	{
+		server_client_t *c = s->clients[i];
+
+		if (c->rejected > 0)
+		{
+			c->rejected--;
+			*req = s->defaults;
+			req->fd = c->fd;
+			req->host[0] = '\0';
+			req->error = "out of memory";
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void server_done (trace_server_t *s, int fd, const void *reply, size_t len)
+{
+	server_client_t *c = server_find (s, fd);
+
+	if ((c == NULL) || (c->pending == 0))
+		return;
+
+	c->pending--;
+
+	if (!c->broken && (len > 0))
+	{
+		if (len > SERVER_OUTPUT - c->outlen)
+		{
+			server_break (s, c); // not reading its replies
+			return;
+		}
+
+		if (c->outlen + len > c->outsize)
+		{
+			size_t size = c->outlen + len;
+			char *out = realloc (c->out, size);
+			if (out == NULL)
+			{
+				server_break (s, c);
+				return;
+			}
+			c->out = out;
+			c->outsize = size;
+		}
+
+		memcpy (c->out + c->outlen, reply, len);
+		c->outlen += len;
+		server_write (s, c);
+		return;
+	}
+	server_drop (s, c);
+}
@@ -0,0 +1,952 @@
+/*
+ * trace-sim.c - simulated network for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * Instead of raw sockets, the engine gets one end of datagram socket
+ * pairs, so that poll() works as usual. Probes are answered synchronously
+ * by walking the route to their destination in the topology, and the
+ * responses are written to the socket pairs by a delivery thread, once
+ * their round-trip time has elapsed. Each datagram starts with a
+ * sim_header_t giving the source address and hop limit of the response.
+ *
+ * The topology file has one statement per line:
+ *   source <address>
+ *   seed <number>
+ *   node <name> <address> [delay <ms>] [loss <%>] [rate <pps>]
+ *        [burst <count>] [silent] [drop] [reject]
+ *   route <prefix>/<length> <node>[|<node>...] ... [delay <ms>]
+ *         [loss <%>] [open] [silent]
+ * A node delay is the one-way delay from the previous hop. Its ICMPv6
+ * errors are rate-limited by a token bucket if rate is set. A silent node
+ * never sends errors, while drop and reject filter the probes that it
+ * would forward, the latter with an administratively prohibited error.
+ * Alternative nodes in a route are picked by a hash of the probe flow
+ * (equal-cost multipath). The destination answers after the last node;
+ * TCP ports are closed unless open is set. Losses are drawn from a
+ * pseudo-random generator, so runs are reproducible for a given seed.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gettext.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h> /* inet_pton() */
+
+#include "traceroute.h"
+#include "gettime.h"
+
+#define SIM_MAX_ALTS    8 // equal-cost nodes per hop
+#define SIM_MAX_HOPS   64
+#define SIM_MAX_SOCKETS 8
+#define SIM_MAX_PACKET 1232 // ICMPv6 errors payload, as per RFC 4443
+
+#define SIM_SILENT 0x1
+#define SIM_DROP   0x2
+#define SIM_REJECT 0x4
+#define SIM_OPEN   0x8
+
+typedef struct sim_node
+{
+	char name[32];
+	struct in6_addr addr;
+	int64_t delay; // nanoseconds
+	uint32_t loss; // probability * 2^32
+	unsigned flags;
+	unsigned rate, burst; // ICMPv6 errors token bucket
+	double tokens;
+	int64_t last;
+} sim_node_t;
+
+typedef struct sim_route
+{
+	struct in6_addr prefix;
+	unsigned plen;
+	unsigned hops;
+	struct
+	{
+		unsigned count;
+		unsigned node[SIM_MAX_ALTS];
+	} hop[SIM_MAX_HOPS];
+	int64_t delay;
+	uint32_t loss;
+	unsigned flags;
+} sim_route_t;
+
+typedef struct sim_header
+{
+	struct sockaddr_in6 from;
+	int hlim;
+} sim_header_t;
+
+typedef struct sim_event
+{
+	int64_t due;
+	uint64_t seq; // keeps the order of simultaneous events
+	int fd;
+	sim_header_t hdr;
+	size_t len;
+	uint8_t data[];
+} sim_event_t;
+
+struct trace_sim
+{
+	sim_node_t *nodes;
+	unsigned node_count;
+	sim_route_t *routes;
+	unsigned route_count;
+	struct in6_addr src;
+	uint64_t rand;
+
+	struct
+	{
+		int fd, peer;
+		int protocol;
+		bool connected;
+		struct sockaddr_in6 dst;
+	} socks[SIM_MAX_SOCKETS];
+	unsigned sock_count;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	sim_event_t **heap;
+	size_t heap_len, heap_size;
+	uint64_t seq;
+	bool stop;
+};
+
+
+static int64_t now_ns (void)
+{
+	struct timespec ts;
+
+	mono_gettime (&ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* xorshift64* pseudo-random generator */
+static uint32_t sim_random (trace_sim_t *sim)
+{
+	uint64_t x = sim->rand;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sim->rand = x;
+	return (x * UINT64_C(0x2545f4914f6cdd1d)) >> 32;
+}
+
+
+static bool sim_lost (trace_sim_t *sim, uint32_t loss)
+{
+	return (loss != 0) && (sim_random (sim) < loss);
+}
+
+
+/*** Topology file ***/
+/* Parses a decimal number (whatever the locale), multiplied by scale */
+static bool parse_decimal (const char *str, int64_t scale, int64_t *val)
+{
+	char *end;
+	unsigned long l = strtoul (str, &end, 10);
+
+	if ((end == str) || (*str == '-') || (l > 1000000))
+		return false;
+
+	*val = l * scale;
+	if (*end == '.')
+		for (end++; (*end >= '0') && (*end <= '9'); end++)
+		{
+			scale /= 10;
+			*val += (*end - '0') * scale;
+		}
+	return (*end == '\0') || !strcmp (end, "%");
+}
+
+
+static bool parse_ms (const char *str, int64_t *ns)
+{
+	return parse_decimal (str, 1000000, ns);
+}
+
+
+static bool parse_loss (const char *str, uint32_t *loss)
+{
+	int64_t ppm;
+
+	if (!parse_decimal (str, 10000, &ppm) || (ppm > 1000000))
+		return false;
+	*loss = (ppm >= 1000000) ? UINT32_MAX
+	                         : (uint32_t)((ppm << 32) / 1000000);
+	return true;
+}
+
+
+static bool parse_uint (const char *str, unsigned *val)
+{
+	char *end;
+	unsigned long l = strtoul (str, &end, 10);
+
+	if ((end == str) || *end || (l > 1000000000))
+		return false;
+	*val = l;
+	return true;
+}
+
+
+static int find_node (const trace_sim_t *sim, const char *name)
+{
+	for (unsigned i = 0; i < sim->node_count; i++)
+		if (!strcmp (sim->nodes[i].name, name))
+			return i;
+	return -1;
+}
+
+
+static bool parse_node (trace_sim_t *sim, char **saveptr)
+{
+	const char *name = strtok_r (NULL, " \t\n", saveptr);
+	const char *addr = strtok_r (NULL, " \t\n", saveptr);
+	sim_node_t node;
+
+	memset (&node, 0, sizeof (node));
+	if ((name == NULL) || (addr == NULL)
+	 || (strlen (name) >= sizeof (node.name)) || (find_node (sim, name) >= 0)
+	 || (inet_pton (AF_INET6, addr, &node.addr) != 1))
+		return false;
+	strcpy (node.name, name);
+
+	for (const char *tok; (tok = strtok_r (NULL, " \t\n", saveptr)) != NULL;)
+	{
+		const char *arg = NULL;
+
+		if (!strcmp (tok, "silent"))
+			node.flags |= SIM_SILENT;
+		else
+		if (!strcmp (tok, "drop"))
+			node.flags |= SIM_DROP;
+		else
+		if (!strcmp (tok, "reject"))
+			node.flags |= SIM_REJECT;
+		else
+		if ((arg = strtok_r (NULL, " \t\n", saveptr)) == NULL)
+			return false;
+		else
+		if (!strcmp (tok, "delay") ? !parse_ms (arg, &node.delay) :
+		    !strcmp (tok, "loss") ? !parse_loss (arg, &node.loss) :
+		    !strcmp (tok, "rate") ? !parse_uint (arg, &node.rate) :
+		    !strcmp (tok, "burst") ? !parse_uint (arg, &node.burst) : true)
+			return false;
+	}
+
+	if (node.burst == 0)
+		node.burst = 1;
+	node.tokens = node.burst;
+
+	sim_node_t *tab = realloc (sim->nodes,
+	                           (sim->node_count + 1) * sizeof (*tab));
+	if (tab == NULL)
+		return false;
+	sim->nodes = tab;
+	tab[sim->node_count++] = node;
+	return true;
+}
+
+
+static bool parse_route (trace_sim_t *sim, char **saveptr)
+{
+	char *prefix = strtok_r (NULL, " \t\n", saveptr);
+	sim_route_t *r = calloc (1, sizeof (*r));
+
+	if ((r == NULL) || (prefix == NULL))
+		goto error;
+
+	char *slash = strchr (prefix, '/');
+	if (slash != NULL)
+	{
+		*slash = '\0';
+		if (!parse_uint (slash + 1, &r->plen) || (r->plen > 128))
+			goto error;
+	}
+	else
+		r->plen = 128;
+	if (inet_pton (AF_INET6, prefix, &r->prefix) != 1)
+		goto error;
+
+	for (char *tok; (tok = strtok_r (NULL, " \t\n", saveptr)) != NULL;)
+	{
+		const char *arg;
+
+		if (!strcmp (tok, "open"))
+			r->flags |= SIM_OPEN;
+		else
+		if (!strcmp (tok, "silent"))
+			r->flags |= SIM_SILENT;
+		else
+		if (!strcmp (tok, "delay") || !strcmp (tok, "loss"))
+		{
+			arg = strtok_r (NULL, " \t\n", saveptr);
+			if ((arg == NULL)
+			 || ((tok[0] == 'd') ? !parse_ms (arg, &r->delay)
+			                     : !parse_loss (arg, &r->loss)))
+				goto error;
+		}
+		else
+		{
+			/* A hop: one or more alternative node names */
+			char *alt, *altptr;
+
+			if (r->hops >= SIM_MAX_HOPS)
+				goto error;
+			for (alt = strtok_r (tok, "|", &altptr); alt != NULL;
+			     alt = strtok_r (NULL, "|", &altptr))
+			{
+				int n = find_node (sim, alt);
+				if ((n < 0) || (r->hop[r->hops].count >= SIM_MAX_ALTS))
+					goto error;
+				r->hop[r->hops].node[r->hop[r->hops].count++] = n;
+			}
+			r->hops++;
+		}
+	}
+
+	sim_route_t *tab = realloc (sim->routes,
+	                            (sim->route_count + 1) * sizeof (*tab));
+	if (tab == NULL)
+		goto error;
+	sim->routes = tab;
+	tab[sim->route_count++] = *r;
+	free (r);
+	return true;
+
+error:
+	free (r);
+	return false;
+}
+
+
+static int sim_load (trace_sim_t *sim, FILE *stream, const char *path)
+{
+	char buf[1024];
+	unsigned lineno = 0;
+
+	while (fgets (buf, sizeof (buf), stream) != NULL)
+	{
+		char *saveptr;
+		const char *arg;
+		bool ok = true;
+
+		lineno++;
+		buf[strcspn (buf, "#")] = '\0';
+
+		const char *tok = strtok_r (buf, " \t\n", &saveptr);
+		if (tok == NULL)
+			continue;
+
+		if (!strcmp (tok, "node"))
+			ok = parse_node (sim, &saveptr);
+		else
+		if (!strcmp (tok, "route"))
+			ok = parse_route (sim, &saveptr);
+		else
+		if (!strcmp (tok, "source"))
+			ok = ((arg = strtok_r (NULL, " \t\n", &saveptr)) != NULL)
+			  && (inet_pton (AF_INET6, arg, &sim->src) == 1);
+		else
+		if (!strcmp (tok, "seed"))
+		{
+			unsigned seed;
+
+			ok = ((arg = strtok_r (NULL, " \t\n", &saveptr)) != NULL)
+			  && parse_uint (arg, &seed);
+			if (ok)
+				sim->rand = seed ? seed : 1;
+		}
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			fprintf (stderr, _("%s: line %u: invalid topology entry\n"),
+			         path, lineno);
+			return -1;
+		}
+	}
+
+	if (ferror (stream))
+	{
+		perror (path);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*** Delivery ***/
+static bool event_before (const sim_event_t *a, const sim_event_t *b)
+{
+	return (a->due < b->due) || ((a->due == b->due) && (a->seq < b->seq));
+}
+
+
+static void heap_push (trace_sim_t *sim, sim_event_t *ev)
+{
+	size_t i = sim->heap_len++;
+
+	while (i > 0)
+	{
+		size_t parent = (i - 1) / 2;
+
+		if (!event_before (ev, sim->heap[parent]))
+			break;
+		sim->heap[i] = sim->heap[parent];
+		i = parent;
+	}
+	sim->heap[i] = ev;
+}
+
+
+static sim_event_t *heap_pop (trace_sim_t *sim)
+{
+	sim_event_t *top = sim->heap[0];
+	sim_event_t *last = sim->heap[--sim->heap_len];
+	size_t i = 0;
+
+	for (;;)
+	{
+		size_t child = 2 * i + 1;
+
+		if (child >= sim->heap_len)
+			break;
+		if ((child + 1 < sim->heap_len)
+		 && event_before (sim->heap[child + 1], sim->heap[child]))
+			child++;
+		if (!event_before (sim->heap[child], last))
+			break;
+		sim->heap[i] = sim->heap[child];
+		i = child;
+	}
+	if (sim->heap_len > 0)
+		sim->heap[i] = last;
+	return top;
+}
+
+
+static void *sim_thread (void *data)
+{
+	trace_sim_t *sim = data;
+
+	pthread_mutex_lock (&sim->lock);
+	while (!sim->stop)
+	{
+		if (sim->heap_len == 0)
+		{
+			pthread_cond_wait (&sim->wait, &sim->lock);
+			continue;
+		}
+
+		sim_event_t *ev = sim->heap[0];
+		if (ev->due > now_ns ())
+		{
+			struct timespec ts =
+			{
+				.tv_sec = ev->due / 1000000000,
+				.tv_nsec = ev->due % 1000000000,
+			};
+			pthread_cond_timedwait (&sim->wait, &sim->lock, &ts);
+			continue;
+		}
+
+		heap_pop (sim);
+		pthread_mutex_unlock (&sim->lock);
+
+		struct iovec iov[2] =
+		{
+			{ .iov_base = &ev->hdr, .iov_len = sizeof (ev->hdr) },
+			{ .iov_base = ev->data, .iov_len = ev->len },
+		};
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+		sendmsg (ev->fd, &msg, MSG_DONTWAIT); // lost if the queue is full
+		free (ev);
+		pthread_mutex_lock (&sim->lock);
+	}
+	pthread_mutex_unlock (&sim->lock);
+	return NULL;
+}
+
+
+/* Schedules a response to the socket of the given protocol */
+static void sim_deliver (trace_sim_t *sim, int protocol, bool last,
+                         int64_t due, const struct in6_addr *from, int hlim,
+                         const void *data, size_t len)
+{
+	int fd = -1;
+
+	for (unsigned i = 0; i < sim->sock_count; i++)
+		if ((sim->socks[i].protocol == protocol)
+		 && ((fd == -1) || last))
+			fd = sim->socks[i].peer;
+	if (fd == -1)
+		return;
+
+	sim_event_t *ev = malloc (sizeof (*ev) + len);
+	if (ev == NULL)
+		return;
+
+	ev->due = due;
+	ev->fd = fd;
+	memset (&ev->hdr, 0, sizeof (ev->hdr));
+	ev->hdr.from.sin6_family = AF_INET6;
+	ev->hdr.from.sin6_addr = *from;
+	ev->hdr.hlim = hlim;
+	ev->len = len;
+	memcpy (ev->data, data, len);
+
+	pthread_mutex_lock (&sim->lock);
+	if (sim->heap_len >= sim->heap_size)
+	{
+		size_t size = sim->heap_size ? (2 * sim->heap_size) : 256;
+		sim_event_t **heap = realloc (sim->heap, size * sizeof (*heap));
+		if (heap == NULL)
+		{
+			pthread_mutex_unlock (&sim->lock);
+			free (ev);
+			return;
+		}
+		sim->heap = heap;
+		sim->heap_size = size;
+	}
+	ev->seq = sim->seq++;
+	heap_push (sim, ev);
+	if (sim->heap[0] == ev)
+		pthread_cond_signal (&sim->wait);
+	pthread_mutex_unlock (&sim->lock);
+}
+
+
+/* Sends an ICMPv6 error quoting the probe */
+static void sim_error (trace_sim_t *sim, int protocol, int64_t due,
+                       const struct in6_addr *from, int hlim,
+                       uint8_t type, uint8_t code,
+                       const struct in6_addr *dst, const void *probe,
+                       size_t len)
+{
+	struct
+	{
+		struct icmp6_hdr hdr;
+		struct ip6_hdr ip6;
+		uint8_t payload[SIM_MAX_PACKET - sizeof (struct ip6_hdr)];
+	} pkt;
+
+	memset (&pkt, 0, sizeof (pkt));
+	pkt.hdr.icmp6_type = type;
+	pkt.hdr.icmp6_code = code;
+	pkt.ip6.ip6_vfc = 0x60;
+	pkt.ip6.ip6_plen = htons (len);
+	pkt.ip6.ip6_nxt = protocol;
+	pkt.ip6.ip6_hlim = 1;
+	pkt.ip6.ip6_src = sim->src;
+	pkt.ip6.ip6_dst = *dst;
+
+	if (len > sizeof (pkt.payload))
+		len = sizeof (pkt.payload);
+	memcpy (pkt.payload, probe, len);
+
+	sim_deliver (sim, IPPROTO_ICMPV6, false, due, from, hlim, &pkt,
+	             sizeof (pkt.hdr) + sizeof (pkt.ip6) + len);
+}
+
+
+/* Answers a probe that reached its destination */
+static void sim_reply (trace_sim_t *sim, int protocol, int64_t due,
+                       const sim_route_t *r, const struct in6_addr *dst,
+                       int hlim, const void *probe, size_t len)
+{
+	switch (protocol)
+	{
+		case IPPROTO_ICMPV6:
+		{
+			struct icmp6_hdr reply;
+
+			if (len < sizeof (reply))
+				return;
+			memcpy (&reply, probe, sizeof (reply));
+			if (reply.icmp6_type != ICMP6_ECHO_REQUEST)
+				return;
+			reply.icmp6_type = ICMP6_ECHO_REPLY;
+			sim_deliver (sim, protocol, true, due, dst, hlim, &reply,
+			             sizeof (reply));
+			break;
+		}
+
+		case IPPROTO_TCP:
+		{
+			struct tcphdr th, reply;
+
+			if (len < sizeof (th))
+				return;
+			memcpy (&th, probe, sizeof (th));
+			memset (&reply, 0, sizeof (reply));
+			reply.th_sport = th.th_dport;
+			reply.th_dport = th.th_sport;
+			reply.th_off = sizeof (reply) / 4;
+
+			if (th.th_flags & TH_SYN)
+			{
+				reply.th_ack = htonl (ntohl (th.th_seq) + 1);
+				if (r->flags & SIM_OPEN)
+				{
+					reply.th_seq = htonl (sim_random (sim));
+					reply.th_flags = TH_SYN | TH_ACK;
+				}
+				else
+					reply.th_flags = TH_RST | TH_ACK;
+			}
+			else
+			if (th.th_flags & TH_ACK)
+			{
+				reply.th_seq = th.th_ack;
+				reply.th_flags = TH_RST;
+			}
+			else
+				return;
+
+			sim_deliver (sim, protocol, true, due, dst, hlim, &reply,
+			             sizeof (reply));
+			break;
+		}
+
+		default: // UDP, UDP-Lite
+			sim_error (sim, protocol, due, dst, hlim, ICMP6_DST_UNREACH,
+			           ICMP6_DST_UNREACH_NOPORT, dst, probe, len);
+	}
+}
+
+
+static bool match (const struct in6_addr *addr, const sim_route_t *r)
+{
+	unsigned bytes = r->plen / 8, bits = r->plen % 8;
+
+	if (memcmp (addr, &r->prefix, bytes))
+		return false;
+	if (bits == 0)
+		return true;
+
+	uint8_t mask = 0xff << (8 - bits);
+	return ((addr->s6_addr[bytes] ^ r->prefix.s6_addr[bytes]) & mask) == 0;
+}
+
+
+/* Hash of the flow identifiers, as routers balance equal-cost paths */
+static uint32_t flow_hash (const struct in6_addr *dst, int protocol,
+                           const uint8_t *probe, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	for (unsigned i = 0; i < 16; i++)
+		h = (h ^ dst->s6_addr[i]) * 16777619u;
+	h = (h ^ protocol) * 16777619u;
+	if ((protocol != IPPROTO_ICMPV6) && (len >= 4))
+		for (unsigned i = 0; i < 4; i++) // ports
+			h = (h ^ probe[i]) * 16777619u;
+	return h;
+}
+
+
+/* Whether a node may send an ICMPv6 error now */
+static bool sim_ratelimit (sim_node_t *node, int64_t now)
+{
+	if (node->flags & SIM_SILENT)
+		return false;
+	if (node->rate == 0)
+		return true;
+
+	node->tokens += (now - node->last) * 1e-9 * node->rate;
+	if (node->tokens > node->burst)
+		node->tokens = node->burst;
+	node->last = now;
+
+	if (node->tokens < 1.)
+		return false;
+	node->tokens -= 1.;
+	return true;
+}
+
+
+static int sim_find (const trace_sim_t *sim, int fd)
+{
+	for (unsigned i = 0; i < sim->sock_count; i++)
+		if (sim->socks[i].fd == fd)
+			return i;
+	errno = ENOTSOCK;
+	return -1;
+}
+
+
+/*** Socket interface ***/
+trace_sim_t *sim_open (const char *path)
+{
+	FILE *stream = fopen (path, "r");
+	if (stream == NULL)
+	{
+		perror (path);
+		return NULL;
+	}
+
+	trace_sim_t *sim = calloc (1, sizeof (*sim));
+	if (sim == NULL)
+	{
+		perror (path);
+		fclose (stream);
+		return NULL;
+	}
+	sim->src = in6addr_loopback;
+	sim->rand = 1;
+
+	int val = sim_load (sim, stream, path);
+	fclose (stream);
+	if (val)
+		goto error;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&sim->wait, &attr);
+	pthread_condattr_destroy (&attr);
+	pthread_mutex_init (&sim->lock, NULL);
+
+	val = pthread_create (&sim->thread, NULL, sim_thread, sim);
+	if (val == 0)
+		return sim;
+
+	fprintf (stderr, "pthread_create: %s\n", strerror (val));
+	pthread_cond_destroy (&sim->wait);
+	pthread_mutex_destroy (&sim->lock);
+error:
+	free (sim->routes);
+	free (sim->nodes);
+	free (sim);
+	return NULL;
+}
+
+
+void sim_close (trace_sim_t *sim)
+{
+	pthread_mutex_lock (&sim->lock);
+	sim->stop = true;
+	pthread_cond_signal (&sim->wait);
+	pthread_mutex_unlock (&sim->lock);
+	pthread_join (sim->thread, NULL);
+
+	while (sim->heap_len > 0)
+		free (heap_pop (sim));
+	free (sim->heap);
+	for (unsigned i = 0; i < sim->sock_count; i++)
+		close (sim->socks[i].peer);
+	pthread_cond_destroy (&sim->wait);
+	pthread_mutex_destroy (&sim->lock);
+	free (sim->routes);
+	free (sim->nodes);
+	free (sim);
+}
+
+
+int sim_socket (trace_sim_t *sim, int protocol)
+{
+	int fds[2];
+
+	if (sim->sock_count >= SIM_MAX_SOCKETS)
+	{
+		errno = EMFILE;
+		return -1;
+	}
+	if (socketpair (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds))
+		return -1;
+
+	/* Large enough for a full scan worth of responses */
+	setsockopt (fds[0], SOL_SOCKET, SO_RCVBUF, &(int){ 4 << 20 },
+	            sizeof (int));
+
+	unsigned i = sim->sock_count++;
+	memset (&sim->socks[i], 0, sizeof (sim->socks[i]));
+	sim->socks[i].fd = fds[0];
+	sim->socks[i].peer = fds[1];
+	sim->socks[i].protocol = protocol;
+	return fds[0];
+}
+
+
+int sim_bind (trace_sim_t *sim, int fd, const struct sockaddr_in6 *addr)
+{
+	if (sim_find (sim, fd) < 0)
+		return -1;
+	if (!IN6_IS_ADDR_UNSPECIFIED (&addr->sin6_addr))
+		sim->src = addr->sin6_addr;
+	return 0;
+}
+
+
+int sim_connect (trace_sim_t *sim, int fd, const struct sockaddr_in6 *dst)
+{
+	int i = sim_find (sim, fd);
+	if (i < 0)
+		return -1;
+
+	sim->socks[i].dst = *dst;
+	sim->socks[i].connected = true;
+	return 0;
+}
+
+
+int sim_getsockname (trace_sim_t *sim, int fd, struct sockaddr_in6 *addr)
+{
+	if (sim_find (sim, fd) < 0)
+		return -1;
+
+	memset (addr, 0, sizeof (*addr));
+	addr->sin6_family = AF_INET6;
+	addr->sin6_addr = sim->src;
+	return 0;
+}
+
+
+int sim_send (trace_sim_t *sim, int fd, const struct sockaddr_in6 *dst,
+              const void *data, size_t len, int hlim)
+{
+	int i = sim_find (sim, fd);
+	if (i < 0)
+		return -1;
+
+	if (dst == NULL)
+	{
+		if (!sim->socks[i].connected)
+		{
+			errno = EDESTADDRREQ;
+			return -1;
+		}
+		dst = &sim->socks[i].dst;
+	}
+
+	/* Longest prefix match */
+	const sim_route_t *r = NULL;
+	for (unsigned j = 0; j < sim->route_count; j++)
+		if (match (&dst->sin6_addr, sim->routes + j)
+		 && ((r == NULL) || (sim->routes[j].plen > r->plen)))
+			r = sim->routes + j;
+	if (r == NULL)
+	{
+		errno = ENETUNREACH;
+		return -1;
+	}
+
+	int protocol = sim->socks[i].protocol;
+	uint32_t hash = flow_hash (&dst->sin6_addr, protocol, data, len);
+	int64_t now = now_ns (), delay = 0;
+
+	if (hlim < 0)
+		hlim = 64;
+
+	for (unsigned h = 0; h < r->hops; h++)
+	{
+		unsigned n = r->hop[h].node[(hash ^ (h * 0x9e3779b9u))
+		                            % r->hop[h].count];
+		sim_node_t *node = sim->nodes + n;
+
+		delay += node->delay;
+		if (sim_lost (sim, node->loss))
+			return 0;
+
+		if ((unsigned)hlim == h + 1)
+		{
+			if (sim_ratelimit (node, now))
+				sim_error (sim, protocol, now + 2 * delay, &node->addr,
+				           64 - h, ICMP6_TIME_EXCEEDED,
+				           ICMP6_TIME_EXCEED_TRANSIT, &dst->sin6_addr,
+				           data, len);
+			return 0;
+		}
+
+		/* Filters the probes to forward */
+		if (node->flags & SIM_DROP)
+			return 0;
+		if (node->flags & SIM_REJECT)
+		{
+			if (sim_ratelimit (node, now))
+				sim_error (sim, protocol, now + 2 * delay, &node->addr,
+				           64 - h, ICMP6_DST_UNREACH,
+				           ICMP6_DST_UNREACH_ADMIN, &dst->sin6_addr,
+				           data, len);
+			return 0;
+		}
+	}
+
+	delay += r->delay;
+	if (!(r->flags & SIM_SILENT) && !sim_lost (sim, r->loss))
+		sim_reply (sim, protocol, now + 2 * delay, r, &dst->sin6_addr,
+		           64 - r->hops, data, len);
+	return 0;
+}
+
+
+ssize_t sim_recv (trace_sim_t *sim, int fd, void *buf, size_t len,
+                  struct sockaddr_in6 *addr, int *hlim)
+{
+	sim_header_t hdr;
+	struct iovec iov[2] =
+	{
+		{ .iov_base = &hdr, .iov_len = sizeof (hdr) },
+		{ .iov_base = buf, .iov_len = len },
+	};
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+	(void)sim;
+	ssize_t val = recvmsg (fd, &msg, 0);
+	if (val == -1)
+		return -1;
+	if ((size_t)val < sizeof (hdr))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (addr != NULL)
+		*addr = hdr.from;
+	*hlim = hdr.hlim;
+	return val - sizeof (hdr);
+}
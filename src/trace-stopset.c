@@ -0,0 +1,143 @@
+/*
+ * trace-stopset.c - set of known hops for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * Open addressing hash set of (hop limit, address) pairs, with linear
+ * probing. The table is kept at most half full.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "traceroute.h"
+
+typedef struct stopset_entry
+{
+	struct in6_addr addr;
+	uint8_t hlim; // zero if the entry is free
+} stopset_entry_t;
+
+struct trace_stopset
+{
+	stopset_entry_t *tab;
+	size_t size; // power of two
+	size_t count;
+};
+
+
+static size_t hash (unsigned hlim, const struct in6_addr *addr)
+{
+	uint64_t a, b;
+
+	memcpy (&a, addr->s6_addr, 8);
+	memcpy (&b, addr->s6_addr + 8, 8);
+	a = (a ^ (b * UINT64_C(0x9e3779b97f4a7c15)) ^ hlim)
+	    * UINT64_C(0xff51afd7ed558ccd);
+	return a ^ (a >> 32);
+}
+
+
+static stopset_entry_t *lookup (const trace_stopset_t *s, unsigned hlim,
+                                const struct in6_addr *addr)
+{
+	size_t i = hash (hlim, addr) & (s->size - 1);
+
+	for (;;)
+	{
+		stopset_entry_t *e = s->tab + i;
+
+		if ((e->hlim == 0)
+		 || ((e->hlim == hlim) && !memcmp (&e->addr, addr, 16)))
+			return e;
+		i = (i + 1) & (s->size - 1);
+	}
+}
+
+
+trace_stopset_t *stopset_create (void)
+{
+	trace_stopset_t *s = malloc (sizeof (*s));
+	if (s == NULL)
+		return NULL;
+
+	s->size = 1024;
+	s->count = 0;
+	s->tab = calloc (s->size, sizeof (*s->tab));
+	if (s->tab == NULL)
+	{
+		free (s);
+		return NULL;
+	}
+	return s;
+}
+
+
+void stopset_destroy (trace_stopset_t *s)
+{
+	free (s->tab);
+	free (s);
+}
+
+
+bool stopset_contains (const trace_stopset_t *s, unsigned hlim,
+                       const struct in6_addr *addr)
+{
+	return lookup (s, hlim, addr)->hlim != 0;
+}
+
+
+int stopset_add (trace_stopset_t *s, unsigned hlim,
+                 const struct in6_addr *addr)
+{
+	if ((hlim == 0) || (hlim > 255))
+		return -1;
+
+	if (2 * (s->count + 1) > s->size)
+	{
+		trace_stopset_t n = { .size = 2 * s->size, .count = s->count };
+
+		n.tab = calloc (n.size, sizeof (*n.tab));
+		if (n.tab == NULL)
+			return -1;
+
+		for (size_t i = 0; i < s->size; i++)
+			if (s->tab[i].hlim != 0)
+				*lookup (&n, s->tab[i].hlim, &s->tab[i].addr) = s->tab[i];
+
+		free (s->tab);
+		*s = n;
+	}
+
+	stopset_entry_t *e = lookup (s, hlim, addr);
+	if (e->hlim == 0)
+	{
+		e->addr = *addr;
+		e->hlim = hlim;
+		s->count++;
+	}
+	return 0;
+}
@@ -28,7 +28,6 @@
 #include <stdint.h>
 
 #include <sys/types.h>
-#include <unistd.h> // getpid()
 #include <sys/socket.h> // SOCK_STREAM
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -44,7 +43,8 @@
 
 /* TCP/SYN probes */
 static ssize_t
-send_syn_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
+send_syn_probe (int fd, unsigned ttl, uint16_t id, size_t plen,
+                uint16_t port)
 {
 	if (plen < sizeof (struct tcphdr))
 		plen = sizeof (struct tcphdr);
@@ -59,7 +59,7 @@ send_syn_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
 	memset(packet, 0, plen);
 	packet->th.th_sport = sport;
 	packet->th.th_dport = port;
-	packet->th.th_seq = htonl((ttl << 24) | (n << 16) | (getpid() & 0xffff));
+	packet->th.th_seq = htonl(((uint32_t)ident << 16) | id);
 	packet->th.th_off = sizeof (packet->th) / 4;
 	packet->th.th_flags = TH_SYN | (ecn ? (TH_ECE | TH_CWR) : 0);
 	packet->th.th_win = htons(TCP_WINDOW);
@@ -69,7 +69,7 @@ send_syn_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
 
 
 static ssize_t
-parse_syn_resp (const void *data, size_t len, int *ttl, unsigned *n,
+parse_syn_resp (const void *data, size_t len, int *ttl, int *id,
                 uint16_t port)
 {
 	const struct tcphdr *pth = (const struct tcphdr *)data;
@@ -84,17 +84,17 @@ parse_syn_resp (const void *data, size_t len, int *ttl, unsigned *n,
 		return -1;
 
 	seq = ntohl (pth->th_ack) - 1;
-	if ((seq & 0xffff) != (uint16_t)getpid ())
+	if ((seq >> 16) != ident)
 		return -1;
 
-	*ttl = seq >> 24;
-	*n = (seq >> 16) & 0xff;
+	(void)ttl;
+	*id = seq & 0xffff;
 	return 1 + ((pth->th_flags & TH_SYN) == TH_SYN);
 }
 
 
 static ssize_t
-parse_syn_error (const void *data, size_t len, int *ttl, unsigned *n,
+parse_syn_error (const void *data, size_t len, int *ttl, int *id,
                  uint16_t port)
 {
 	const struct tcphdr *pth = (const struct tcphdr *)data;
@@ -106,11 +106,11 @@ parse_syn_error (const void *data, size_t len, int *ttl, unsigned *n,
 		return -1;
 
 	seq = ntohl (pth->th_seq);
-	if ((seq & 0xffff) != (uint16_t)getpid ())
+	if ((seq >> 16) != ident)
 		return -1;
 
-	*ttl = seq >> 24;
-	*n = (seq >> 16) & 0xff;
+	(void)ttl;
+	*id = seq & 0xffff;
 	return 0;
 }
 
@@ -122,7 +122,8 @@ const tracetype syn_type =
 
 /* TCP/ACK probes */
 static ssize_t
-send_ack_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
+send_ack_probe (int fd, unsigned ttl, uint16_t id, size_t plen,
+                uint16_t port)
 {
 	if (plen < sizeof (struct tcphdr))
 		plen = sizeof (struct tcphdr);
@@ -137,7 +138,7 @@ send_ack_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
 	memset(packet, 0, plen);
 	packet->th.th_sport = sport;
 	packet->th.th_dport = port;
-	packet->th.th_ack = htonl((ttl << 24) | (n << 16) | (getpid () & 0xffff));
+	packet->th.th_ack = htonl(((uint32_t)ident << 16) | id);
 	packet->th.th_off = sizeof (packet->th) / 4;
 	packet->th.th_flags = TH_ACK;
 	packet->th.th_win = htons(TCP_WINDOW);
@@ -147,7 +148,7 @@ send_ack_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
 
 
 static ssize_t
-parse_ack_resp (const void *data, size_t len, int *ttl, unsigned *n,
+parse_ack_resp (const void *data, size_t len, int *ttl, int *id,
                 uint16_t port)
 {
 	const struct tcphdr *pth = (const struct tcphdr *)data;
@@ -163,17 +164,17 @@ parse_ack_resp (const void *data, size_t len, int *ttl, unsigned *n,
 		return -1;
 
 	seq = ntohl (pth->th_seq);
-	if ((seq & 0xffff) != (uint16_t)getpid ())
+	if ((seq >> 16) != ident)
 		return -1;
 
-	*ttl = seq >> 24;
-	*n = (seq >> 16) & 0xff;
+	(void)ttl;
+	*id = seq & 0xffff;
 	return 0;
 }
 
 
 static ssize_t
-parse_ack_error (const void *data, size_t len, int *ttl, unsigned *n,
+parse_ack_error (const void *data, size_t len, int *ttl, int *id,
                  uint16_t port)
 {
 	const struct tcphdr *pth = (const struct tcphdr *)data;
@@ -185,11 +186,11 @@ parse_ack_error (const void *data, size_t len, int *ttl, unsigned *n,
 		return -1;
 
 	seq = ntohl (pth->th_ack);
-	if ((seq & 0xffff) != (uint16_t)getpid ())
+	if ((seq >> 16) != ident)
 		return -1;
 
-	*ttl = seq >> 24;
-	*n = (seq >> 16) & 0xff;
+	(void)ttl;
+	*id = seq & 0xffff;
 	return 0;
 }
 
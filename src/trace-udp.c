@@ -34,9 +34,14 @@
 #include "traceroute.h"
 
 
-/* UDP probes (traditional traceroute) */
+/*
+ * UDP probes (traditional traceroute). The destination port encodes the
+ * hop limit; if the packet is long enough, the payload starts with the
+ * process identifier and the probe ID.
+ */
 static ssize_t
-send_udp_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
+send_udp_probe (int fd, unsigned ttl, uint16_t id, size_t plen,
+                uint16_t port)
 {
 	if (plen < sizeof (struct udphdr))
 		plen = sizeof (struct udphdr);
@@ -49,7 +54,6 @@ send_udp_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
 	} *packet = (void *)buf;
 
 	memset(packet, 0, plen);
-	(void)n;
 	packet->uh.uh_sport = sport;
 	packet->uh.uh_dport = htons(ntohs(port) + ttl);
 	/* For UDP-Lite we have full checksum coverage, if only because the
@@ -57,18 +61,24 @@ send_udp_probe (int fd, unsigned ttl, unsigned n, size_t plen, uint16_t port)
 	 * we can set coverage to the length of the packet, even though zero
 	 * would be more idiosyncrasic. */
 	packet->uh.uh_ulen = htons(plen);
-	/*if (plen > sizeof (struct udphdr))
-		packet->payload[0] = (uint8_t)ttl;*/
+	if (plen >= sizeof (struct udphdr) + 4)
+	{
+		packet->payload[0] = ident >> 8;
+		packet->payload[1] = ident;
+		packet->payload[2] = id >> 8;
+		packet->payload[3] = id;
+	}
 
 	return send_payload(fd, packet, plen, ttl);
 }
 
 
 static ssize_t
-parse_udp_error (const void *data, size_t len, int *ttl, unsigned *n,
+parse_udp_error (const void *data, size_t len, int *ttl, int *id,
                  uint16_t port)
 {
 	const struct udphdr *puh = (const struct udphdr *)data;
+	const uint8_t *payload = (const uint8_t *)data + sizeof (*puh);
 	uint16_t rport;
 
 	if ((len < 4) || (puh->uh_sport != sport ))
@@ -79,8 +89,61 @@ parse_udp_error (const void *data, size_t len, int *ttl, unsigned *n,
 	if ((rport < port) || (rport > port + 255))
 		return -1;
 
+	/* Short probes only carry the hop limit */
+	if ((len >= sizeof (*puh) + 4)
+	 && (ntohs (puh->uh_ulen) >= sizeof (*puh) + 4))
+	{
+		if (((payload[0] << 8) | payload[1]) != ident)
+			return -1;
+		*id = (payload[2] << 8) | payload[3];
+	}
+
 	*ttl = rport - port;
-	*n = (unsigned)(-1);
+	return 0;
+}
+
+
+/*
+ * UDP probes from a datagram socket (unprivileged traceroute). The kernel
+ * writes the UDP header, and the destination port is that of the
+ * connected socket, so the payload always carries the process identifier
+ * and the probe ID. Errors are read from the socket error queue, quoting
+ * the payload only.
+ */
+static ssize_t
+send_udp_dgram_probe (int fd, unsigned ttl, uint16_t id, size_t plen,
+                      uint16_t port)
+{
+	if (plen < sizeof (struct udphdr) + 4)
+		plen = sizeof (struct udphdr) + 4;
+	plen -= sizeof (struct udphdr);
+
+	uint8_t payload[plen];
+
+	memset (payload, 0, plen);
+	payload[0] = ident >> 8;
+	payload[1] = ident;
+	payload[2] = id >> 8;
+	payload[3] = id;
+	(void)port;
+
+	return send_payload (fd, payload, plen, ttl);
+}
+
+
+static ssize_t
+parse_udp_dgram_error (const void *data, size_t len, int *ttl, int *id,
+                       uint16_t port)
+{
+	const uint8_t *payload = data;
+
+	if ((len < 4) || (((payload[0] << 8) | payload[1]) != ident))
+		return -1;
+
+	(void)ttl;
+	(void)port;
+
+	*id = (payload[2] << 8) | payload[3];
 	return 0;
 }
 
@@ -91,3 +154,6 @@ const tracetype udp_type =
 const tracetype udplite_type =
 	{ SOCK_DGRAM, IPPROTO_UDPLITE, 6,
 	  send_udp_probe, NULL, parse_udp_error };
+const tracetype udp_dgram_type =
+	{ SOCK_DGRAM, IPPROTO_UDP, -1,
+	  send_udp_dgram_probe, NULL, parse_udp_dgram_error };
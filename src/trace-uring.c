@@ -0,0 +1,610 @@
+/*
+ * trace-uring.c - io_uring I/O backend for IPv6 traceroute tool
+ */
+
+/*************************************************************************
+ *  This program is free software: you can redistribute and/or modify    *
+ *  it under the terms of the GNU General Public License as published by *
+ *  the Free Software Foundation, versions 2 or 3 of the license.        *
+ *                                                                       *
+ *  This program is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ *  GNU General Public License for more details.                         *
+ *                                                                       *
+ *  You should have received a copy of the GNU General Public License    *
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/*
+ * A minimal io_uring driver, using the raw system calls:
+ *  - each armed socket has one multishot recvmsg request, which picks
+ *    receive buffers from a ring of buffers registered with the kernel;
+ *  - sendmsg requests are queued in the submission ring, and only
+ *    submitted in batches when waiting for completions or flushing. Their headers
+ *    and payloads live in a preallocated array of send slots, recycled
+ *    on completion.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "traceroute.h"
+#include "gettime.h"
+
+#ifdef HAVE_IO_URING_MULTISHOT
+# include <unistd.h>
+# include <signal.h> // _NSIG
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+
+# define URING_RECV_BUFS 512 // power of two
+# define URING_RECV_SIZE 2048
+# define URING_MAX_FDS 2
+
+# define URING_KIND_SEND 1
+# define URING_KIND_RECV 2
+
+typedef struct uring_slot
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_in6 dst;
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (sizeof (int))];
+	} cmsg;
+	uint8_t *data;
+} uring_slot_t;
+
+struct trace_uring
+{
+	int fd;
+
+	/* Submission queue */
+	atomic_uint *sq_head, *sq_tail;
+	unsigned *sq_array, sq_mask, sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local; // next tail, not yet published
+	unsigned pending; // queued but not submitted
+	void *sq_ring;
+	size_t sq_ring_size, sqes_size;
+
+	/* Completion queue */
+	atomic_uint *cq_head, *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *cq_ring;
+	size_t cq_ring_size;
+
+	/* Registered receive buffers */
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	uint8_t *bufs;
+	uint16_t br_tail;
+
+	/* Multishot receives */
+	struct
+	{
+		int fd;
+		bool armed;
+		struct msghdr msg;
+	} recv[URING_MAX_FDS];
+	unsigned nrecv;
+	int recv_errnum; // receive failure, not re-armed
+
+	/* Send slots */
+	uring_slot_t *slots;
+	unsigned *free_slots, nfree, nslots;
+	size_t maxlen;
+	int errnum;
+
+	trace_uring_cb cb;
+	void *opaque;
+};
+
+
+static int sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+	return syscall (__NR_io_uring_setup, entries, p);
+}
+
+
+static int
+sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags, const void *arg, size_t argsz)
+{
+	return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+	                arg, argsz);
+}
+
+
+static int
+sys_io_uring_register (int fd, unsigned op, const void *arg, unsigned n)
+{
+	return syscall (__NR_io_uring_register, fd, op, arg, n);
+}
+
+
+static void uring_recycle (trace_uring_t *u, unsigned bid)
+{
+	struct io_uring_buf *b;
+
+	b = u->br->bufs + (u->br_tail & (URING_RECV_BUFS - 1));
+
+	b->addr = (uintptr_t)(u->bufs + bid * URING_RECV_SIZE);
+	b->len = URING_RECV_SIZE;
+	b->bid = bid;
+	u->br_tail++;
+	atomic_store_explicit ((_Atomic uint16_t *)&u->br->tail, u->br_tail,
+	                       memory_order_release);
+}
+
+
+static struct io_uring_sqe *uring_get_sqe (trace_uring_t *u)
+{
+	unsigned head = atomic_load_explicit (u->sq_head, memory_order_acquire);
+
+	if (u->sq_local - head >= u->sq_entries)
+		return NULL;
+
+	unsigned idx = u->sq_local++ & u->sq_mask;
+	struct io_uring_sqe *sqe = u->sqes + idx;
+
+	memset (sqe, 0, sizeof (*sqe));
+	u->sq_array[idx] = idx;
+	u->pending++;
+	return sqe;
+}
+
+
+static void uring_arm (trace_uring_t *u, unsigned i)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe (u);
+	if (sqe == NULL)
+		return; // re-armed after the next completions
+
+	u->recv[i].armed = true;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = u->recv[i].fd;
+	sqe->addr = (uintptr_t)&u->recv[i].msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = ((uint64_t)URING_KIND_RECV << 32) | i;
+}
+
+
+static void uring_complete_recv (trace_uring_t *u, unsigned i,
+                                 const struct io_uring_cqe *cqe)
+{
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		u->recv[i].armed = false; // out of buffers or error
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+	{
+		/* ENOBUFS only means that the buffer ring ran dry */
+		if ((cqe->res < 0) && (cqe->res != -ENOBUFS)
+		 && (u->recv_errnum == 0))
+			u->recv_errnum = -cqe->res;
+		return;
+	}
+
+	unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	uint8_t *buf = u->bufs + bid * URING_RECV_SIZE;
+	const struct msghdr *tmpl = &u->recv[i].msg;
+
+	if (cqe->res >= (int)sizeof (struct io_uring_recvmsg_out))
+	{
+		const struct io_uring_recvmsg_out *out = (const void *)buf;
+		size_t off = sizeof (*out) + tmpl->msg_namelen
+		             + tmpl->msg_controllen;
+
+		if ((size_t)cqe->res >= off)
+		{
+			struct sockaddr_in6 from;
+			size_t len = out->payloadlen;
+			int hlim = -1;
+
+			if (len > cqe->res - off)
+				len = cqe->res - off; // truncated
+
+			memset (&from, 0, sizeof (from));
+			memcpy (&from, buf + sizeof (*out),
+			        (out->namelen < sizeof (from)) ? out->namelen
+			                                       : sizeof (from));
+
+			struct msghdr hdr =
+			{
+				.msg_control = buf + sizeof (*out) + tmpl->msg_namelen,
+				.msg_controllen = out->controllen,
+			};
+			for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&hdr);
+			     cmsg != NULL;
+			     cmsg = CMSG_NXTHDR (&hdr, cmsg))
+				if ((cmsg->cmsg_level == IPPROTO_IPV6)
+				 && (cmsg->cmsg_type == IPV6_HOPLIMIT))
+					memcpy (&hlim, CMSG_DATA (cmsg), sizeof (hlim));
+
+			u->cb (u->opaque, u->recv[i].fd, buf + off, len, &from, hlim);
+		}
+	}
+
+	uring_recycle (u, bid);
+}
+
+
+/* Processes all available completions */
+static unsigned uring_reap (trace_uring_t *u)
+{
+	unsigned head = atomic_load_explicit (u->cq_head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit (u->cq_tail, memory_order_acquire);
+	unsigned n = tail - head;
+
+	for (; head != tail; head++)
+	{
+		struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+		unsigned idx = (uint32_t)cqe.user_data;
+
+		switch (cqe.user_data >> 32)
+		{
+			case URING_KIND_SEND:
+				if ((cqe.res < 0) && (u->errnum == 0))
+					u->errnum = -cqe.res;
+				u->free_slots[u->nfree++] = idx;
+				break;
+
+			case URING_KIND_RECV:
+				uring_complete_recv (u, idx, &cqe);
+				break;
+		}
+	}
+
+	atomic_store_explicit (u->cq_head, head, memory_order_release);
+
+	if (u->recv_errnum == 0)
+		for (unsigned i = 0; i < u->nrecv; i++)
+			if (!u->recv[i].armed)
+				uring_arm (u, i);
+	return n;
+}
+
+
+/**
+ * Submits the queued requests, and waits for completions until a deadline.
+ * @return the number of completions processed, or -1 on error, including
+ * if a receive failed (it is not re-armed then).
+ */
+static int
+uring_enter (trace_uring_t *u, unsigned min_complete, int64_t timeout)
+{
+	struct __kernel_timespec ts =
+	{
+		.tv_sec = timeout / 1000000000,
+		.tv_nsec = timeout % 1000000000,
+	};
+	struct io_uring_getevents_arg arg =
+	{
+		.sigmask = 0,
+		.sigmask_sz = _NSIG / 8,
+		.ts = (uintptr_t)&ts,
+	};
+
+	atomic_store_explicit (u->sq_tail, u->sq_local, memory_order_release);
+
+	int rc = sys_io_uring_enter (u->fd, u->pending, min_complete,
+	                             IORING_ENTER_GETEVENTS
+	                              | IORING_ENTER_EXT_ARG,
+	                             &arg, sizeof (arg));
+	if (rc >= 0)
+		u->pending -= ((unsigned)rc < u->pending) ? (unsigned)rc
+		                                          : u->pending;
+	else
+	if ((errno != ETIME) && (errno != EINTR) && (errno != EBUSY))
+		return -1;
+
+	unsigned n = uring_reap (u);
+	if (u->recv_errnum != 0)
+	{
+		errno = u->recv_errnum;
+		return -1;
+	}
+	return n;
+}
+
+
+trace_uring_t *uring_create (unsigned depth, size_t maxlen,
+                             trace_uring_cb cb, void *opaque)
+{
+	trace_uring_t *u = calloc (1, sizeof (*u));
+	if (u == NULL)
+		return NULL;
+
+	struct io_uring_params p;
+	memset (&p, 0, sizeof (p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * depth + URING_RECV_BUFS;
+
+	u->fd = sys_io_uring_setup (depth, &p);
+	if (u->fd == -1)
+	{
+		free (u);
+		return NULL;
+	}
+
+	/* Maps the rings */
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	u->cq_ring_size = p.cq_off.cqes
+	                  + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap (NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+	                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto error;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else
+	{
+		u->cq_ring = mmap (NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+		                   MAP_SHARED | MAP_POPULATE, u->fd,
+		                   IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto error;
+	}
+
+	u->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	u->sqes = mmap (NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto error;
+
+	uint8_t *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (atomic_uint *)(sq + p.sq_off.head);
+	u->sq_tail = (atomic_uint *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_local = atomic_load (u->sq_tail);
+	u->cq_head = (atomic_uint *)(cq + p.cq_off.head);
+	u->cq_tail = (atomic_uint *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Registers the receive buffers */
+	u->br_size = URING_RECV_BUFS * sizeof (struct io_uring_buf);
+	u->br = mmap (NULL, u->br_size, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->bufs = malloc (URING_RECV_BUFS * URING_RECV_SIZE);
+	if ((u->br == MAP_FAILED) || (u->bufs == NULL))
+		goto error;
+
+	struct io_uring_buf_reg reg =
+	{
+		.ring_addr = (uintptr_t)u->br,
+		.ring_entries = URING_RECV_BUFS,
+		.bgid = 0,
+	};
+	if (sys_io_uring_register (u->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		goto error;
+
+	for (unsigned i = 0; i < URING_RECV_BUFS; i++)
+		uring_recycle (u, i);
+
+	/* Allocates the send slots */
+	u->nslots = u->nfree = depth;
+	u->maxlen = maxlen;
+	u->slots = calloc (depth, sizeof (*u->slots));
+	u->free_slots = calloc (depth, sizeof (*u->free_slots));
+	if ((u->slots == NULL) || (u->free_slots == NULL))
+		goto error;
+
+	for (unsigned i = 0; i < depth; i++)
+	{
+		u->free_slots[i] = i;
+		u->slots[i].data = malloc (maxlen ? maxlen : 1);
+		if (u->slots[i].data == NULL)
+			goto error;
+	}
+
+	u->cb = cb;
+	u->opaque = opaque;
+	return u;
+
+error:
+	uring_destroy (u);
+	return NULL;
+}
+
+
+void uring_destroy (trace_uring_t *u)
+{
+	if (u->slots != NULL)
+		for (unsigned i = 0; i < u->nslots; i++)
+			free (u->slots[i].data);
+	free (u->free_slots);
+	free (u->slots);
+	free (u->bufs);
+	if ((u->br != NULL) && (u->br != MAP_FAILED))
+		munmap (u->br, u->br_size);
+	if ((u->sqes != NULL) && (u->sqes != MAP_FAILED))
+		munmap (u->sqes, u->sqes_size);
+	if ((u->cq_ring != NULL) && (u->cq_ring != MAP_FAILED)
+	 && (u->cq_ring != u->sq_ring))
+		munmap (u->cq_ring, u->cq_ring_size);
+	if ((u->sq_ring != NULL) && (u->sq_ring != MAP_FAILED))
+		munmap (u->sq_ring, u->sq_ring_size);
+	close (u->fd);
+	free (u);
+}
+
+
+int uring_recv (trace_uring_t *u, int fd)
+{
+	if (u->nrecv >= URING_MAX_FDS)
+	{
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	unsigned i = u->nrecv++;
+	struct msghdr *msg = &u->recv[i].msg;
+
+	u->recv[i].fd = fd;
+	memset (msg, 0, sizeof (*msg));
+	msg->msg_namelen = sizeof (struct sockaddr_in6);
+	msg->msg_controllen = CMSG_SPACE (sizeof (int));
+	uring_arm (u, i);
+	return 0;
+}
+
+
+int uring_send (trace_uring_t *u, int fd, const struct sockaddr_in6 *dst,
+                const void *data, size_t len, int hlim)
+{
+	if (len > u->maxlen)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/* Waits for a free slot and submission entry */
+	struct io_uring_sqe *sqe;
+	while ((u->nfree == 0) || ((sqe = uring_get_sqe (u)) == NULL))
+		if (uring_enter (u, 1, 1000000000) < 0)
+			return -1;
+
+	unsigned idx = u->free_slots[--u->nfree];
+	uring_slot_t *s = u->slots + idx;
+
+	memcpy (s->data, data, len);
+	s->iov.iov_base = s->data;
+	s->iov.iov_len = len;
+	memset (&s->msg, 0, sizeof (s->msg));
+	if (dst != NULL)
+	{
+		s->dst = *dst;
+		s->msg.msg_name = &s->dst;
+		s->msg.msg_namelen = sizeof (s->dst);
+	}
+	s->msg.msg_iov = &s->iov;
+	s->msg.msg_iovlen = 1;
+	s->msg.msg_control = s->cmsg.buf;
+	s->msg.msg_controllen = sizeof (s->cmsg.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR (&s->msg);
+	cmsg->cmsg_level = IPPROTO_IPV6;
+	cmsg->cmsg_type = IPV6_HOPLIMIT;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (hlim));
+	memcpy (CMSG_DATA (cmsg), &hlim, sizeof (hlim));
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&s->msg;
+	sqe->user_data = ((uint64_t)URING_KIND_SEND << 32) | idx;
+	return 0;
+}
+
+
+int uring_wait (trace_uring_t *u, const struct timespec *deadline)
+{
+	struct timespec now;
+
+	mono_gettime (&now);
+
+	int64_t left = (deadline->tv_sec - now.tv_sec) * INT64_C(1000000000)
+	               + (deadline->tv_nsec - now.tv_nsec);
+	if (left < 0)
+		left = 0;
+
+	return uring_enter (u, (left > 0) ? 1 : 0, left);
+}
+
+
+int uring_flush (trace_uring_t *u)
+{
+	return uring_enter (u, 0, 0);
+}
+
+
+int uring_error (const trace_uring_t *u)
+{
+	return u->errnum;
+}
+
+#else /* !HAVE_IO_URING_MULTISHOT */
+trace_uring_t *uring_create (unsigned depth, size_t maxlen,
+                             trace_uring_cb cb, void *opaque)
+{
+	(void)depth; (void)maxlen; (void)cb; (void)opaque;
+	errno = ENOSYS;
+	return NULL;
+}
+
+
+void uring_destroy (trace_uring_t *u)
+{
+	(void)u;
+}
+
+
+int uring_recv (trace_uring_t *u, int fd)
+{
+	(void)u; (void)fd;
+	errno = ENOSYS;
+	return -1;
+}
+
+
+int uring_send (trace_uring_t *u, int fd, const struct sockaddr_in6 *dst,
+                const void *data, size_t len, int hlim)
+{
+	(void)u; (void)fd; (void)dst; (void)data; (void)len; (void)hlim;
+	errno = ENOSYS;
+	return -1;
+}
+
+
+int uring_wait (trace_uring_t *u, const struct timespec *deadline)
+{
+	(void)u; (void)deadline;
+	errno = ENOSYS;
+	return -1;
+}
+
+
+int uring_flush (trace_uring_t *u)
+{
+	(void)u;
+	errno = ENOSYS;
+	return -1;
+}
+
+
+int uring_error (const trace_uring_t *u)
+{
+	(void)u;
+	return ENOSYS;
+}
+#endif
@@ -29,6 +29,7 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <time.h> /* nanosleep() */
 #include <assert.h>
 
@@ -45,11 +46,15 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <locale.h> /* setlocale() */
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #ifdef HAVE_GETOPT_H
 # include <getopt.h>
 #endif
 #ifdef __linux__
 # include <linux/filter.h>
+# include <linux/errqueue.h>
 #endif
 
 #include "gettime.h"
@@ -75,10 +80,6 @@
 # define IPV6_RECVHOPLIMIT IPV6_HOPLIMIT
 #endif
 
-#ifndef ICMP6_DST_UNREACH_BEYONDSCOPE
-# define ICMP6_DST_UNREACH_BEYONDSCOPE 2
-#endif
-
 #ifndef SOL_IPV6
 # define SOL_IPV6 IPPROTO_IPV6
 #endif
@@ -86,24 +87,70 @@
 # define SOL_ICMPV6 IPPROTO_ICMPV6
 #endif
 
+/* Adaptive timeout bounds (nanoseconds) */
+#define RTO_MIN 50000000
+#define RTO_FACTOR 2
+
+/* Extension headers skipped by the kernel socket filter */
+#define FILTER_EXTHDRS 3
+
 
 /* All our evil global variables */
 static const tracetype *type = NULL;
 static int niflags = 0;
 static int tclass = -1;
-uint16_t sport;
+uint16_t sport, ident;
 static bool debug = false, dontroute = false, show_hlim = false;
+static bool pmtu = false, adaptive = false, pace = false, show_ext = false;
+static bool summary = false;
+static unsigned shown_mtu;
 bool ecn = false;
+static enum trace_format format = TRACE_FORMAT_TEXT;
+static asn_table_t *asn = NULL;
+static trace_stopset_t *stopset = NULL;
+static trace_graph_t *graph = NULL;
+static trace_baseline_t *baseline = NULL;
+static int64_t rtt_shift = 10000000; // nanoseconds
+static int stop_hlim = 1;
+static unsigned long probes_sent = 0;
 static char ifname[IFNAMSIZ] = "";
+static const struct sockaddr_in6 *send_dst = NULL; // if not connected
+static trace_uring_t *send_uring = NULL;
+static trace_sim_t *sim = NULL; // simulated network (-X)
+static bool recverr = false; // unprivileged datagram sockets
 
 static const char *rt_segv[127];
+static struct in6_addr rt_addrv[127];
 static int rt_segc = 0;
+static int rt_type = IPV6_RTHDR_TYPE_0;
+static const struct in6_addr *rt_cur = rt_addrv; // segments in use
+static int rt_curc = 0;
+static size_t rt_len = 0; // routing header in use, in bytes
 
 /****************************************************************************/
 
+/* Picks a random process identifier, so concurrent traces do not mix up */
+static uint16_t getident (void)
+{
+	uint16_t v;
+	int fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+	if ((fd == -1) || (read (fd, &v, sizeof (v)) != sizeof (v)))
+	{
+		struct timespec now;
+
+		mono_gettime (&now);
+		v = getpid () ^ (now.tv_nsec * 40503u) ^ (now.tv_nsec >> 16);
+	}
+	if (fd != -1)
+		close (fd);
+	return v;
+}
+
+
 static uint16_t getsourceport (void)
 {
-	uint16_t v = ~getpid ();
+	uint16_t v = ~ident;
 	if (v < 1025)
 		v += 1025;
 	return htons (v);
@@ -120,8 +167,8 @@ ssize_t send_payload (int fd, const void *payload, size_t length, int hlim)
 	};
 	struct msghdr hdr =
 	{
-		.msg_name = NULL,
-		.msg_namelen = 0,
+		.msg_name = (void *)send_dst,
+		.msg_namelen = (send_dst != NULL) ? sizeof (*send_dst) : 0,
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
 		.msg_control = cbuf,
@@ -135,7 +182,19 @@ ssize_t send_payload (int fd, const void *payload, size_t length, int hlim)
 
 	memcpy (CMSG_DATA (cmsg), &hlim, sizeof (hlim));
 
+	if (sim != NULL)
+		return sim_send (sim, fd, send_dst, payload, length, hlim);
+	if (send_uring != NULL)
+		return uring_send (send_uring, fd, send_dst, payload, length, hlim);
+
 	ssize_t rc = sendmsg (fd, &hdr, 0);
+
+	/* A datagram socket reports its pending ICMPv6 error (if any) to the
+	 * next send, then clears it: that is not an error of this probe. */
+	for (unsigned i = 0; (rc == -1) && recverr && (errno != EAGAIN) && (i < 4);
+	     i++)
+		rc = sendmsg (fd, &hdr, 0);
+
 	if (rc == (ssize_t)length)
 		return 0;
 
@@ -165,6 +224,16 @@ recv_payload (int fd, void *buf, size_t len,
 		.msg_controllen = sizeof (cbuf)
 	};
 
+	if (sim != NULL)
+	{
+		int val;
+		ssize_t rc = sim_recv (sim, fd, buf, len, addr, &val);
+
+		if ((rc != -1) && show_hlim)
+			*hlim = val;
+		return rc;
+	}
+
 	ssize_t val = recvmsg (fd, &hdr, 0);
 	if (val == -1)
 		return val;
@@ -215,266 +284,112 @@ tsdiff (struct timespec *res,
 }
 
 
-static ssize_t
-parse (trace_parser_t func, const void *data, size_t len,
-       int *hlim, int *attempt, uint16_t port)
+static int64_t ts2ns (const struct timespec *ts)
 {
-	if (func == NULL)
-		return -1;
-
-	unsigned dummy = -1;
-	ssize_t rc = func (data, len, hlim, &dummy, port);
-	*attempt = dummy;
-	if (rc < 0)
-		return rc;
-
-	return rc;
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
 }
 
 
-static const void *
-skip_exthdrs (struct ip6_hdr *ip6, size_t *plen)
+static void ns2ts (struct timespec *ts, int64_t ns)
 {
-	const uint8_t *payload = (const uint8_t *)(ip6 + 1);
-	size_t len = *plen;
-	uint8_t nxt = ip6->ip6_nxt;
-
-	for (;;)
-	{
-		uint16_t hlen;
-
-		switch (nxt)
-		{
-			case IPPROTO_HOPOPTS:
-			case IPPROTO_DSTOPTS:
-			case IPPROTO_ROUTING:
-				if (len < 2)
-					return NULL;
-
-				hlen = (1 + (uint16_t)payload[1]) << 3;
-				break;
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
 
-			case IPPROTO_FRAGMENT:
-				hlen = 8;
-				break;
 
-			case IPPROTO_AH:
-				if (len < 2)
-					return NULL;
+static int64_t mono_ns (void)
+{
+	struct timespec now;
 
-				hlen = (2 + (uint16_t)payload[1]) << 2;
-				break;
+	mono_gettime (&now);
+	return ts2ns (&now);
+}
 
-			default: // THE END
-				goto out;
-		}
 
-		if (len < hlen)
-			return NULL; // too short;
+/**
+ * Round-trip time estimator for adaptive timeouts (as per RFC 6298).
+ */
+typedef struct
+{
+	int64_t srtt, rttvar; // nanoseconds
+	bool valid;
+} rtt_estimator;
 
-		switch (nxt)
-		{
-			case IPPROTO_ROUTING:
-			{
-				/* Extract real destination */
-				if (payload[3] > 0) // segments left
-				{
-					if (payload[2] != 0)
-						return NULL; // unknown type
-	
-					/* Handle Routing Type 0 */
-					if ((hlen & 8) != 8)
-						return NULL; // != 8[16] -> invalid length
-
-					memcpy (&ip6->ip6_dst,
-					        payload + (16 * payload[3]) - 8, 16);
-				}
-				break;
-			}
 
-			case IPPROTO_FRAGMENT:
-			{
-				uint16_t offset;
-				memcpy (&offset, payload + 2, 2);
-				if (ntohs (offset) >> 3)
-					return NULL; // non-first fragment
-				break;
-			}
-		}
+static void rtt_update (rtt_estimator *e, const struct timespec *rtt)
+{
+	int64_t r = (int64_t)rtt->tv_sec * 1000000000 + rtt->tv_nsec;
 
-		nxt = payload[0];
-		len -= hlen;
-		payload += hlen;
+	if (!e->valid)
+	{
+		e->srtt = r;
+		e->rttvar = r / 2;
+		e->valid = true;
+		return;
 	}
 
-out:
-	ip6->ip6_nxt = nxt;
-	*plen = len;
-	return payload;
+	int64_t delta = (e->srtt > r) ? (e->srtt - r) : (r - e->srtt);
+	e->rttvar = (3 * e->rttvar + delta) / 4;
+	e->srtt = (7 * e->srtt + r) / 8;
 }
 
 
-#define TRACE_TIMEOUT     0
-#define TRACE_OK          1 // TTL exceeded, echo reply, port unreachable...
-#define TRACE_CLOSED      2
-#define TRACE_OPEN        3
-#define TRACE_NOROUTE 0x100 // !N network unreachable
-#define TRACE_ADMIN   0x101 // !A administratively prohibited
-#define TRACE_BSCOPE  0X102 // !S beyond scope of source address
-#define TRACE_NOHOST  0x103 // !H address unreachable
-//#define TRACE_TOOBIG  0x100 // !F-%u packet too big
-//#define TRACE_NOSUP   0x400 // header field error
-#define TRACE_NOPROTO 0x401 // !P unrecognized next header
-//#define TRACE_NOOPT 0x402 // unrecognized option
+/**
+ * Computes the time to wait for replies. Without any sample, or when
+ * adaptive timeouts are disabled, this is the fixed timeout. Otherwise,
+ * a small multiple of the retransmission timeout from the round-trip
+ * times seen so far, capped to the fixed timeout.
+ */
+static void
+rtt_deadline (const rtt_estimator *e, struct timespec *deadline,
+              unsigned timeout)
+{
+	mono_gettime (deadline);
 
+	if (!adaptive || !e->valid)
+	{
+		deadline->tv_sec += timeout;
+		return;
+	}
 
-typedef struct
-{
-	struct sockaddr_in6 addr;  // hop address
-	struct timespec     sent;  // request date
-	struct timespec     rcvd;  // reply date
-	int                 rhlim; // received hop limit
-	unsigned            result;// 0: no reply, 1: ok, 2: closed, 3: open
-} tracetest_t;
+	int64_t rto = RTO_FACTOR * (e->srtt + 4 * e->rttvar);
+	if (rto < RTO_MIN)
+		rto = RTO_MIN;
+	if (rto > (int64_t)timeout * 1000000000)
+		rto = (int64_t)timeout * 1000000000;
+
+	deadline->tv_sec += rto / 1000000000;
+	deadline->tv_nsec += rto % 1000000000;
+	if (deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
 
 
 static int
-icmp_recv (int fd, tracetest_t *res, int *attempt, int *hlim,
+icmp_recv (int fd, tracetest_t *res, int *id, int *hlim,
            const struct sockaddr_in6 *dst)
 {
-	struct
+	union
 	{
 		struct icmp6_hdr hdr;
-		struct ip6_hdr inhdr;
-		uint8_t buf[1192];
+		uint8_t buf[1240];
 	} pkt;
 	res->rhlim = -1;
 
 	ssize_t len = recv_payload (fd, &pkt, sizeof (pkt), &res->addr,
 	                            &res->rhlim);
-
-	if (len < (ssize_t)(sizeof (pkt.hdr) + sizeof (pkt.inhdr)))
-		return 0; // too small
-
-	len -= sizeof (pkt.hdr) + sizeof (pkt.inhdr);
-
-#if 0
-	/* "Extended" ICMP detection */
-	const uint8_t *ext = NULL;
-	size_t extlen = 0;
-	switch (pkt.hdr.icmp6_type)
-	{
-		case ICMP6_DST_UNREACH:
-		case ICMP6_TIME_EXCEEDED:
-			if (pkt.hdr.icmp6_data8[0] != 0)
-			{
-				short origlen = pkt.hdr.icmp6_data8[0] << 6;
-				if (origlen > len)
-					return 0; // malformatted extended ICMP
-
-				assert (origlen >= 40);
-				ext = pkt.buf - 40 + origlen;
-				extlen = len - origlen;
-				len = origlen;
-
-				if ((extlen < 1) || ((ext[0] >> 4) != 2))
-					break; // no ext / unknown version
-				if (extlen < 4)
-					return 0; // malformatted v2 extension
-
-				/* FIXME: compute checksum */
-			}
-	}
-#endif
-
-	const void *buf = skip_exthdrs (&pkt.inhdr, (size_t *)&len);
-
-	if (memcmp (&pkt.inhdr.ip6_dst, &dst->sin6_addr, 16))
-		return 0; // wrong destination
-
-	if (pkt.inhdr.ip6_nxt != type->protocol)
-		return 0; // wrong protocol
-
-	len = parse (type->parse_err, buf, len, hlim, attempt, dst->sin6_port);
 	if (len < 0)
 		return 0;
 
-	/* interesting ICMPv6 error */
-	bool final = true;
-	switch (pkt.hdr.icmp6_type)
-	{
-		case ICMP6_DST_UNREACH:
-			switch (pkt.hdr.icmp6_code)
-			{
-				case ICMP6_DST_UNREACH_NOROUTE:
-				case ICMP6_DST_UNREACH_ADMIN:
-				case ICMP6_DST_UNREACH_BEYONDSCOPE:
-				case ICMP6_DST_UNREACH_ADDR:
-					res->result = 0x100 | pkt.hdr.icmp6_code;
-					break;
-				case ICMP6_DST_UNREACH_NOPORT:
-					res->result = TRACE_OK;
-					break;
-				case 5: // ingress/egress policy failure
-				case 6: // reject route
-					res->result = TRACE_ADMIN;
-					break;
-			}
-			break;
-
-		case ICMP6_PARAM_PROB:
-			switch (pkt.hdr.icmp6_code)
-			{
-				case ICMP6_PARAMPROB_NEXTHEADER:
-					res->result = 0x400 | pkt.hdr.icmp6_code;
-			}
-			break;
-
-		case ICMP6_TIME_EXCEEDED:
-			if (pkt.hdr.icmp6_code == ICMP6_TIME_EXCEED_TRANSIT)
-			{
-				res->result = TRACE_OK;
-				final = false; // intermediary reponse
-				break;
-			}
-			/* fall through */
-		default: // should not happen (ICMPv6 filter)
-			return 0;
-	}
-
-#if 0
-	/* "Extended" ICMP handling */
-	if (extlen > 0)
-	{
-		ext += 4;
-		extlen -= 4;
-		while (extlen >= 4)
-		{
-			uint16_t objlen = (ext[0] << 8) | ext[1];
-			if ((objlen & 3) || (objlen < 4) // malformatted object
-			 || (objlen > extlen)) // incomplete object
-				break;
-
-			switch (ext[2])
-			{
-			}
-
-			ext += objlen;
-			extlen -= objlen;
-		}
-	}
-#endif
-
-	if (!final)
-		return 1; // intermediary response
-
-	// final response received
-	return memcmp (&res->addr.sin6_addr, &dst->sin6_addr, 16) ? 2 : 3;
+	return icmp_parse (type, &pkt, len, res, id, hlim, dst);
 }
 
 
 static int
-proto_recv (int fd, tracetest_t *res, int *attempt, int *hlim,
+proto_recv (int fd, tracetest_t *res, int *id, int *hlim,
             const struct sockaddr_in6 *dst)
 {
 	res->rhlim = -1;
@@ -500,21 +415,103 @@ proto_recv (int fd, tracetest_t *res, int *attempt, int *hlim,
 		}
 	}
 
-	len = parse (type->parse_resp, buf, len, hlim, attempt, dst->sin6_port);
-	if (len < 0)
+	return proto_parse (type, buf, len, res, id, hlim, dst);
+}
+
+
+#ifdef IPV6_RECVERR
+/**
+ * Receives an ICMPv6 error from the error queue of a datagram socket.
+ * The kernel has matched the error to the socket, and provides the
+ * offender address, and the reception time if timestamps are enabled.
+ * @return same as icmp_parse().
+ */
+static int
+err_recv (int fd, tracetest_t *res, int *id, int *hlim,
+          const struct sockaddr_in6 *dst, struct timespec *recvd)
+{
+	uint8_t buf[1240];
+	char cbuf[CMSG_SPACE (sizeof (struct sock_extended_err)
+	                      + sizeof (struct sockaddr_in6))
+	          + CMSG_SPACE (sizeof (struct timespec))
+	          + CMSG_SPACE (sizeof (int))];
+	struct iovec iov =
+	{
+		.iov_base = buf,
+		.iov_len = sizeof (buf)
+	};
+	struct msghdr hdr =
+	{
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof (cbuf)
+	};
+
+	res->rhlim = -1;
+
+	ssize_t len = recvmsg (fd, &hdr, MSG_ERRQUEUE);
+	if (len == -1)
+	{
+		/* Clears any pending error not from the queue */
+		if (errno == EAGAIN)
+			getsockopt (fd, SOL_SOCKET, SO_ERROR, &(int){ 0 },
+			            &(socklen_t){ sizeof (int) });
+		return 0;
+	}
+
+	const struct sock_extended_err *ee = NULL;
+	const struct timespec *ts = NULL;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&hdr);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR (&hdr, cmsg))
+	{
+		if ((cmsg->cmsg_level == SOL_IPV6)
+		 && (cmsg->cmsg_type == IPV6_RECVERR))
+			ee = (const void *)CMSG_DATA (cmsg);
+		else
+		if ((cmsg->cmsg_level == SOL_IPV6)
+		 && (cmsg->cmsg_type == IPV6_HOPLIMIT))
+			memcpy (&res->rhlim, CMSG_DATA (cmsg), sizeof (res->rhlim));
+		else
+		if ((cmsg->cmsg_level == SOL_SOCKET)
+		 && (cmsg->cmsg_type == SCM_TIMESTAMPNS))
+			ts = (const void *)CMSG_DATA (cmsg);
+	}
+
+	if ((ee == NULL) || (ee->ee_origin != SO_EE_ORIGIN_ICMP6))
+		return 0; // local error
+
+	const struct sockaddr_in6 *from = (const void *)SO_EE_OFFENDER (ee);
+	if (from->sin6_family != AF_INET6)
 		return 0;
+	memcpy (&res->addr, from, sizeof (res->addr));
 
-	/* Route determination complete! */
-	memcpy (&res->addr, dst, sizeof (res->addr));
-	res->result = 1 + len;
-	return 1; // response received
+	int val = err_parse (type, ee->ee_type, ee->ee_code, ee->ee_info, buf,
+	                     len, res, id, hlim, dst);
+
+	/* Kernel timestamps are in real time: how long ago was that? */
+	if (val && (ts != NULL))
+	{
+		struct timespec now;
+
+		/* Both clocks are read together, as the age is counted from now */
+		mono_gettime (recvd);
+		clock_gettime (CLOCK_REALTIME, &now);
+		int64_t age = ts2ns (&now) - ts2ns (ts);
+		if ((age > 0) && (age < ts2ns (recvd)))
+			ns2ts (recvd, ts2ns (recvd) - age);
+	}
+	return val;
 }
+#endif
 
 
 static int
 probe (int protofd, int icmpfd, const struct sockaddr_in6 *dst,
        const struct timespec *deadline,
-       tracetest_t *res, int *hlim, int *attempt)
+       tracetest_t *res, int *hlim, int *id)
 {
 	for (;;)
 	{
@@ -538,14 +535,21 @@ probe (int protofd, int icmpfd, const struct sockaddr_in6 *dst,
 			continue;
 		if (val == 0)
 		{
-			*hlim = -1;
+			*hlim = *id = -1;
 			break;
 		}
 
+		val = 0;
+#ifdef IPV6_RECVERR
+		/* ICMPv6 errors are queued on the datagram socket itself */
+		if (recverr && (ufds[0].revents & POLLERR))
+			val = err_recv (protofd, res, id, hlim, dst, &recvd);
+		else
+#endif
 		/* Receive final packet when host reached */
 		if (ufds[0].revents)
 		{
-			if (proto_recv (protofd, res, attempt, hlim, dst) > 0)
+			if (proto_recv (protofd, res, id, hlim, dst) > 0)
 			{
 				res->rcvd = recvd;
 				return 1;
@@ -554,20 +558,19 @@ probe (int protofd, int icmpfd, const struct sockaddr_in6 *dst,
 
 		/* Receive ICMP errors along the way */
 		if (ufds[1].revents)
-		{
-			val = icmp_recv (icmpfd, res, attempt, hlim, dst);
-			if (val)
-				res->rcvd = recvd;
+			val = icmp_recv (icmpfd, res, id, hlim, dst);
 
-			switch (val)
-			{
-				case 1:
-					return 0; // TTL exceeded
-				case 2:
-					return -1; // unreachable
-				case 3:
-					return 1; // reached
-			}
+		if (val)
+			res->rcvd = recvd;
+
+		switch (val)
+		{
+			case 1:
+				return 0; // TTL exceeded
+			case 2:
+				return -1; // unreachable
+			case 3:
+				return 1; // reached
 		}
 	}
 	return 0;
@@ -601,6 +604,23 @@ printname (const struct sockaddr *addr, size_t addrlen)
 }
 
 
+/* Prints the origin AS and prefix of an address */
+static void
+printasn (const struct in6_addr *addr)
+{
+	struct in6_addr prefix;
+	uint32_t as;
+	unsigned plen;
+	char buf[INET6_ADDRSTRLEN];
+
+	if (!asn_lookup (asn, addr, &as, &prefix, &plen))
+		return;
+
+	inet_ntop (AF_INET6, &prefix, buf, sizeof (buf));
+	printf ("[AS%"PRIu32" %s/%u] ", as, buf, plen);
+}
+
+
 static inline void
 printrtt (const struct timespec *rtt)
 {
@@ -622,6 +642,63 @@ printrtt (const struct timespec *rtt)
 }
 
 
+/* Prints ICMPv6 extensions, unless identical to the previous probe's */
+static void
+printext (const tracetest_t *test, const tracetest_t *prev)
+{
+	if ((test->mpls_count > 0)
+	 && ((prev == NULL) || (prev->mpls_count != test->mpls_count)
+	  || memcmp (prev->mpls, test->mpls,
+	             test->mpls_count * sizeof (test->mpls[0]))))
+	{
+		fputs ("<MPLS:", stdout);
+		for (unsigned i = 0; i < test->mpls_count; i++)
+		{
+			uint32_t lse = test->mpls[i];
+			printf ("%sL=%"PRIu32",E=%u,S=%u,T=%u", (i > 0) ? "/" : "",
+			        lse >> 12, (unsigned)(lse >> 9) & 7,
+			        (unsigned)(lse >> 8) & 1, (unsigned)lse & 0xff);
+		}
+		fputs ("> ", stdout);
+	}
+
+	const trace_iface_t *iface = &test->iface;
+	if ((iface->ctype != 0)
+	 && ((prev == NULL) || memcmp (&prev->iface, iface, sizeof (*iface))))
+	{
+		static const char roles[][4] = { "IN", "SUB", "OUT", "NH" };
+		const char *sep = ":";
+
+		printf ("<%s", roles[TRACE_IFACE_ROLE (iface->ctype)]);
+		if (iface->ctype & TRACE_IFACE_NAME)
+		{
+			printf ("%s%s", sep, iface->name);
+			sep = ",";
+		}
+		if (iface->ctype & TRACE_IFACE_INDEX)
+		{
+			printf ("%sindex=%"PRIu32, sep, iface->index);
+			sep = ",";
+		}
+		if (iface->ctype & TRACE_IFACE_ADDR)
+		{
+			char buf[INET6_ADDRSTRLEN];
+
+			if (IN6_IS_ADDR_V4MAPPED (&iface->addr))
+				inet_ntop (AF_INET, iface->addr.s6_addr + 12, buf,
+				           sizeof (buf));
+			else
+				inet_ntop (AF_INET6, &iface->addr, buf, sizeof (buf));
+			printf ("%s%s", sep, buf);
+			sep = ",";
+		}
+		if (iface->ctype & TRACE_IFACE_MTU)
+			printf ("%smtu=%"PRIu32, sep, iface->mtu);
+		fputs ("> ", stdout);
+	}
+}
+
+
 static void
 display (const tracetest_t *tab, unsigned min_ttl, unsigned max_ttl,
          unsigned retries)
@@ -646,6 +723,8 @@ display (const tracetest_t *tab, unsigned min_ttl, unsigned max_ttl,
 			{
 				memcpy (&hop, &test->addr, sizeof (hop));
 				printname ((struct sockaddr *)&hop, sizeof (hop));
+				if (asn != NULL)
+					printasn (&hop.sin6_addr);
 			}
 
 			struct timespec rtt;
@@ -706,6 +785,19 @@ display (const tracetest_t *tab, unsigned min_ttl, unsigned max_ttl,
 
 			if (msg2 != NULL)
 				fputs (msg2, stdout);
+
+			if (show_ext)
+				printext (test, (col > 0) ? test - 1 : NULL);
+		}
+
+		unsigned mtu = 0;
+		for (unsigned col = 0; col < retries; col++)
+			if (line[col].mtu && (!mtu || (line[col].mtu < mtu)))
+				mtu = line[col].mtu;
+		if (mtu && (mtu != shown_mtu))
+		{
+			printf (_("pmtu %u "), mtu);
+			shown_mtu = mtu;
 		}
 
 		fputc ('\n', stdout);
@@ -713,68 +805,251 @@ display (const tracetest_t *tab, unsigned min_ttl, unsigned max_ttl,
 }
 
 
-
-static int
-getaddrinfo_err (const char *host, const char *serv,
-                 const struct addrinfo *hints, struct addrinfo **res)
+static void
+output_hop (const tracetest_t *line, unsigned ttl, unsigned retries)
 {
-	int val = getaddrinfo (host, serv, hints, res);
-	if (val)
+	switch (format)
 	{
-		fprintf (stderr, _("%s%s%s%s: %s\n"), host ?: "", host ? " " : "",
-		         serv ? _("port ") : "", serv ?: "", gai_strerror (val));
-		return val;
+		case TRACE_FORMAT_TEXT:
+			display (line, ttl, ttl, retries);
+			break;
+
+		case TRACE_FORMAT_JSON:
+			json_write_hop (stdout, line, ttl, retries, asn);
+			break;
+
+		case TRACE_FORMAT_BINARY:
+			binary_write_hop (stdout, line, ttl, retries);
+			break;
+
+		case TRACE_FORMAT_NONE:
+			return;
 	}
-	return 0;
+	fflush (stdout);
 }
 
 
+/* Converts binary records back to the selected output format */
 static int
-connect_proto (int fd, struct sockaddr_in6 *dst,
-               const char *dsthost, const char *dstport,
-               const char *srchost, const char *srcport)
+decode (const char *path)
 {
-	struct addrinfo hints, *res;
-
-	memset (&hints, 0, sizeof (hints));
-	hints.ai_family = AF_INET6;
-	hints.ai_socktype = type->gai_socktype;
-	hints.ai_flags = AI_CANONNAME | AI_IDN;
-
-	if ((srchost != NULL) || (srcport != NULL))
+	FILE *stream = strcmp (path, "-") ? fopen (path, "rb") : stdin;
+	if (stream == NULL)
 	{
-		hints.ai_flags |= AI_PASSIVE;
+		perror (path);
+		return -1;
+	}
 
-		if (getaddrinfo_err (srchost, srcport, &hints, &res))
-			return -1;
+	trace_record_t rec;
+	tracetest_t *line = NULL;
+	unsigned retries = 0, ttl = 0;
+	int val;
 
-		if (bind (fd, res->ai_addr, res->ai_addrlen))
+	while ((val = trace_record_read (stream, &rec)) > 0)
+	{
+		if ((rec.kind == TRACE_RECORD_HOP) && (ttl != 0)
+		 && (rec.hlim != ttl))
 		{
-			perror (srchost);
-			goto error;
+			output_hop (line, ttl, retries);
+			memset (line, 0, retries * sizeof (*line));
 		}
 
-		if (srcport != NULL)
-			sport = ((const struct sockaddr_in6 *)res->ai_addr)->sin6_port;
-		freeaddrinfo (res);
+		switch (rec.kind)
+		{
+			case TRACE_RECORD_TRACE:
+			{
+				struct sockaddr_in6 dst =
+				{
+					.sin6_family = AF_INET6,
+					.sin6_port = htons (rec.port),
+					.sin6_addr = rec.addr,
+				};
+				char buf[INET6_ADDRSTRLEN];
+
+				if (ttl != 0)
+					output_hop (line, ttl, retries);
+
+				free (line);
+				shown_mtu = 0;
+				retries = rec.attempt;
+				ttl = 0;
+				line = calloc (retries ? retries : 1, sizeof (*line));
+				if (line == NULL)
+				{
+					val = -1;
+					goto out;
+				}
 
-		hints.ai_flags &= ~AI_PASSIVE;
-	}
+				inet_ntop (AF_INET6, &rec.addr, buf, sizeof (buf));
+				switch (format)
+				{
+					case TRACE_FORMAT_TEXT:
+						printf (_("traceroute to %s (%s) "), buf, buf);
+						printf (ngettext ("%u hop max, ", "%u hops max, ",
+						                  rec.hlim), rec.hlim);
+						printf (ngettext ("%zu byte packets\n",
+						                  "%zu bytes packets\n",
+						                  (size_t)rec.extra),
+						        (size_t)rec.extra);
+						break;
 
-	if (srcport == NULL)
-		sport = getsourceport ();
+					case TRACE_FORMAT_JSON:
+						json_write_trace (stdout, NULL, &dst, NULL, 0,
+						                  rec.result, rec.rhlim, rec.hlim,
+						                  retries, rec.extra);
+						break;
 
-	if (getaddrinfo_err (dsthost, dstport, &hints, &res))
-		return -1;
+					case TRACE_FORMAT_BINARY:
+						trace_record_write (stdout, &rec);
+						break;
 
-	if (res->ai_addrlen > sizeof (*dst))
-		goto error;
+					case TRACE_FORMAT_NONE:
+						break;
+				}
+				break;
+			}
 
-	if (connect (fd, res->ai_addr, res->ai_addrlen))
-	{
-		perror (dsthost);
-		goto error;
-	}
+			case TRACE_RECORD_HOP:
+			{
+				if ((line == NULL) || (rec.attempt >= retries))
+					break; // orphan record
+				ttl = rec.hlim;
+
+				tracetest_t *t = line + rec.attempt;
+				t->addr.sin6_family = AF_INET6;
+				t->addr.sin6_addr = rec.addr;
+				t->sent.tv_sec = rec.sent / 1000000000;
+				t->sent.tv_nsec = rec.sent % 1000000000;
+				t->rcvd.tv_sec = rec.rcvd / 1000000000;
+				t->rcvd.tv_nsec = rec.rcvd % 1000000000;
+				t->rhlim = rec.rhlim;
+				t->result = rec.result;
+				t->mtu = rec.extra;
+				t->mpls_count = 0;
+				break;
+			}
+
+			case TRACE_RECORD_MPLS:
+			{
+				if ((line == NULL) || (rec.attempt >= retries)
+				 || (rec.hlim != ttl))
+					break; // orphan record
+
+				tracetest_t *t = line + rec.attempt;
+				if (t->mpls_count < TRACE_MPLS_MAX)
+					t->mpls[t->mpls_count++] = rec.extra;
+				break;
+			}
+		}
+	}
+
+	if ((val == 0) && (ttl != 0))
+		output_hop (line, ttl, retries);
+out:
+	if (val < 0)
+		fprintf (stderr, _("%s: invalid trace records\n"), path);
+	free (line);
+	if (stream != stdin)
+		fclose (stream);
+	return val;
+}
+
+
+static int
+getaddrinfo_err (const char *host, const char *serv,
+                 const struct addrinfo *hints, struct addrinfo **res)
+{
+	int val = getaddrinfo (host, serv, hints, res);
+	if (val)
+	{
+		fprintf (stderr, _("%s%s%s%s: %s\n"), host ?: "", host ? " " : "",
+		         serv ? _("port ") : "", serv ?: "", gai_strerror (val));
+		return val;
+	}
+	return 0;
+}
+
+
+static int
+bind_proto (int fd, const char *srchost, const char *srcport)
+{
+	struct addrinfo hints, *res;
+
+	if (srcport == NULL)
+		sport = getsourceport ();
+
+	if ((srchost == NULL) && (srcport == NULL))
+		return 0;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = type->gai_socktype;
+	hints.ai_flags = AI_PASSIVE | AI_IDN;
+
+	if (getaddrinfo_err (srchost, srcport, &hints, &res))
+		return -1;
+
+	if ((sim != NULL)
+	    ? sim_bind (sim, fd, (const struct sockaddr_in6 *)res->ai_addr)
+	    : bind (fd, res->ai_addr, res->ai_addrlen))
+	{
+		perror (srchost);
+		freeaddrinfo (res);
+		return -1;
+	}
+
+	if (srcport != NULL)
+		sport = ((const struct sockaddr_in6 *)res->ai_addr)->sin6_port;
+	freeaddrinfo (res);
+	return 0;
+}
+
+
+/* Prints the route segments of a trace, if any */
+static void print_segments (const struct in6_addr *segv, int segc)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (segc == 0)
+		return;
+
+	fputs (_("via "), stdout);
+	for (int i = 0; i < segc; i++)
+		if (inet_ntop (AF_INET6, segv + i, buf, sizeof (buf)) != NULL)
+			printf ("%s%s", (i > 0) ? "," : "", buf);
+	fputs (", ", stdout);
+}
+
+
+static int
+connect_proto (int fd, struct sockaddr_in6 *dst, char *canonname,
+               const char *dsthost, const char *dstport)
+{
+	struct addrinfo hints, *res;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = type->gai_socktype;
+	hints.ai_flags = AI_CANONNAME | AI_IDN;
+
+	if (getaddrinfo_err (dsthost, dstport, &hints, &res))
+		return -1;
+
+	if (res->ai_addrlen > sizeof (*dst))
+		goto error;
+
+	if ((sim != NULL)
+	    ? sim_connect (sim, fd, (const struct sockaddr_in6 *)res->ai_addr)
+	    : connect (fd, res->ai_addr, res->ai_addrlen))
+	{
+		perror (dsthost);
+		goto error;
+	}
+
+	/* The kernel picks the source port of datagram sockets */
+	if (recverr && (getsockname (fd, (struct sockaddr *)dst,
+	                             &(socklen_t){ sizeof (*dst) }) == 0))
+		sport = dst->sin6_port;
 
 	char buf[INET6_ADDRSTRLEN];
 	if (inet_ntop (AF_INET6,
@@ -782,15 +1057,22 @@ connect_proto (int fd, struct sockaddr_in6 *dst,
 	               buf, sizeof (buf)) == NULL)
 		strcpy (buf, "??");
 
-	printf (_("traceroute to %s (%s) "), res->ai_canonname, buf);
+	snprintf (canonname, NI_MAXHOST, "%s", res->ai_canonname);
 
-	if ((getsockname (fd, (struct sockaddr *)dst,
-	                  &(socklen_t){ sizeof (*dst) }) == 0)
-	 && inet_ntop (AF_INET6, &dst->sin6_addr, buf, sizeof (buf)))
-		printf (_("from %s, "), buf);
+	if (format == TRACE_FORMAT_TEXT)
+	{
+		printf (_("traceroute to %s (%s) "), res->ai_canonname, buf);
+
+		if ((((sim != NULL) ? sim_getsockname (sim, fd, dst)
+		                    : getsockname (fd, (struct sockaddr *)dst,
+		                                   &(socklen_t){ sizeof (*dst) })) == 0)
+		 && inet_ntop (AF_INET6, &dst->sin6_addr, buf, sizeof (buf)))
+			printf (_("from %s, "), buf);
+		print_segments (rt_cur, rt_curc);
+	}
 
 	memcpy (dst, res->ai_addr, res->ai_addrlen);
-	if (has_port (type->protocol))
+	if (has_port (type->protocol) && (format == TRACE_FORMAT_TEXT))
 		printf (_("port %u, from port %u, "), ntohs (dst->sin6_port),
 		        ntohs (sport));
 
@@ -820,11 +1102,9 @@ static void setup_socket (int fd)
 }
 
 
-static int setsock_rth (int fd, int type, const char **segv, int segc)
+static int resolve_segments (const char *const *segv, int segc,
+                             struct in6_addr *addrv)
 {
-	uint8_t hdr[inet6_rth_space (type, segc)];
-	inet6_rth_init (hdr, sizeof (hdr), type, segc);
-
 	struct addrinfo hints;
 	memset (&hints, 0, sizeof (hints));
 	hints.ai_family = AF_INET6;
@@ -837,13 +1117,69 @@ static int setsock_rth (int fd, int type, const char **segv, int segc)
 		if (getaddrinfo_err (segv[i], NULL, &hints, &res))
 			return -1;
 
-		const struct sockaddr_in6 *a = (const void *)res->ai_addr;
-		if (inet6_rth_add (hdr, &a->sin6_addr))
+		addrv[i] = ((const struct sockaddr_in6 *)res->ai_addr)->sin6_addr;
+		freeaddrinfo (res);
+	}
+	return 0;
+}
+
+
+/* Returns the length of a routing header through segc segments */
+static size_t rth_space (int segc)
+{
+	if (segc == 0)
+		return 0;
+	if (rt_type == TRACE_RTHDR_SRH)
+		return 8 + 16 * (segc + 1); // the final destination comes first
+	return inet6_rth_space (IPV6_RTHDR_TYPE_0, segc);
+}
+
+
+/**
+ * Routes the next probes from a socket through the given segments, with
+ * a routing header of type rt_type, or removes the routing header if
+ * there are no segments.
+ */
+static int setsock_rth (int fd, const struct in6_addr *segv, int segc)
+{
+	size_t len = rth_space (segc);
+	uint8_t hdr[len + 8];
+
+	memset (hdr, 0, len);
+	if (rt_type == TRACE_RTHDR_SRH)
+	{
+		/* RFC 8754: the segments are listed backward, and the kernel
+		 * writes the final destination in the first entry. */
+		if ((len >> 3) > 256)
+		{
+			errno = EINVAL;
 			return -1;
+		}
+		hdr[1] = (len >> 3) - 1;
+		hdr[2] = TRACE_RTHDR_SRH;
+		hdr[3] = hdr[4] = segc; // segments left, last entry
+		for (int i = 0; i < segc; i++)
+			memcpy (hdr + 8 + 16 * (segc - i), segv + i, 16);
+	}
+	else
+	if (segc > 0)
+	{
+		inet6_rth_init (hdr, len, IPV6_RTHDR_TYPE_0, segc);
+		for (int i = 0; i < segc; i++)
+			if (inet6_rth_add (hdr, segv + i))
+				return -1;
 	}
 
+	rt_cur = segv;
+	rt_curc = segc;
+	if (sim != NULL)
+		return 0; // the simulated network ignores routing headers
+
 #ifdef IPV6_RTHDR
-	return setsockopt (fd, SOL_IPV6, IPV6_RTHDR, hdr, sizeof (hdr));
+	if (setsockopt (fd, SOL_IPV6, IPV6_RTHDR, (len > 0) ? hdr : NULL, len))
+		return -1;
+	rt_len = len;
+	return 0;
 #else
 	errno = ENOSYS;
 	return -1;
@@ -851,6 +1187,40 @@ static int setsock_rth (int fd, int type, const char **segv, int segc)
 }
 
 
+/**
+ * Splits a line of a targets file: a destination, then the segments
+ * (if any) of its route, and an optional comment.
+ * @return the destination, or NULL if the line is blank or invalid
+ * (then *segc is -1).
+ */
+static const char *split_target (char *line, const char **segv, int *segc)
+{
+	const char *host = NULL;
+	char *tok, *saveptr;
+
+	line[strcspn (line, "#\r\n")] = '\0';
+	*segc = 0;
+
+	for (tok = strtok_r (line, " \t", &saveptr); tok != NULL;
+	     tok = strtok_r (NULL, " \t", &saveptr))
+	{
+		if (host == NULL)
+			host = tok;
+		else
+		if (*segc >= 127)
+		{
+			fprintf (stderr, _("%s: Too many route segments specified.\n"),
+			         host);
+			*segc = -1;
+			return NULL;
+		}
+		else
+			segv[(*segc)++] = tok;
+	}
+	return host;
+}
+
+
 /* Requests raw sockets ahead of use so we can drop root quicker */
 static struct
 {
@@ -884,6 +1254,9 @@ static int prepare_sockets (void)
 
 static int get_socket (int protocol)
 {
+	if (sim != NULL)
+		return sim_socket (sim, protocol);
+
 	errno = EPROTONOSUPPORT;
 	for (unsigned i = 0; i < sizeof (protofd) / sizeof (protofd[0]); i++)
 		if (protofd[i].protocol == protocol)
@@ -901,6 +1274,38 @@ static int get_socket (int protocol)
 }
 
 
+/**
+ * Opens a datagram socket that receives ICMPv6 errors on its error queue,
+ * for unprivileged traceroute. Only UDP and ICMPv6 Echo (ping sockets, if
+ * allowed by the net.ipv4.ping_group_range sysctl) are supported.
+ */
+static int get_dgram_socket (void)
+{
+#ifdef IPV6_RECVERR
+	const tracetype *dgram = (type == &udp_type) ? &udp_dgram_type
+	                                             : &echo_dgram_type;
+
+	int fd = socket (AF_INET6, SOCK_DGRAM, dgram->protocol);
+	if (fd == -1)
+		return -1;
+
+	if (setsockopt (fd, SOL_IPV6, IPV6_RECVERR, &(int){ 1 }, sizeof (int)))
+	{
+		close (fd);
+		return -1;
+	}
+	setsockopt (fd, SOL_SOCKET, SO_TIMESTAMPNS, &(int){ 1 }, sizeof (int));
+
+	type = dgram;
+	recverr = true;
+	return fd;
+#else
+	errno = EPERM;
+	return -1;
+#endif
+}
+
+
 static void drop_sockets (void)
 {
 	for (unsigned i = 0; i < sizeof (protofd) / sizeof (protofd[0]); i++)
@@ -908,296 +1313,2284 @@ static void drop_sockets (void)
 			close (protofd[i].fd);
 }
 
+/*
+ * In-flight probes, indexed by probe ID. An entry is only valid for the
+ * probe_hops() run (generation) that sent it, so that late replies to
+ * a previous destination or hop limit range are ignored. A run sends at
+ * most 255 * 255 probes, which fits in the ID space without wrapping.
+ */
+static struct
+{
+	unsigned gen;
+	uint8_t hlim;
+	uint16_t attempt;
+} inflight[65536];
+static unsigned inflight_gen = 0;
+static uint16_t next_id = 0;
+
 
+/**
+ * Sends a probe and records its sending time. With path MTU discovery,
+ * the probe size is reduced if the kernel knows a smaller path MTU.
+ */
 static int
-traceroute (const char *dsthost, const char *dstport,
-            const char *srchost, const char *srcport,
-            unsigned timeout, unsigned delay, unsigned retries,
-            size_t packet_len, int min_ttl, int max_ttl)
+send_probe (int fd, tracetest_t *t, unsigned hlim, unsigned attempt,
+            size_t *plen, size_t overhead, uint16_t port)
 {
-	/* Creates ICMPv6 socket to collect error packets */
-	int icmpfd = get_socket (IPPROTO_ICMPV6);
-	if (icmpfd == -1)
-	{
-		perror (_("Raw IPv6 socket"));
-		return -1;
-	}
+	uint16_t id = next_id++;
+
+	inflight[id].gen = inflight_gen;
+	inflight[id].hlim = hlim;
+	inflight[id].attempt = attempt;
 
-	/* Creates protocol-specific socket */
-	int protofd = get_socket (type->protocol);
-	if (protofd == -1)
+	while (type->send_probe (fd, hlim, id, *plen, port))
 	{
-		perror (_("Raw IPv6 socket"));
-		close (icmpfd);
-		return -1;
+		int mtu;
+
+		if (!pmtu || (errno != EMSGSIZE))
+			return -1;
+
+		if (getsockopt (fd, SOL_IPV6, IPV6_MTU, &mtu,
+		                &(socklen_t){ sizeof (mtu) })
+		 || ((size_t)mtu >= *plen + overhead) || ((size_t)mtu < overhead))
+		{
+			errno = EMSGSIZE; // not from getsockopt()
+			return -1;
+		}
+		*plen = mtu - overhead;
 	}
 
-	drop_sockets ();
+	t->mtu = pmtu ? (*plen + overhead) : 0;
+	mono_gettime (&t->sent);
+	probes_sent++;
+	return 0;
+}
 
-#ifdef IPV6_PKTINFO
-	/* Set outgoing interface */
-	if (*ifname)
+
+#ifdef SO_ATTACH_FILTER
+/* Tiny BPF assembler with forward-only symbolic jumps */
+enum
+{
+	L_NEXT = -1,
+	L_ACCEPT, L_DROP, L_MATCH,
+	L_WALK, // one per extension header, plus one
+	L_EXT = L_WALK + FILTER_EXTHDRS + 1,
+	L_FRAG = L_EXT + FILTER_EXTHDRS,
+	L_MAX = L_FRAG + FILTER_EXTHDRS
+};
+
+struct bpf_asm
+{
+	struct sock_filter insn[128];
+	signed char jt[128], jf[128];
+	int label[L_MAX];
+	unsigned len;
+};
+
+
+static void
+bpf_emit (struct bpf_asm *p, uint16_t code, uint32_t k, int jt, int jf)
+{
+	assert (p->len < sizeof (p->insn) / sizeof (p->insn[0]));
+	p->insn[p->len] = (struct sock_filter){ code, 0, 0, k };
+	p->jt[p->len] = jt;
+	p->jf[p->len] = jf;
+	p->len++;
+}
+
+
+static void bpf_label (struct bpf_asm *p, int label)
+{
+	p->label[label] = p->len;
+}
+
+
+static void bpf_link (struct bpf_asm *p)
+{
+	for (unsigned pc = 0; pc < p->len; pc++)
 	{
-		struct in6_pktinfo nfo;
+		struct sock_filter *f = p->insn + pc;
 
-		memset (&nfo, 0, sizeof (nfo));
-		nfo.ipi6_ifindex = if_nametoindex (ifname);
-		if (nfo.ipi6_ifindex == 0)
+		if (p->jt[pc] != L_NEXT)
 		{
-			fprintf (stderr, _("%s: %s\n"), ifname, strerror (ENXIO));
-			goto error;
+			unsigned off = p->label[(int)p->jt[pc]] - (pc + 1);
+			if (BPF_OP (f->code) == BPF_JA)
+				f->k = off;
+			else
+			{
+				assert (off <= 255);
+				f->jt = off;
+			}
 		}
-
-		if (setsockopt (protofd, SOL_IPV6, IPV6_PKTINFO, &nfo, sizeof (nfo)))
+		if (p->jf[pc] != L_NEXT)
 		{
-			perror (ifname);
-			goto error;
+			unsigned off = p->label[(int)p->jf[pc]] - (pc + 1);
+			assert (off <= 255);
+			f->jf = off;
 		}
 	}
-#endif
+}
 
-	setup_socket (icmpfd);
-	setup_socket (protofd);
 
-	/* Set ICMPv6 filter */
-	{
-		struct icmp6_filter f;
+/**
+ * Attaches a socket filter to the unconnected ICMPv6 socket.
+ * We are only interested if the inner IPv6 packet has the right
+ * IPv6 destination, and if the inner upper-layer header has our
+ * identity (source port, or ICMPv6 Echo identifier).
+ * If dst is NULL, any destination is accepted.
+ * A few extension headers are skipped in the quoted packet. In case of
+ * doubt, the packet is accepted and left to icmp_parse() to check.
+ */
+static void attach_filter (int fd, const struct sockaddr_in6 *dst)
+{
+	struct bpf_asm p = { .len = 0 };
 
-		ICMP6_FILTER_SETBLOCKALL (&f);
-		ICMP6_FILTER_SETPASS (ICMP6_DST_UNREACH, &f);
-		ICMP6_FILTER_SETPASS (ICMP6_TIME_EXCEEDED, &f);
-		ICMP6_FILTER_SETPASS (ICMP6_PARAM_PROB, &f);
-		setsockopt (icmpfd, SOL_ICMPV6, ICMP6_FILTER, &f, sizeof (f));
-	}
+	/* With a Routing header, the quoted destination is a segment */
+	if ((rt_len == 0) && (dst != NULL))
+		for (unsigned i = 0; i < 4; i++)
+		{
+			/* A = icmp->ip6_dst.s6_addr32[i]; */
+			bpf_emit (&p, BPF_LD + BPF_W + BPF_ABS, 8 + 24 + (i * 4),
+			          L_NEXT, L_NEXT);
+			/* if (A != dst.sin6_addr.s6_addr32[i]) goto drop; */
+			bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K,
+			          ntohl (dst->sin6_addr.s6_addr32[i]), L_NEXT, L_DROP);
+		}
 
-	/* Defines protocol-specific checksum offset */
-	if ((type->checksum_offset != -1)
-	 && setsockopt (protofd, SOL_IPV6, IPV6_CHECKSUM, &type->checksum_offset,
-	                sizeof (int)))
+	/* A = icmp->ip6_nxt; X = offsetof (upper-layer header); */
+	bpf_emit (&p, BPF_LD + BPF_B + BPF_ABS, 8 + 6, L_NEXT, L_NEXT);
+	bpf_emit (&p, BPF_LDX + BPF_W + BPF_IMM, 8 + 40, L_NEXT, L_NEXT);
+
+	for (unsigned i = 0; i < FILTER_EXTHDRS; i++)
 	{
-		perror ("setsockopt(IPV6_CHECKSUM)");
-		goto error;
+		bpf_label (&p, L_WALK + i);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, type->protocol,
+		          L_MATCH, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_HOPOPTS,
+		          L_EXT + i, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_DSTOPTS,
+		          L_EXT + i, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_ROUTING,
+		          L_EXT + i, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_FRAGMENT,
+		          L_FRAG + i, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_AH,
+		          L_ACCEPT, L_DROP);
+
+		/* M[0] = nxt; X += (1 + hdrlen) << 3; A = M[0]; */
+		bpf_label (&p, L_EXT + i);
+		bpf_emit (&p, BPF_LD + BPF_B + BPF_IND, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_ST, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_LD + BPF_B + BPF_IND, 1, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_ALU + BPF_ADD + BPF_K, 1, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_ALU + BPF_LSH + BPF_K, 3, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_ALU + BPF_ADD + BPF_X, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_MISC + BPF_TAX, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_LD + BPF_MEM, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JA, 0, L_WALK + i + 1, L_NEXT);
+
+		/* M[0] = nxt; X += 8; A = M[0]; */
+		bpf_label (&p, L_FRAG + i);
+		bpf_emit (&p, BPF_LD + BPF_B + BPF_IND, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_ST, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_MISC + BPF_TXA, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_ALU + BPF_ADD + BPF_K, 8, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_MISC + BPF_TAX, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_LD + BPF_MEM, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JA, 0, L_WALK + i + 1, L_NEXT);
 	}
 
-	/* Set ICMPv6 filter for echo replies */
+	/* Too many extension headers: let the userland decide */
+	bpf_label (&p, L_WALK + FILTER_EXTHDRS);
+	bpf_emit (&p, BPF_JMP + BPF_JA, 0, L_ACCEPT, L_NEXT);
+
+	bpf_label (&p, L_MATCH);
 	if (type->protocol == IPPROTO_ICMPV6)
 	{
-		// NOTE: we assume any ICMP probes type uses ICMP echo
-		struct icmp6_filter f;
-
-		ICMP6_FILTER_SETBLOCKALL (&f);
-		ICMP6_FILTER_SETPASS (ICMP6_ECHO_REPLY, &f);
-		setsockopt (protofd, SOL_ICMPV6, ICMP6_FILTER, &f, sizeof (f));
+		/* if (icmp6_type != ICMP6_ECHO_REQUEST) goto drop; */
+		bpf_emit (&p, BPF_LD + BPF_B + BPF_IND, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, ICMP6_ECHO_REQUEST,
+		          L_NEXT, L_DROP);
+		/* if (icmp6_id != our ID) goto drop; */
+		bpf_emit (&p, BPF_LD + BPF_H + BPF_IND, 4, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, ident,
+		          L_ACCEPT, L_DROP);
+	}
+	else
+	{
+		/* if (source port != sport) goto drop; */
+		bpf_emit (&p, BPF_LD + BPF_H + BPF_IND, 0, L_NEXT, L_NEXT);
+		bpf_emit (&p, BPF_JMP + BPF_JEQ + BPF_K, ntohs (sport),
+		          L_ACCEPT, L_DROP);
 	}
 
-#ifdef IPV6_TCLASS
-	/* Defines traffic class */
-	setsockopt (protofd, SOL_IPV6, IPV6_TCLASS, &tclass, sizeof (tclass));
+	/* return ~0U; */
+	bpf_label (&p, L_ACCEPT);
+	bpf_emit (&p, BPF_RET + BPF_K, ~0U, L_NEXT, L_NEXT);
+
+	/* drop: return 0; */
+	bpf_label (&p, L_DROP);
+	bpf_emit (&p, BPF_RET + BPF_K, 0, L_NEXT, L_NEXT);
+
+	bpf_link (&p);
+
+	struct sock_fprog sfp = {
+		.len = p.len,
+		.filter = p.insn,
+	};
+	setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER, &sfp, sizeof (sfp));
+}
 #endif
 
-	if (dontroute)
-		setsockopt (protofd, SOL_SOCKET, SO_DONTROUTE, &(int){ 1 },
-		            sizeof (int));
 
-	/* Defines Type 0 Routing Header */
-	if (rt_segc > 0)
-		setsock_rth (protofd, IPV6_RTHDR_TYPE_0, rt_segv, rt_segc);
+/*
+ * ICMPv6 rate limit pacing (-Z). Routers generate errors through a token
+ * bucket, so a hop typically answers the first attempts and drops the
+ * next ones. A hop with such partial losses is held back: its missing
+ * attempts are sent again one at a time, with an exponential backoff,
+ * while the other hops are probed at full speed. Hops that answer no
+ * attempt at all are deemed silent, and are not probed again.
+ */
+#define PACE_BACKOFF 200000000 // initial backoff (nanoseconds)
+#define PACE_MAX 1000000000 // slowest common rate limit (nanoseconds)
+
+typedef struct
+{
+	int64_t due, backoff; // nanoseconds
+	int attempt; // attempt being probed again, or -1
+	unsigned budget; // probes left
+	bool held;
+} pace_t;
+
+
+/* Whether a hop answered some attempts, but not all of them */
+static bool pace_limited (const tracetest_t *line, unsigned retries)
+{
+	unsigned answered = 0;
+
+	for (unsigned i = 0; i < retries; i++)
+		if (line[i].result != TRACE_TIMEOUT)
+			answered++;
+	return (answered > 0) && (answered < retries);
+}
+
+
+/* Returns the first attempt without a reply, or -1 if there is none */
+static int pace_missing (const tracetest_t *line, unsigned retries)
+{
+	for (unsigned i = 0; i < retries; i++)
+		if (line[i].result == TRACE_TIMEOUT)
+			return i;
+	return -1;
+}
+
+
+/*
+ * Forgets the probes previously sent for an attempt, so that late replies
+ * are not matched with the sending time of the new one.
+ */
+static void forget_probes (uint16_t first_id, unsigned hlim, unsigned attempt)
+{
+	for (uint16_t id = first_id; id != next_id; id++)
+		if ((inflight[id].gen == inflight_gen)
+		 && (inflight[id].hlim == hlim) && (inflight[id].attempt == attempt))
+			inflight[id].gen--;
+}
+
+
+static void show_progress (unsigned progress, unsigned total)
+{
+	if (progress > total)
+		progress = total; // probed again after a timeout
+	printf (_(" %3u%% completed..."), 100 * progress / total);
+	fputc ('\r', stdout);
+}
+
+
+/**
+ * Probes every hop limit from min_ttl to *pmax_ttl, pipelining probes.
+ * tab holds retries results per hop limit, starting from min_ttl.
+ * If the destination responds, *pmax_ttl is lowered to its distance and
+ * *val is set to 1, or -1 if it is unreachable.
+ * @return 0 on success, -1 if a probe could not be sent.
+ */
+static int
+probe_hops (int protofd, int icmpfd, const struct sockaddr_in6 *dst,
+            tracetest_t *tab, unsigned retries, int min_ttl, int *pmax_ttl,
+            size_t *packet_len, size_t overhead, unsigned timeout,
+            unsigned delay, rtt_estimator *est, bool output, int *val)
+{
+	int max_ttl = *pmax_ttl;
+	size_t tabsize = (1 + max_ttl - min_ttl) * retries;
+	bool meter = output && (format == TRACE_FORMAT_TEXT) && isatty (1);
+	pace_t pacing[256];
+	unsigned held = 0;
+	int shown = min_ttl; // first hop not output yet
+	uint16_t first_id = next_id;
+	unsigned long first_sent = probes_sent;
+
+	inflight_gen++;
+	memset (pacing, 0, sizeof (pacing));
+
+	struct timespec delay_ts;
+	if (delay)
+	{
+		div_t d = div (delay, 1000);
+		delay_ts.tv_sec = d.quot;
+		delay_ts.tv_nsec = d.rem * 1000000;
+	}
+
+	for (unsigned step = 1, progress = 0;
+	     (step < (1 + max_ttl - min_ttl) + retries) || (held > 0);
+	     step++)
+	{
+		unsigned pending = 0;
+		unsigned total = retries * (max_ttl - min_ttl + 1);
+
+		if (meter)
+			show_progress (progress, total);
+
+		if (step >= (1 + max_ttl - min_ttl) + retries)
+		{
+			/* Only held hops are left: waits for the next one */
+			int64_t due = INT64_MAX;
+
+			for (int hl = shown; hl <= max_ttl; hl++)
+				if (pacing[hl - min_ttl].held
+				 && (pacing[hl - min_ttl].due < due))
+					due = pacing[hl - min_ttl].due;
+
+			struct timespec ts;
+			ns2ts (&ts, due);
+			mono_sleep_until (&ts);
+		}
+		else
+		if (delay && (step > 1))
+			mono_nanosleep (&delay_ts);
+
+		/* Sends requests */
+		for (unsigned i = 0; i < retries; i++)
+		{
+			int attempt = (retries - 1) - i;
+			int hlim = min_ttl + step + i - retries;
+
+			if ((hlim > max_ttl) || (hlim < min_ttl))
+				continue;
+
+			tracetest_t *t = tab + (hlim - min_ttl) * retries + attempt;
+			assert (t >= tab);
+			assert (t < tab + tabsize);
+
+			if (send_probe (protofd, t, hlim, attempt, packet_len,
+			                overhead, dst->sin6_port))
+			{
+				fprintf (stderr, _("Cannot send data: %s\n"),
+				         strerror (errno));
+				return -1;
+			}
+
+			pending++;
+		}
+
+		/* Probes held hops again as they become due */
+		if (held > 0)
+		{
+			int64_t now = mono_ns ();
+
+			for (int hl = shown; hl <= max_ttl; hl++)
+			{
+				pace_t *pc = pacing + (hl - min_ttl);
+				tracetest_t *line = tab + (hl - min_ttl) * retries;
+
+				if (!pc->held || (pc->due > now))
+					continue;
+
+				pc->attempt = pace_missing (line, retries);
+				if ((pc->attempt < 0)
+				 || (probes_sent - first_sent >= 65535))
+				{
+					pc->held = false; // no ID left for this run
+					pc->attempt = -1;
+					continue;
+				}
+
+				forget_probes (first_id, hl, pc->attempt);
+				if (send_probe (protofd, line + pc->attempt, hl,
+				                pc->attempt, packet_len, overhead,
+				                dst->sin6_port))
+				{
+					fprintf (stderr, _("Cannot send data: %s\n"),
+					         strerror (errno));
+					return -1;
+				}
+				pc->budget--;
+				pending++;
+			}
+		}
+
+		struct timespec deadline;
+		rtt_deadline (est, &deadline, timeout);
+
+		/* Receives replies */
+		while (pending > 0)
+		{
+			tracetest_t results;
+			int hlim, id, attempt;
+			memset (&results, 0, sizeof (results));
+			int res = probe (protofd, icmpfd, dst, &deadline,
+			                 &results, &hlim, &id);
+
+			if ((hlim == -1) && (id == -1)) /* timeout! */
+			{
+				progress += pending;
+				break;
+			}
+
+			if (id != -1)
+			{
+				if ((inflight[id].gen != inflight_gen)
+				 || ((hlim != -1) && (hlim != inflight[id].hlim)))
+					continue; // stale or foreign probe
+
+				hlim = inflight[id].hlim;
+				attempt = inflight[id].attempt;
+			}
+			else /* only the hop limit is known: guess the attempt */
+				attempt = min_ttl + step - (hlim + 1);
+
+			if ((hlim > max_ttl) || (hlim < min_ttl))
+				continue;
+
+			if ((attempt < 0) || ((unsigned)attempt >= retries))
+				continue;
+
+			tracetest_t *t = tab + (hlim - min_ttl) * retries + attempt;
+			assert (t >= tab);
+			assert (t < tab + tabsize);
+
+			if (results.result == TRACE_TOOBIG)
+			{
+				/* Shrink probes and send this one again */
+				if ((t->result == TRACE_TIMEOUT)
+				 && (results.mtu >= 1280) && (results.mtu < t->mtu))
+				{
+					if (results.mtu < *packet_len + overhead)
+						*packet_len = results.mtu - overhead;
+
+					if (send_probe (protofd, t, hlim, attempt,
+					                packet_len, overhead, dst->sin6_port))
+					{
+						fprintf (stderr, _("Cannot send data: %s\n"),
+						         strerror (errno));
+						return -1;
+					}
+				}
+				continue;
+			}
+
+			if (t->result == TRACE_TIMEOUT /* no result yet */)
+			{
+				struct timespec buf = t->sent;
+				unsigned mtu = t->mtu;
+				memcpy (t, &results, sizeof (*t));
+				t->sent = buf;
+				t->mtu = mtu;
+				pending--;
+
+				/* A kernel timestamp can precede the end of the send call */
+				if (ts2ns (&t->rcvd) < ts2ns (&t->sent))
+					t->rcvd = t->sent;
+
+				struct timespec rtt;
+				tsdiff (&rtt, &t->sent, &t->rcvd);
+				rtt_update (est, &rtt);
+
+				if (meter)
+					show_progress (++progress, total);
+			}
+
+			if (res && (*val <= 0))
+			{
+				*val = res > 0 ? 1 : -1; // sign <-> reachability
+				max_ttl = hlim;
+			}
+		}
+
+		if (meter)
+		{
+			// white spaces to erase "xxx% completed..."
+			fputs (_("                  "), stdout);
+			fputc ('\r', stdout);
+		}
+
+		/* Holds back the hop whose attempts were all sent, if need be */
+		int done = min_ttl + step - retries;
+		int64_t now = mono_ns ();
+
+		if (pace && (done >= min_ttl) && (done <= max_ttl)
+		 && pace_limited (tab + (done - min_ttl) * retries, retries))
+		{
+			pace_t *pc = pacing + (done - min_ttl);
+
+			pc->held = true;
+			pc->attempt = -1;
+			pc->budget = retries;
+			pc->backoff = PACE_BACKOFF;
+			pc->due = now + pc->backoff;
+		}
+
+		held = 0;
+		for (int hl = shown; hl <= max_ttl; hl++)
+		{
+			pace_t *pc = pacing + (hl - min_ttl);
+			const tracetest_t *line = tab + (hl - min_ttl) * retries;
+
+			if (!pc->held)
+				continue;
+
+			if (pc->attempt >= 0)
+			{
+				/* Slows down further if still rate limited */
+				if ((line[pc->attempt].result == TRACE_TIMEOUT)
+				 && (pc->backoff < PACE_MAX))
+					pc->backoff = (2 * pc->backoff < PACE_MAX)
+						? 2 * pc->backoff : PACE_MAX;
+				pc->attempt = -1;
+				pc->due = now + pc->backoff;
+
+				if ((pc->budget == 0) || (pace_missing (line, retries) < 0))
+				{
+					pc->held = false;
+					continue;
+				}
+			}
+			held++;
+		}
+
+		/* Outputs completed hops in order */
+		while ((shown <= done) && (shown <= max_ttl)
+		    && !pacing[shown - min_ttl].held)
+		{
+			if (output)
+				output_hop (tab + retries * (shown - min_ttl), shown,
+				            retries);
+			shown++;
+		}
+	}
+
+	*pmax_ttl = max_ttl;
+	return 0;
+}
+
+
+/* Whether a hop was already seen while tracing other destinations */
+static bool
+known_hop (const tracetest_t *line, unsigned hlim, unsigned retries)
+{
+	for (unsigned col = 0; col < retries; col++)
+		if ((line[col].result != TRACE_TIMEOUT)
+		 && stopset_contains (stopset, hlim, &line[col].addr.sin6_addr))
+			return true;
+	return false;
+}
+
+
+static int64_t test_rtt (const tracetest_t *test)
+{
+	struct timespec rtt;
+
+	tsdiff (&rtt, &test->sent, &test->rcvd);
+	return (int64_t)rtt.tv_sec * 1000000000 + rtt.tv_nsec;
+}
+
+
+static void print_change (const trace_change_t *c)
+{
+	switch (c->kind)
+	{
+		case TRACE_CHANGE_NONE:
+			printf (ngettext ("path unchanged (%u hop)\n",
+			                  "path unchanged (%u hops)\n", c->ttl), c->ttl);
+			break;
+
+		case TRACE_CHANGE_NEW:
+		case TRACE_CHANGE_GONE:
+		{
+			struct sockaddr_in6 hop =
+			{
+				.sin6_family = AF_INET6,
+				.sin6_addr = c->addr,
+			};
+
+			printf ("%2u %c", c->ttl,
+			        (c->kind == TRACE_CHANGE_NEW) ? '+' : '-');
+			printname ((struct sockaddr *)&hop, sizeof (hop));
+			if (asn != NULL)
+				printasn (&hop.sin6_addr);
+			fputc ('\n', stdout);
+			break;
+		}
+
+		case TRACE_CHANGE_RTT:
+		{
+			struct timespec before =
+			{
+				.tv_sec = c->before / 1000000000,
+				.tv_nsec = c->before % 1000000000,
+			}, after =
+			{
+				.tv_sec = c->after / 1000000000,
+				.tv_nsec = c->after % 1000000000,
+			};
+
+			printf ("%2u ", c->ttl);
+			printrtt (&before);
+			fputs ("->", stdout);
+			printrtt (&after);
+			fputc ('\n', stdout);
+			break;
+		}
+
+		case TRACE_CHANGE_REACHED:
+			if (c->after == 0)
+				printf (_("destination not reached (was %"PRId64" hops)\n"),
+				        c->before);
+			else
+			if (c->before == 0)
+				printf (_("destination reached at %"PRId64" hops "
+				          "(was not reached)\n"), c->after);
+			else
+				printf (_("destination reached at %"PRId64" hops "
+				          "(was %"PRId64")\n"), c->after, c->before);
+			break;
+	}
+}
+
+
+static void output_change (const trace_change_t *c)
+{
+	switch (format)
+	{
+		case TRACE_FORMAT_TEXT:
+			print_change (c);
+			break;
+
+		case TRACE_FORMAT_JSON:
+			json_write_change (stdout, c);
+			break;
+
+		default: // see main()
+			return;
+	}
+	fflush (stdout);
+}
+
+
+/**
+ * Compares a trace with its baseline, from min_ttl to max_ttl, and
+ * reports the differences if output is true. Addresses from the baseline
+ * are only reported as gone if none of them responded, as a few probes
+ * cannot tell all the load-balanced paths.
+ * @return whether the path changed (RTT shifts excluded).
+ */
+static bool
+diff_path (const trace_path_t *base, const tracetest_t *tab,
+           unsigned retries, int min_ttl, int max_ttl,
+           const struct in6_addr *dst, bool output)
+{
+	static const trace_path_hop_t none = { .count = 0, .rtt = -1 };
+	trace_change_t c;
+	int last = ((unsigned)max_ttl > base->hops) ? max_ttl : (int)base->hops;
+	unsigned reached = 0;
+	bool changed = false, shifted = false;
+
+	for (int hl = min_ttl; hl <= last; hl++)
+	{
+		const trace_path_hop_t *bhop = ((unsigned)hl <= base->hops)
+		                               ? base->hop + (hl - 1) : &none;
+		const tracetest_t *line = (hl <= max_ttl)
+		                          ? tab + (hl - min_ttl) * retries : NULL;
+		unsigned cols = (line != NULL) ? retries : 0;
+		bool common = false;
+		int64_t rtt = -1;
+
+		c.ttl = hl;
+		for (unsigned col = 0; col < cols; col++)
+		{
+			const tracetest_t *test = line + col;
+			const struct in6_addr *addr = &test->addr.sin6_addr;
+
+			if (test->result == TRACE_TIMEOUT)
+				continue;
+
+			int64_t val = test_rtt (test);
+			if ((rtt < 0) || (val < rtt))
+				rtt = val;
+			if (!memcmp (addr, dst, 16) && (reached == 0))
+				reached = hl;
+
+			if (path_hop_has (bhop, addr))
+			{
+				common = true;
+				continue;
+			}
+
+			/* Reports every new address once */
+			unsigned prev = 0;
+			while ((prev < col)
+			    && ((line[prev].result == TRACE_TIMEOUT)
+			     || memcmp (&line[prev].addr.sin6_addr, addr, 16)))
+				prev++;
+			if (prev < col)
+				continue;
+
+			changed = true;
+			if (output)
+			{
+				c.kind = TRACE_CHANGE_NEW;
+				c.addr = *addr;
+				output_change (&c);
+			}
+		}
+
+		if (!common)
+			for (unsigned i = 0; i < bhop->count; i++)
+			{
+				changed = true;
+				if (output)
+				{
+					c.kind = TRACE_CHANGE_GONE;
+					c.addr = bhop->addr[i];
+					output_change (&c);
+				}
+			}
+
+		if ((rtt >= 0) && (bhop->rtt >= 0)
+		 && (llabs (rtt - bhop->rtt) > rtt_shift))
+		{
+			shifted = true;
+			if (output)
+			{
+				c.kind = TRACE_CHANGE_RTT;
+				c.before = bhop->rtt;
+				c.after = rtt;
+				output_change (&c);
+			}
+		}
+	}
+
+	if (reached != base->reached)
+	{
+		changed = true;
+		if (output)
+		{
+			c.kind = TRACE_CHANGE_REACHED;
+			c.before = base->reached;
+			c.after = reached;
+			output_change (&c);
+		}
+	}
+
+	if (output && !changed && !shifted)
+	{
+		c.kind = TRACE_CHANGE_NONE;
+		c.ttl = reached;
+		output_change (&c);
+	}
+	return changed;
+}
+
+
+static void
+print_summary (unsigned ttl, const trace_path_hop_t *hop, const trace_hist_t *h)
+{
+	static const unsigned pcts[] = { 50, 90, 99 };
+	unsigned long sent = h->answered + h->lost;
+
+	printf ("%2u ", ttl);
+	if (hop->count == 0)
+		fputs (" *", stdout);
+
+	for (unsigned i = 0; i < hop->count; i++)
+	{
+		struct sockaddr_in6 addr =
+		{
+			.sin6_family = AF_INET6,
+			.sin6_addr = hop->addr[i],
+		};
+
+		printname ((struct sockaddr *)&addr, sizeof (addr));
+		if (asn != NULL)
+			printasn (&addr.sin6_addr);
+	}
+
+	if (h->answered > 0)
+	{
+		struct timespec rtt;
+
+		for (unsigned i = 0; i < sizeof (pcts) / sizeof (pcts[0]); i++)
+		{
+			int64_t ns = hist_percentile (h, pcts[i]);
+
+			rtt.tv_sec = ns / 1000000000;
+			rtt.tv_nsec = ns % 1000000000;
+			printf (" p%u", pcts[i]);
+			printrtt (&rtt);
+		}
+		rtt.tv_sec = h->max / 1000000000;
+		rtt.tv_nsec = h->max % 1000000000;
+		fputs (_(" max"), stdout);
+		printrtt (&rtt);
+	}
+
+	unsigned permille = (sent > 0) ? (1000 * h->lost + sent / 2) / sent : 0;
+	printf (_(" loss %u.%u%% (%lu/%lu)\n"), permille / 10, permille % 10,
+	        h->lost, sent);
+}
+
+
+/**
+ * Probes every hop limit retries times, SUMMARY_ROUND attempts at a time,
+ * and outputs the round-trip time distribution of each hop, rather than
+ * every probe. Memory usage does not depend on the number of attempts.
+ */
+#define SUMMARY_ROUND 64
+
+static int
+trace_summary (int protofd, int icmpfd, const struct sockaddr_in6 *dst,
+               unsigned retries, int min_ttl, int max_ttl,
+               size_t *packet_len, size_t overhead, unsigned timeout,
+               unsigned delay, rtt_estimator *est, int *val)
+{
+	unsigned round = (retries < SUMMARY_ROUND) ? retries : SUMMARY_ROUND;
+	unsigned hops = 1 + max_ttl - min_ttl;
+	tracetest_t *tab = calloc (hops * round, sizeof (*tab));
+	trace_path_hop_t *addrs = calloc (hops, sizeof (*addrs));
+	trace_hist_t *hist = calloc (hops, sizeof (*hist));
+
+	if ((tab == NULL) || (addrs == NULL) || (hist == NULL))
+	{
+		perror ("calloc");
+		goto error;
+	}
+
+	for (unsigned done = 0; done < retries; done += round)
+	{
+		if (round > retries - done)
+			round = retries - done;
+
+		memset (tab, 0, hops * round * sizeof (*tab));
+		if (probe_hops (protofd, icmpfd, dst, tab, round, min_ttl, &max_ttl,
+		                packet_len, overhead, timeout, delay, est, false,
+		                val))
+			goto error;
+
+		for (int hl = min_ttl; hl <= max_ttl; hl++)
+		{
+			const tracetest_t *line = tab + (hl - min_ttl) * round;
+			trace_path_hop_t *hop = addrs + (hl - min_ttl);
+			trace_hist_t *h = hist + (hl - min_ttl);
+
+			for (unsigned col = 0; col < round; col++)
+			{
+				const tracetest_t *test = line + col;
+
+				if (test->result == TRACE_TIMEOUT)
+				{
+					h->lost++;
+					continue;
+				}
+
+				hist_add (h, ts2ns (&test->rcvd) - ts2ns (&test->sent));
+				if (!path_hop_has (hop, &test->addr.sin6_addr)
+				 && (hop->count < TRACE_PATH_ADDRS))
+					hop->addr[hop->count++] = test->addr.sin6_addr;
+			}
+		}
+	}
+
+	for (int hl = min_ttl; hl <= max_ttl; hl++)
+	{
+		const trace_path_hop_t *hop = addrs + (hl - min_ttl);
+		const trace_hist_t *h = hist + (hl - min_ttl);
+
+		switch (format)
+		{
+			case TRACE_FORMAT_TEXT:
+				print_summary (hl, hop, h);
+				break;
+
+			case TRACE_FORMAT_JSON:
+				json_write_summary (stdout, hl, hop, h);
+				break;
+
+			default:
+				break;
+		}
+	}
+	fflush (stdout);
+
+	free (hist);
+	free (addrs);
+	free (tab);
+	return 0;
+
+error:
+	free (hist);
+	free (addrs);
+	free (tab);
+	return -1;
+}
+
+
+/**
+ * Traces the route to one destination.
+ * @return 0 if the destination was reached, -2 if not, -1 on error.
+ */
+static int
+trace_dest (int protofd, int icmpfd, const char *dsthost,
+            const char *dstport, unsigned timeout, unsigned delay,
+            unsigned retries, size_t packet_len, int min_ttl, int max_ttl)
+{
+	/* Defines destination */
+	struct sockaddr_in6 dst;
+	char canonname[NI_MAXHOST];
+	memset (&dst, 0, sizeof (dst));
+	if (connect_proto (protofd, &dst, canonname, dsthost, dstport))
+		return -1;
+
+	const trace_path_t *base = NULL;
+	if (baseline != NULL)
+		base = baseline_lookup (baseline, &dst.sin6_addr);
+
+	struct sockaddr_in6 src;
+	if ((sim != NULL) ? sim_getsockname (sim, protofd, &src)
+	                  : getsockname (protofd, (struct sockaddr *)&src,
+	                                 &(socklen_t){ sizeof (src) }))
+		memset (&src, 0, sizeof (src));
+	if (format == TRACE_FORMAT_TEXT)
+		printf (ngettext ("%u hop max, ", "%u hops max, ", max_ttl),
+		        max_ttl);
+
+#ifdef SO_ATTACH_FILTER
+	if ((sim == NULL) && (icmpfd != -1))
+		attach_filter (icmpfd, &dst);
+#endif
+
+	/* Adjusts packets length */
+	if (packet_len == 0)
+	{
+		int mtu;
+
+		/* Start path MTU discovery from the link MTU */
+		packet_len = 60;
+		if (pmtu && (getsockopt (protofd, SOL_IPV6, IPV6_MTU, &mtu,
+		                         &(socklen_t){ sizeof (mtu) }) == 0))
+			packet_len = mtu;
+	}
+
+	size_t overhead = sizeof (struct ip6_hdr) + rt_len;
+	if (packet_len < overhead)
+		packet_len = overhead;
+
+	switch (format)
+	{
+		case TRACE_FORMAT_TEXT:
+			printf (ngettext ("%zu byte packets\n", "%zu bytes packets\n",
+			                  packet_len), packet_len);
+			break;
+
+		case TRACE_FORMAT_JSON:
+			json_write_trace (stdout, canonname, &dst, rt_cur, rt_curc,
+			                  type->protocol, min_ttl, max_ttl, retries,
+			                  packet_len);
+			break;
+
+		case TRACE_FORMAT_BINARY:
+			binary_write_trace (stdout, &dst, type->protocol,
+			                    min_ttl, max_ttl, retries, packet_len);
+			break;
+
+		case TRACE_FORMAT_NONE:
+			break;
+	}
+	packet_len -= overhead;
+
+	/* Performs traceroute */
+	int val = 0;
+	rtt_estimator est = { .valid = false };
+	shown_mtu = 0;
+	if (summary && (max_ttl >= min_ttl))
+	{
+		if (trace_summary (protofd, icmpfd, &dst, retries, min_ttl, max_ttl,
+		                   &packet_len, overhead, timeout, delay, &est,
+		                   &val))
+			return -1;
+	}
+	else
+	if (max_ttl >= min_ttl)
+	{
+		size_t tabsize = (1 + max_ttl - min_ttl) * retries;
+		tracetest_t *tab = calloc (tabsize ? tabsize : 1, sizeof (*tab));
+		if (tab == NULL)
+		{
+			perror ("calloc");
+			return -1;
+		}
+
+		/*
+		 * Confirms a known path with a single probe per hop, and only
+		 * traces it fully if it changed.
+		 */
+		if ((base != NULL) && (base->reached >= (unsigned)min_ttl)
+		 && (base->reached <= (unsigned)max_ttl))
+		{
+			int top = base->reached, qval = 0;
+
+			if (probe_hops (protofd, icmpfd, &dst, tab, 1, min_ttl, &top,
+			                &packet_len, overhead, timeout, delay, &est,
+			                false, &qval))
+			{
+				free (tab);
+				return -1;
+			}
+
+			if ((qval > 0)
+			 && !diff_path (base, tab, 1, min_ttl, top, &dst.sin6_addr,
+			                false))
+			{
+				diff_path (base, tab, 1, min_ttl, top, &dst.sin6_addr, true);
+				free (tab);
+				return 0;
+			}
+			memset (tab, 0, tabsize * sizeof (*tab));
+		}
+
+		int start = min_ttl, first = min_ttl;
+		if (stopset != NULL)
+		{
+			start = (stop_hlim > min_ttl) ? stop_hlim : min_ttl;
+			if (start > max_ttl)
+				start = max_ttl;
+			first = start;
+		}
+
+		/*
+		 * Backward probing (Doubletree): one hop at a time, from the start
+		 * hop limit down, until a hop known from previous destinations.
+		 */
+		for (int hl = start - 1; hl >= min_ttl; hl--)
+		{
+			tracetest_t *line = tab + (hl - min_ttl) * retries;
+			int hval = 0, top = hl;
+
+			if (probe_hops (protofd, icmpfd, &dst, line, retries, hl, &top,
+			                &packet_len, overhead, timeout, delay, &est,
+			                false, &hval))
+			{
+				free (tab);
+				return -1;
+			}
+			first = hl;
+
+			if (hval != 0)
+			{
+				/* The destination is no farther than that */
+				val = hval;
+				max_ttl = hl;
+			}
+			else
+			if (known_hop (line, hl, retries))
+				break;
+		}
+
+		for (int hl = first; (hl < start) && (hl <= max_ttl); hl++)
+			output_hop (tab + (hl - min_ttl) * retries, hl, retries);
+
+		/* Forward probing */
+		if ((start <= max_ttl)
+		 && probe_hops (protofd, icmpfd, &dst,
+		                tab + (start - min_ttl) * retries, retries, start,
+		                &max_ttl, &packet_len, overhead, timeout, delay,
+		                &est, base == NULL, &val))
+		{
+			free (tab);
+			return -1;
+		}
+
+		if (base != NULL)
+			diff_path (base, tab, retries, min_ttl, max_ttl, &dst.sin6_addr,
+			           true);
+
+		if ((graph != NULL)
+		 && graph_add_trace (graph, (first == 1) ? &src.sin6_addr : NULL,
+		                     tab + (first - min_ttl) * retries, first,
+		                     max_ttl, retries))
+			perror ("graph_add_trace");
+
+		/* Remembers the intermediate hops */
+		if (stopset != NULL)
+			for (int hl = first; hl <= max_ttl; hl++)
+			{
+				const tracetest_t *line = tab + (hl - min_ttl) * retries;
+
+				for (unsigned col = 0; col < retries; col++)
+					if ((line[col].result != TRACE_TIMEOUT)
+					 && memcmp (&line[col].addr.sin6_addr, &dst.sin6_addr,
+					            16))
+						stopset_add (stopset, hl,
+						             &line[col].addr.sin6_addr);
+			}
+
+		free (tab);
+	}
+
+	return val > 0 ? 0 : -2;
+}
+
+
+/*
+ * Threaded scan mode: a sender thread paces probes to every destination,
+ * breadth-first by hop limit, while receiver threads drain the replies.
+ *
+ * The sender logs every probe into a ring of 65536 slots indexed by probe
+ * ID, along with its destination, hop limit, attempt and send time. Slots
+ * are published with a sequence number (seqlock), so receivers read them
+ * without locks; a slot is only reused once its probe has timed out.
+ *
+ * With io_uring, a single thread sends and receives: the sender queues
+ * its probes, and handles the replies while waiting for the next one.
+ */
+typedef struct
+{
+	struct sockaddr_in6 dst;
+	struct sockaddr_in6 to; // without port, as raw sockets require
+	char *name;
+	struct in6_addr *segv; // own route segments, if any
+	int segc;
+	atomic_int reached; // smallest hop limit with a final response
+} scan_target_t;
+
+typedef struct
+{
+	atomic_uint seq; // zero while being written
+	atomic_uint_fast64_t info; // destination << 24 | hlim << 16 | attempt
+	atomic_int_fast64_t sent; // nanoseconds
+} scan_slot_t;
+
+typedef struct
+{
+	int protofd, icmpfd;
+	scan_target_t *targets;
+	unsigned count;
+	tracetest_t *tab; // count * tabsize results
+	atomic_bool *claimed; // whether a result was stored
+	size_t tabsize;
+	scan_slot_t *slots;
+	unsigned retries;
+	int min_ttl, max_ttl;
+	size_t plen;
+	int64_t timeout; // nanoseconds
+	unsigned long sent;
+	int errnum; // first send error
+	atomic_ulong answered;
+	atomic_bool done;
+	atomic_int_fast64_t end; // when the last probe times out
+	trace_uring_t *uring;
+} scan_t;
+
+static unsigned scan_threads = 0, scan_rate = 0;
+static bool scan_uring = false;
+
+
+/* Waits until a deadline, handling replies meanwhile with io_uring */
+static void scan_sleep (scan_t *s, const struct timespec *ts)
+{
+	if (s->uring == NULL)
+	{
+		mono_sleep_until (ts);
+		return;
+	}
+
+	while (mono_ns () < ts2ns (ts))
+		if (uring_wait (s->uring, ts) < 0)
+		{
+			mono_sleep_until (ts); // reported by scan_run_uring()
+			break;
+		}
+}
+
+
+static void *scan_sender (void *data)
+{
+	scan_t *s = data;
+	int64_t period = scan_rate ? (1000000000 / scan_rate) : 0;
+	int64_t next = mono_ns ();
+	unsigned seq = 0;
+
+	for (int hl = s->min_ttl; hl <= s->max_ttl; hl++)
+		for (unsigned attempt = 0; attempt < s->retries; attempt++)
+			for (unsigned i = 0; i < s->count; i++)
+			{
+				scan_target_t *tgt = s->targets + i;
+
+				if (hl > atomic_load_explicit (&tgt->reached,
+				                               memory_order_relaxed))
+					continue; // beyond the destination
+
+				/* Switches routes: the routing header sticks to the socket */
+				const struct in6_addr *segv = tgt->segc ? tgt->segv : rt_addrv;
+				if ((segv != rt_cur)
+				 && setsock_rth (s->protofd, segv,
+				                 tgt->segc ? tgt->segc : rt_segc))
+				{
+					if (s->errnum == 0)
+						s->errnum = errno;
+					continue;
+				}
+
+				if (++seq == 0)
+					seq++;
+
+				uint16_t id = seq;
+				scan_slot_t *slot = s->slots + id;
+				int64_t now = mono_ns ();
+
+				/* Waits for the previous probe in this slot to time out */
+				int64_t reuse = atomic_load_explicit (&slot->sent,
+				                                      memory_order_relaxed);
+				if ((reuse != 0) && (reuse + s->timeout > next))
+					next = reuse + s->timeout;
+
+				if (next > now)
+				{
+					struct timespec ts;
+
+					ns2ts (&ts, next);
+					scan_sleep (s, &ts);
+					now = mono_ns ();
+				}
+				next = ((period != 0) ? next : now) + period;
+
+				atomic_store_explicit (&slot->seq, 0, memory_order_relaxed);
+				atomic_thread_fence (memory_order_release);
+				atomic_store_explicit (&slot->info,
+				                       ((uint_fast64_t)i << 24) | (hl << 16)
+				                        | attempt, memory_order_relaxed);
+				atomic_store_explicit (&slot->sent, now,
+				                       memory_order_relaxed);
+				atomic_store_explicit (&slot->seq, seq, memory_order_release);
+
+				send_dst = &tgt->to;
+				if (type->send_probe (s->protofd, hl, id, s->plen,
+				                      tgt->dst.sin6_port) == 0)
+					s->sent++;
+				else
+				if (s->errnum == 0)
+					s->errnum = errno;
+
+				/* Bounds the delay between the send date and actual send */
+				if ((s->uring != NULL) && ((seq % 16) == 0))
+					uring_flush (s->uring);
+			}
+
+	atomic_store (&s->end, mono_ns () + s->timeout);
+	atomic_store (&s->done, true);
+	return NULL;
+}
+
+
+/**
+ * Stores the result of a received packet if it answers one of our probes.
+ * res holds the sender address, received hop limit and date.
+ */
+static void
+scan_process (scan_t *s, void *pkt, size_t len, tracetest_t *res, bool icmp)
+{
+	static const struct sockaddr_in6 any = { .sin6_family = AF_INET6 };
+	struct sockaddr_in6 from = res->addr;
+
+	/* The destination port is the same for all destinations */
+	struct sockaddr_in6 dst = any;
+	dst.sin6_port = s->targets[0].dst.sin6_port;
+
+	int id, hlim, val;
+	if (icmp)
+		val = icmp_parse (type, pkt, len, res, &id, &hlim, &dst);
+	else
+		val = proto_parse (type, pkt, len, res, &id, &hlim, &dst);
+	if ((val <= 0) || (id == -1))
+		return;
+
+	/* Looks the probe up */
+	scan_slot_t *slot = s->slots + id;
+	unsigned seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+	uint_fast64_t info = atomic_load_explicit (&slot->info,
+	                                           memory_order_relaxed);
+	int64_t sent = atomic_load_explicit (&slot->sent, memory_order_relaxed);
+	atomic_thread_fence (memory_order_acquire);
+	if ((seq == 0)
+	 || (seq != atomic_load_explicit (&slot->seq, memory_order_relaxed)))
+		return; // not sent yet, or being reused
+
+	unsigned i = info >> 24;
+	int hl = (info >> 16) & 0xff;
+	unsigned attempt = info & 0xffff;
+	scan_target_t *tgt = s->targets + i;
+
+	if ((i >= s->count) || ((hlim != -1) && (hlim != hl)))
+		return;
+
+	bool final = !icmp || (val > 1);
+	if (icmp)
+	{
+		/* A late error for the previous probe with this ID might
+		 * quote another destination. */
+		const struct ip6_hdr *inhdr =
+			(const void *)((const struct icmp6_hdr *)pkt + 1);
+
+		if (memcmp (&inhdr->ip6_dst, &tgt->dst.sin6_addr, 16))
+			return; // error about another destination
+	}
+	else
+	{
+		if (memcmp (&from.sin6_addr, &tgt->dst.sin6_addr, 16))
+			return; // response from another host
+		res->addr = tgt->dst;
+	}
+
+	size_t idx = i * s->tabsize + (hl - s->min_ttl) * s->retries + attempt;
+	if (atomic_exchange (s->claimed + idx, true))
+		return; // duplicate
+
+	ns2ts (&res->sent, sent);
+	s->tab[idx] = *res;
+	atomic_fetch_add (&s->answered, 1);
+
+	if (final)
+	{
+		int old = atomic_load_explicit (&tgt->reached, memory_order_relaxed);
+		while ((hl < old)
+		    && !atomic_compare_exchange_weak (&tgt->reached, &old, hl));
+	}
+}
+
+
+/**
+ * Receives one packet from a socket, and processes it.
+ * @return -1 if there was no packet to receive, 0 otherwise.
+ */
+static int scan_recv (scan_t *s, int fd, bool icmp)
+{
+	union
+	{
+		struct icmp6_hdr hdr;
+		uint8_t buf[1240];
+	} pkt;
+	tracetest_t res;
+
+	memset (&res, 0, sizeof (res));
+	res.rhlim = -1;
+
+	ssize_t len = recv_payload (fd, &pkt, sizeof (pkt), &res.addr,
+	                            &res.rhlim);
+	if (len < 0)
+		return -1;
+
+	mono_gettime (&res.rcvd);
+	scan_process (s, &pkt, len, &res, icmp);
+	return 0;
+}
+
+
+static void scan_uring_cb (void *opaque, int fd, void *data, size_t len,
+                           const struct sockaddr_in6 *from, int hlim)
+{
+	scan_t *s = opaque;
+	tracetest_t res;
+
+	memset (&res, 0, sizeof (res));
+	mono_gettime (&res.rcvd);
+	res.addr = *from;
+	res.rhlim = hlim;
+	scan_process (s, data, len, &res, fd == s->icmpfd);
+}
+
+
+static void *scan_receiver (void *data)
+{
+	scan_t *s = data;
+
+	for (;;)
+	{
+		int wait = 100;
+
+		if (atomic_load (&s->done))
+		{
+			int64_t left = atomic_load (&s->end) - mono_ns ();
+
+			if ((left <= 0)
+			 || (atomic_load (&s->answered) == s->sent))
+				break;
+			if (left < 100000000)
+				wait = (left + 999999) / 1000000;
+		}
+
+		struct pollfd ufds[2] =
+		{
+			{ .fd = s->protofd, .events = POLLIN },
+			{ .fd = s->icmpfd, .events = POLLIN },
+		};
+
+		if (poll (ufds, 2, wait) <= 0)
+			continue;
+
+		for (unsigned j = 0; j < 2; j++)
+			if (ufds[j].revents)
+				while (scan_recv (s, ufds[j].fd, j == 1) == 0);
+	}
+	return NULL;
+}
+
+
+/* Runs the scan with one sender and scan_threads receiver threads */
+static int scan_run_threads (scan_t *s)
+{
+	/* Starts the receivers first, not to miss early replies */
+	pthread_t recv_threads[64], send_thread; // see -j
+	unsigned n = 0;
+	int err = 0;
+
+	while ((n < scan_threads)
+	    && !(err = pthread_create (recv_threads + n, NULL, scan_receiver, s)))
+		n++;
+
+	if (err == 0)
+		err = pthread_create (&send_thread, NULL, scan_sender, s);
+	if (err == 0)
+		pthread_join (send_thread, NULL);
+	else
+	{
+		fprintf (stderr, "pthread_create: %s\n", strerror (err));
+		atomic_store (&s->done, true);
+	}
+
+	while (n > 0)
+		pthread_join (recv_threads[--n], NULL);
+	return err ? -1 : 0;
+}
+
+
+/* Runs the scan on this thread with io_uring */
+static int scan_run_uring (scan_t *s)
+{
+	s->uring = uring_create (256, (s->plen > 64) ? s->plen : 64,
+	                         scan_uring_cb, s);
+	if ((s->uring == NULL)
+	 || uring_recv (s->uring, s->protofd)
+	 || uring_recv (s->uring, s->icmpfd))
+	{
+		fprintf (stderr, "io_uring: %s\n", strerror (errno));
+		if (s->uring != NULL)
+			uring_destroy (s->uring);
+		return -1;
+	}
+
+	send_uring = s->uring;
+	scan_sender (s);
+
+	/* Waits for the last replies */
+	int64_t end = atomic_load (&s->end);
+	int val = uring_flush (s->uring);
+
+	while ((val >= 0) && (atomic_load (&s->answered) != s->sent)
+	    && (mono_ns () < end))
+	{
+		struct timespec ts;
+
+		ns2ts (&ts, end);
+		val = uring_wait (s->uring, &ts);
+	}
+
+	if (val < 0)
+		fprintf (stderr, "io_uring: %s\n", strerror (errno));
+
+	if (s->errnum == 0)
+		s->errnum = uring_error (s->uring);
+	send_uring = NULL;
+	uring_destroy (s->uring);
+	return (val < 0) ? -1 : 0;
+}
+
+
+/* Reads and resolves the destinations */
+/**
+ * Resolves one destination.
+ * @return 0 on success, -1 on memory error, or a getaddrinfo() error.
+ */
+static int
+scan_target_init (scan_target_t *tgt, const char *host, const char *dstport,
+                  const char *const *segv, int segc)
+{
+	struct addrinfo hints, *res;
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = type->gai_socktype;
+	hints.ai_flags = AI_CANONNAME | AI_IDN;
+
+	int val = getaddrinfo_err (host, dstport, &hints, &res);
+	if (val)
+		return val;
+
+	memset (tgt, 0, sizeof (*tgt));
+	memcpy (&tgt->dst, res->ai_addr, sizeof (tgt->dst));
+	tgt->to = tgt->dst;
+	tgt->to.sin6_port = 0;
+	tgt->name = strdup (res->ai_canonname ?: host);
+	freeaddrinfo (res);
+	if (tgt->name == NULL)
+		return -1;
+
+	if (segc > 0)
+	{
+		tgt->segv = malloc (segc * sizeof (*tgt->segv));
+		if (tgt->segv == NULL)
+		{
+			free (tgt->name);
+			return -1;
+		}
+		if (resolve_segments (segv, segc, tgt->segv))
+		{
+			free (tgt->segv);
+			free (tgt->name);
+			return 1;
+		}
+		tgt->segc = segc;
+	}
+	return 0;
+}
+
+
+static scan_target_t *
+scan_resolve (const char *dsthost, FILE *targets, const char *dstport,
+              unsigned *pcount, bool *failed)
+{
+	scan_target_t *tab = NULL;
+	unsigned count = 0, size = 0;
+	char *buf = NULL;
+	size_t bufsize = 0;
+	const char *segv[127];
+	int segc = 0;
+
+	for (;;)
+	{
+		const char *host = dsthost;
+
+		if (targets != NULL)
+		{
+			if (getline (&buf, &bufsize, targets) == -1)
+				break;
+
+			host = split_target (buf, segv, &segc);
+			if (host == NULL)
+			{
+				if (segc < 0)
+					*failed = true;
+				continue;
+			}
+		}
+
+		if (count == size)
+		{
+			size = size ? (2 * size) : 64;
+
+			scan_target_t *n = realloc (tab, size * sizeof (*tab));
+			if (n == NULL)
+				goto error;
+			tab = n;
+		}
+
+		int val = scan_target_init (tab + count, host, dstport, segv, segc);
+		if (val == 0)
+			count++;
+		else
+		if (val == -1)
+			goto error;
+		else
+			*failed = true;
+
+		if (targets == NULL)
+			break;
+	}
+
+	free (buf);
+	*pcount = count;
+	return tab;
+
+error:
+	perror ("malloc");
+	free (buf);
+	while (count > 0)
+	{
+		count--;
+		free (tab[count].name);
+		free (tab[count].segv);
+	}
+	free (tab);
+	*pcount = 0;
+	return NULL;
+}
+
+
+/**
+ * Probes every destination of a scan, resolved beforehand.
+ * @return 0 on success, -1 on error.
+ */
+static int
+scan_run (scan_t *s, int protofd, int icmpfd, unsigned timeout,
+          unsigned retries, size_t *packet_len, int min_ttl, int max_ttl)
+{
+	if (*packet_len == 0)
+		*packet_len = 60;
+
+	size_t overhead = sizeof (struct ip6_hdr) + rt_len;
+	/* UDP probes need room for their probe ID */
+	if (*packet_len < overhead + 12)
+		*packet_len = overhead + 12;
+
+	s->protofd = protofd;
+	s->icmpfd = icmpfd;
+	s->retries = retries;
+	s->min_ttl = min_ttl;
+	s->max_ttl = max_ttl;
+	s->plen = *packet_len - overhead;
+	s->timeout = (int64_t)timeout * 1000000000;
+	s->tabsize = (max_ttl >= min_ttl) ? ((1 + max_ttl - min_ttl) * retries)
+	                                  : 0;
+	s->tab = calloc (s->count * s->tabsize + 1, sizeof (*s->tab));
+	s->claimed = calloc (s->count * s->tabsize + 1, sizeof (*s->claimed));
+	s->slots = calloc (65536, sizeof (*s->slots));
+	if ((s->tab == NULL) || (s->claimed == NULL) || (s->slots == NULL))
+	{
+		perror ("calloc");
+		return -1;
+	}
+
+	for (unsigned i = 0; i < s->count; i++)
+	{
+		atomic_init (&s->targets[i].reached, max_ttl);
+
+		/* Queued probes would all take the route of the last one */
+		if (scan_uring && (s->targets[i].segc > 0))
+		{
+			fprintf (stderr, _("%s: route segments cannot be used with "
+			                   "-u\n"), s->targets[i].name);
+			return -1;
+		}
+	}
+
+#ifdef SO_ATTACH_FILTER
+	if (sim == NULL)
+		attach_filter (icmpfd, NULL);
+#endif
+
+	if (scan_uring ? scan_run_uring (s) : scan_run_threads (s))
+		return -1;
+
+	if (s->errnum != 0)
+		fprintf (stderr, _("Cannot send data: %s\n"), strerror (s->errnum));
+
+	probes_sent += s->sent;
+	return 0;
+}
+
+
+/**
+ * Prints the results of one destination of a scan.
+ * @return whether the destination was reached.
+ */
+static bool scan_output (const scan_t *s, unsigned i, size_t packet_len)
+{
+	const scan_target_t *tgt = s->targets + i;
+	const tracetest_t *tab = s->tab + i * s->tabsize;
+	unsigned retries = s->retries;
+	int min_ttl = s->min_ttl, max_ttl = s->max_ttl;
+	int last = atomic_load (&tgt->reached);
+	char buf[INET6_ADDRSTRLEN];
+
+	switch (format)
+	{
+		case TRACE_FORMAT_TEXT:
+			inet_ntop (AF_INET6, &tgt->dst.sin6_addr, buf, sizeof (buf));
+			printf (_("traceroute to %s (%s) "), tgt->name, buf);
+			print_segments (tgt->segc ? tgt->segv : rt_addrv,
+			                tgt->segc ? tgt->segc : rt_segc);
+			if (has_port (type->protocol))
+				printf (_("port %u, from port %u, "),
+				        ntohs (tgt->dst.sin6_port), ntohs (sport));
+			printf (ngettext ("%u hop max, ", "%u hops max, ", max_ttl),
+			        max_ttl);
+			printf (ngettext ("%zu byte packets\n", "%zu bytes packets\n",
+			                  packet_len), packet_len);
+			break;
+
+		case TRACE_FORMAT_JSON:
+			json_write_trace (stdout, tgt->name, &tgt->dst,
+			                  tgt->segc ? tgt->segv : rt_addrv,
+			                  tgt->segc ? tgt->segc : rt_segc,
+			                  type->protocol, min_ttl, max_ttl, retries,
+			                  packet_len);
+			break;
+
+		case TRACE_FORMAT_BINARY:
+			binary_write_trace (stdout, &tgt->dst, type->protocol,
+			                    min_ttl, max_ttl, retries, packet_len);
+			break;
+
+		case TRACE_FORMAT_NONE:
+			break;
+	}
+
+	shown_mtu = 0;
+	for (int hl = min_ttl; hl <= last; hl++)
+		output_hop (tab + (hl - min_ttl) * retries, hl, retries);
+
+	if ((graph != NULL)
+	 && graph_add_trace (graph, NULL, tab, min_ttl, last, retries))
+		perror ("graph_add_trace");
+
+	/* Reached if the destination itself answered last */
+	bool reached = false;
+	if (last >= min_ttl)
+		for (unsigned col = 0; col < retries; col++)
+		{
+			const tracetest_t *t = tab + (last - min_ttl) * retries + col;
+
+			if ((t->result != TRACE_TIMEOUT)
+			 && !memcmp (&t->addr.sin6_addr, &tgt->dst.sin6_addr, 16))
+				reached = true;
+		}
+	return reached;
+}
+
+
+static void scan_free (scan_t *s)
+{
+	send_dst = NULL;
+	free (s->slots);
+	free (s->claimed);
+	free (s->tab);
+	for (unsigned i = 0; i < s->count; i++)
+	{
+		free (s->targets[i].name);
+		free (s->targets[i].segv);
+	}
+	free (s->targets);
+}
+
+
+/**
+ * Traces the routes to all destinations at once.
+ * @return 0 if all destinations were reached, -2 if not, -1 on error.
+ */
+static int
+scan_dests (int protofd, int icmpfd, const char *dsthost, FILE *targets,
+            const char *dstport, unsigned timeout, unsigned retries,
+            size_t packet_len, int min_ttl, int max_ttl)
+{
+	scan_t s;
+	bool failed = false;
+	int val = -1;
+
+	memset (&s, 0, sizeof (s));
+	s.targets = scan_resolve (dsthost, targets, dstport, &s.count, &failed);
+	if (s.count == 0)
+		return -1;
+
+	if (scan_run (&s, protofd, icmpfd, timeout, retries, &packet_len,
+	              min_ttl, max_ttl))
+		goto out;
+
+	/* Prints the results */
+	val = 0;
+	for (unsigned i = 0; i < s.count; i++)
+		if (!scan_output (&s, i, packet_len) && (val == 0))
+			val = -2;
+	if (failed)
+		val = -1;
+
+	if (targets != NULL)
+		fprintf (stderr, ngettext ("%lu probes sent to %u destination\n",
+		                           "%lu probes sent to %u destinations\n",
+		                           s.count), probes_sent, s.count);
+out:
+	scan_free (&s);
+	return val;
+}
+
+
+static int setup_options (int protofd, int icmpfd)
+{
+#ifdef IPV6_PKTINFO
+	/* Set outgoing interface */
+	if (*ifname)
+	{
+		struct in6_pktinfo nfo;
+
+		memset (&nfo, 0, sizeof (nfo));
+		nfo.ipi6_ifindex = if_nametoindex (ifname);
+		if (nfo.ipi6_ifindex == 0)
+		{
+			fprintf (stderr, _("%s: %s\n"), ifname, strerror (ENXIO));
+			return -1;
+		}
+
+		if (setsockopt (protofd, SOL_IPV6, IPV6_PKTINFO, &nfo, sizeof (nfo)))
+		{
+			perror (ifname);
+			return -1;
+		}
+	}
+#endif
+
+	/* Set ICMPv6 filter */
+	if (icmpfd != -1)
+	{
+		struct icmp6_filter f;
+
+		ICMP6_FILTER_SETBLOCKALL (&f);
+		ICMP6_FILTER_SETPASS (ICMP6_DST_UNREACH, &f);
+		ICMP6_FILTER_SETPASS (ICMP6_TIME_EXCEEDED, &f);
+		ICMP6_FILTER_SETPASS (ICMP6_PARAM_PROB, &f);
+		if (pmtu)
+			ICMP6_FILTER_SETPASS (ICMP6_PACKET_TOO_BIG, &f);
+		setsockopt (icmpfd, SOL_ICMPV6, ICMP6_FILTER, &f, sizeof (f));
+	}
+
+	/* Defines protocol-specific checksum offset */
+	if ((type->checksum_offset != -1)
+	 && setsockopt (protofd, SOL_IPV6, IPV6_CHECKSUM, &type->checksum_offset,
+	                sizeof (int)))
+	{
+		perror ("setsockopt(IPV6_CHECKSUM)");
+		return -1;
+	}
+
+	/* Set ICMPv6 filter for echo replies */
+	if ((type->protocol == IPPROTO_ICMPV6) && !recverr)
+	{
+		// NOTE: we assume any ICMP probes type uses ICMP echo
+		struct icmp6_filter f;
+
+		ICMP6_FILTER_SETBLOCKALL (&f);
+		ICMP6_FILTER_SETPASS (ICMP6_ECHO_REPLY, &f);
+		setsockopt (protofd, SOL_ICMPV6, ICMP6_FILTER, &f, sizeof (f));
+	}
+
+#ifdef IPV6_TCLASS
+	/* Defines traffic class */
+	setsockopt (protofd, SOL_IPV6, IPV6_TCLASS, &tclass, sizeof (tclass));
+#endif
+
+	if (dontroute)
+		setsockopt (protofd, SOL_SOCKET, SO_DONTROUTE, &(int){ 1 },
+		            sizeof (int));
+
+	if (pmtu)
+	{
+		/* Never fragment locally, and ignore the cached path MTU, so that
+		 * routers report it with Packet Too Big errors */
+#ifdef IPV6_DONTFRAG
+		setsockopt (protofd, SOL_IPV6, IPV6_DONTFRAG, &(int){ 1 },
+		            sizeof (int));
+#endif
+#ifdef IPV6_PMTUDISC_PROBE
+		setsockopt (protofd, SOL_IPV6, IPV6_MTU_DISCOVER,
+		            &(int){ IPV6_PMTUDISC_PROBE }, sizeof (int));
+#endif
+	}
+
+	/* Defines Routing Header */
+	if ((rt_segc > 0) && setsock_rth (protofd, rt_addrv, rt_segc))
+	{
+		perror ("setsockopt(IPV6_RTHDR)");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int
+traceroute (const char *dsthost, FILE *targets,
+            const char *dstport, const char *srchost, const char *srcport,
+            unsigned timeout, unsigned delay, unsigned retries,
+            size_t packet_len, int min_ttl, int max_ttl)
+{
+	/* Creates ICMPv6 socket to collect error packets */
+	int icmpfd = get_socket (IPPROTO_ICMPV6);
+	int protofd;
+
+	if ((icmpfd == -1) && ((errno == EPERM) || (errno == EACCES))
+	 && ((type == &udp_type) || (type == &echo_type)) && (scan_threads == 0))
+	{
+		/* Without privileges, try datagram sockets */
+		drop_sockets ();
+		protofd = get_dgram_socket ();
+		if (protofd == -1)
+		{
+			perror (_("Datagram IPv6 socket"));
+			return -1;
+		}
+	}
+	else
+	{
+		if (icmpfd == -1)
+		{
+			perror (_("Raw IPv6 socket"));
+			return -1;
+		}
+
+		/* Creates protocol-specific socket */
+		protofd = get_socket (type->protocol);
+		if (protofd == -1)
+		{
+			perror (_("Raw IPv6 socket"));
+			close (icmpfd);
+			return -1;
+		}
+
+		drop_sockets ();
+		setup_socket (icmpfd);
+	}
+
+	setup_socket (protofd);
+
+	/* The simulated network has no socket options */
+	if ((sim == NULL) && setup_options (protofd, icmpfd))
+		goto error;
+
+	if (bind_proto (protofd, srchost, srcport))
+		goto error;
+
+	int val;
+	if (scan_threads > 0)
+		val = scan_dests (protofd, icmpfd, dsthost, targets, dstport, timeout,
+		                  retries, packet_len, min_ttl, max_ttl);
+	else
+	if (targets == NULL)
+		val = trace_dest (protofd, icmpfd, dsthost, dstport, timeout, delay,
+		                  retries, packet_len, min_ttl, max_ttl);
+	else
+	{
+		/* One destination per line, with its own route segments if any */
+		char *buf = NULL;
+		size_t bufsize = 0;
+		unsigned count = 0;
+
+		val = 0;
+		while (getline (&buf, &bufsize, targets) != -1)
+		{
+			const char *segv[127];
+			struct in6_addr addrv[127];
+			int segc;
+
+			const char *host = split_target (buf, segv, &segc);
+			if (host == NULL)
+			{
+				if (segc < 0)
+					val = -1;
+				continue;
+			}
+
+			int res = 0;
+			if (segc > 0)
+			{
+				if (resolve_segments (segv, segc, addrv))
+				{
+					val = -1;
+					continue;
+				}
+				res = setsock_rth (protofd, addrv, segc);
+			}
+			else
+			if (rt_cur != rt_addrv)
+				res = setsock_rth (protofd, rt_addrv, rt_segc);
+
+			if (res)
+			{
+				perror ("setsockopt(IPV6_RTHDR)");
+				val = -1;
+				continue;
+			}
+
+			res = trace_dest (protofd, icmpfd, host, dstport, timeout, delay,
+			                  retries, packet_len, min_ttl, max_ttl);
+			if (res < val)
+				val = res;
+			count++;
+		}
+		free (buf);
+
+		fprintf (stderr, ngettext ("%lu probes sent to %u destination\n",
+		                           "%lu probes sent to %u destinations\n",
+		                           count), probes_sent, count);
+	}
+
+	/* Cleans up */
+	close (protofd);
+	close (icmpfd);
+	return val;
+
+error:
+	close (protofd);
+	close (icmpfd);
+	return -1;
+}
+
+
+/*
+ * Service mode (-C): trace requests from clients of a Unix socket are
+ * batched and run through the scan engine, so that they share the raw
+ * sockets, the replies demultiplexing and the global rate limit (-R).
+ * Queued requests with the same probe type and limits make one batch.
+ * The results are written back to each client, as they would be to the
+ * standard output, and followed by an end line with the outcome.
+ */
+static volatile sig_atomic_t serving = 1;
+
+static void serve_stop (int signum)
+{
+	(void)signum;
+	serving = 0;
+}
+
 
-	/* Defines destination */
-	struct sockaddr_in6 dst;
-	memset (&dst, 0, sizeof (dst));
-	if (connect_proto (protofd, &dst, dsthost, dstport, srchost, srcport))
-		goto error;
-	printf (ngettext ("%u hop max, ", "%u hops max, ", max_ttl), max_ttl);
+static bool
+same_batch (const trace_request_t *a, const trace_request_t *b)
+{
+	return (a->type == b->type) && !strcmp (a->port, b->port)
+	    && (a->min_ttl == b->min_ttl) && (a->max_ttl == b->max_ttl)
+	    && (a->retries == b->retries) && (a->timeout == b->timeout);
+}
 
-#ifdef SO_ATTACH_FILTER
-	{
-		/* Static socket filter for the unconnected ICMPv6 socket.
-		* We are only interested if the inner IPv6 packet has the
-		* right IPv6 destination */
-		struct sock_filter f[10], *pc = f;
-		struct sock_fprog sfp = {
-			.len = sizeof (f) / sizeof (f[0]),
-			.filter = f,
-		};
 
-		for (unsigned i = 0; i < 4; i++)
-		{
-			/* A = icmp->ip6_dst.s6_addr32[i]; */
-			pc->code = BPF_LD + BPF_W + BPF_ABS;
-			pc->jt = pc->jf = 0;
-			pc->k = 8 + 24 + (i * 4);
-			pc++;
+/*
+ * Sends the standard output to a temporary file, so that replies are
+ * never written directly to a client that might not be reading.
+ */
+static void serve_begin (int tmpfd)
+{
+	fflush (stdout);
+	if (ftruncate (tmpfd, 0) == 0)
+		lseek (tmpfd, 0, SEEK_SET);
+	dup2 (tmpfd, STDOUT_FILENO);
+}
 
-			/* if (A != dst.sin6_addr.s6_addr32[i]) goto drop; */
-			pc->code = BPF_JMP + BPF_JEQ + BPF_K;
-			pc->jt = 0;
-			pc->jf = f + (sizeof (f) / sizeof (f[0])) - (pc + 2);
-			pc->k = ntohl (dst.sin6_addr.s6_addr32[i]);
-			pc++;
-		}
 
-		/* return ~0U; */
-		pc->code = BPF_RET + BPF_K;
-		pc->jt = pc->jf = 0;
-		pc->k = ~0U;
-		pc++;
+/* Writes the end of a reply, queues it, and restores the standard output */
+static void
+serve_end (trace_server_t *srv, const trace_request_t *req,
+           const char *status, int out, int tmpfd)
+{
+	if (format == TRACE_FORMAT_JSON)
+		json_write_end (stdout, status, req->error);
+	else
+	if (req->error != NULL)
+		printf ("end %s %s\n", status, req->error);
+	else
+		printf ("end %s\n", status);
 
-		/* drop: return 0; */
-		pc->code = BPF_RET + BPF_K;
-		pc->jt = pc->jf = pc->k = 0;
+	fflush (stdout);
+	clearerr (stdout);
+	dup2 (out, STDOUT_FILENO);
 
-		assert ((++pc - f) == (sizeof (f) / sizeof (f[0])));
-		setsockopt (icmpfd, SOL_SOCKET, SO_ATTACH_FILTER, &sfp, sizeof (sfp));
-	}
-#endif
+	off_t len = lseek (tmpfd, 0, SEEK_CUR);
+	char *reply = (len > 0) ? malloc (len) : NULL;
 
-	/* Adjusts packets length */
-	size_t overhead = sizeof (struct ip6_hdr);
-	if (rt_segc > 0)
-		overhead += inet6_rth_space (IPV6_RTHDR_TYPE_0, rt_segc);
-	if (packet_len < overhead)
-		packet_len = overhead;
+	if ((reply != NULL) && (pread (tmpfd, reply, len, 0) == len))
+		server_done (srv, req->fd, reply, len);
+	else
+		server_done (srv, req->fd, NULL, 0);
+	free (reply);
+}
 
-	printf (ngettext ("%zu byte packets\n", "%zu bytes packets\n", packet_len),
-            packet_len);
-	packet_len -= overhead;
 
-	struct timespec delay_ts;
-	if (delay)
+static int
+serve (const char *path, const trace_request_t *defaults,
+       const char *srchost, const char *srcport, size_t packet_len)
+{
+	static const tracetype *const types[] =
+		{ &echo_type, &udp_type, &udplite_type, &syn_type };
+	int fds[sizeof (types) / sizeof (types[0])];
+	const tracetype *deftype = type;
+
+	int icmpfd = get_socket (IPPROTO_ICMPV6);
+	if (icmpfd == -1)
 	{
-		div_t d = div (delay, 1000);
-		delay_ts.tv_sec = d.quot;
-		delay_ts.tv_nsec = d.rem * 1000000;
+		perror (_("Raw IPv6 socket"));
+		return -1;
 	}
+	setup_socket (icmpfd);
 
-	/* Performs traceroute */
-	int val = 0;
-	if (max_ttl >= min_ttl)
+	/* Keeps a socket for every probe type, if allowed */
+	for (unsigned i = 0; i < sizeof (fds) / sizeof (fds[0]); i++)
 	{
-		tracetest_t tab[(1 + max_ttl - min_ttl) * retries];
-		memset (tab, 0, sizeof (tab));
+		type = types[i];
+		fds[i] = get_socket (type->protocol);
+		if (fds[i] == -1)
+			continue;
 
-		for (unsigned step = 1, progress = 0;
-		     step < (1 + max_ttl - min_ttl) + retries;
-		     step++)
+		setup_socket (fds[i]);
+		if (((sim == NULL) && setup_options (fds[i], icmpfd))
+		 || bind_proto (fds[i], srchost, srcport))
 		{
-			unsigned pending = 0;
-
-			if (isatty (1))
-			{
-				unsigned total = retries * (max_ttl - min_ttl + 1);
-				printf (_(" %3u%% completed..."), 100 * progress / total);
-				fputc ('\r', stdout);
-			}
+			close (fds[i]);
+			fds[i] = -1;
+		}
+	}
+	drop_sockets ();
+	type = deftype;
+
+	trace_request_t *batch = NULL;
+	unsigned size = 0;
+	int val = -1, out = dup (STDOUT_FILENO);
+	FILE *tmp = tmpfile (); // replies being written
+	int tmpfd = (tmp != NULL) ? fileno (tmp) : -1;
+	trace_server_t *srv = ((out != -1) && (tmpfd != -1))
+		? server_open (path, defaults) : NULL;
+	if (srv == NULL)
+	{
+		perror (path);
+		goto out;
+	}
 
-			if (delay && (step > 1))
-				mono_nanosleep (&delay_ts);
+	struct sigaction sa = { .sa_handler = serve_stop };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	signal (SIGPIPE, SIG_IGN);
 
-			/* Sends requests */
-			for (unsigned i = 0; i < retries; i++)
-			{
-				int attempt = (retries - 1) - i;
-				int hlim = min_ttl + step + i - retries;
+	while (serving)
+	{
+		if (server_poll (srv, -1))
+		{
+			perror (path);
+			break;
+		}
 
-				if ((hlim > max_ttl) || (hlim < min_ttl))
-					continue;
+		/* Takes every queued request */
+		trace_request_t req;
+		unsigned count = 0;
 
-				tracetest_t *t = tab + (hlim - min_ttl) * retries + attempt;
-				assert (t >= tab);
-				assert (t < tab + (sizeof (tab) / sizeof (tab[0])));
+		while (server_pop (srv, &req))
+		{
+			if (count == size)
+			{
+				trace_request_t *n;
 
-				if (type->send_probe (protofd, hlim, attempt, packet_len,
-				                      dst.sin6_port))
+				size = size ? (2 * size) : 64;
+				n = realloc (batch, size * sizeof (*batch));
+				if (n == NULL)
 				{
-					fprintf (stderr, _("Cannot send data: %s\n"),
-					         strerror (errno));
-					return -1;
+					perror ("realloc");
+					goto out;
 				}
-
-				mono_gettime (&t->sent);
-				pending++;
+				batch = n;
 			}
+			batch[count++] = req;
+		}
 
-			struct timespec deadline;
-			mono_gettime (&deadline);
-			deadline.tv_sec += timeout;
+		for (unsigned first = 0; first < count; first++)
+		{
+			trace_request_t *head = batch + first;
+			if (head->fd == -1)
+				continue; // already answered
 
-			/* Receives replies */
-			while (pending > 0)
-			{
-				tracetest_t results;
-				int hlim = -1;
-				int attempt = -1;
-				int res = probe (protofd, icmpfd, &dst, &deadline,
-				                 &results, &hlim, &attempt);
+			type = head->type;
 
-				if (hlim == -1) /* timeout! */
-				{
-					progress += pending;
-					break;
-				}
+			int protofd = -1;
+			for (unsigned i = 0; i < sizeof (fds) / sizeof (fds[0]); i++)
+				if (types[i]->protocol == type->protocol)
+					protofd = fds[i];
 
-				if ((hlim > max_ttl) || (hlim < min_ttl))
-					continue;
+			scan_t s;
+			memset (&s, 0, sizeof (s));
+			s.targets = calloc (count - first, sizeof (*s.targets));
+			if (s.targets == NULL)
+			{
+				perror ("calloc");
+				goto out;
+			}
 
-				if (attempt == -1)
-					attempt = min_ttl + step - (hlim + 1);
+			/* Resolves the requests of the same batch */
+			trace_request_t *reqv[count - first];
+			for (unsigned i = first; i < count; i++)
+			{
+				trace_request_t *r = batch + i;
 
-				if ((attempt < 0) || ((unsigned)attempt >= retries))
+				if ((r->fd == -1) || !same_batch (head, r))
 					continue;
 
-				tracetest_t *t = tab + (hlim - min_ttl) * retries + attempt;
-				assert (t >= tab);
-				assert (t < tab + (sizeof (tab) / sizeof (tab[0])));
+				if ((r->error == NULL) && (protofd == -1))
+					r->error = "probe type not available";
+				if ((r->error == NULL) && (r->max_ttl < r->min_ttl))
+					r->error = "invalid hop limits";
+				if ((r->error == NULL)
+				 && scan_target_init (s.targets + s.count, r->host,
+				                      r->port, NULL, 0))
+					r->error = "unknown destination";
 
-				if (t->result == TRACE_TIMEOUT /* no result yet */)
+				if (r->error != NULL)
 				{
-					struct timespec buf = t->sent;
-					memcpy (t, &results, sizeof (*t));
-					t->sent = buf;
-					pending--;
-
-					if (isatty (1))
-					{
-						unsigned total = retries * (max_ttl - min_ttl + 1);
-						printf (_(" %3u%% completed..."),
-						        100 * ++progress / total);
-						fputc ('\r', stdout);
-					}
+					serve_begin (tmpfd);
+					serve_end (srv, r, "error", out, tmpfd);
+					r->fd = -1;
 				}
+				else
+					reqv[s.count++] = r;
+			}
 
-				if (res && (val <= 0))
+			size_t plen = packet_len;
+			if ((s.count > 0)
+			 && scan_run (&s, protofd, icmpfd, head->timeout,
+			              head->retries, &plen, head->min_ttl,
+			              head->max_ttl) == 0)
+				for (unsigned i = 0; i < s.count; i++)
 				{
-					val = res > 0 ? 1 : -1; // sign <-> reachability
-					max_ttl = hlim;
+					serve_begin (tmpfd);
+					serve_end (srv, reqv[i],
+					           scan_output (&s, i, plen) ? "reached"
+					                                     : "unreached",
+					           out, tmpfd);
+					reqv[i]->fd = -1;
 				}
-			}
-
-			if (isatty (1))
-			{
-				// white spaces to erase "xxx% completed..."
-				fputs (_("                  "), stdout);
-				fputc ('\r', stdout);
-			}
-
-			if (step >= retries)
-			{
-				int hl = min_ttl + step - retries;
-				display (tab + retries *(hl - min_ttl), hl, hl, retries);
-			}
+			else
+				for (unsigned i = 0; i < s.count; i++)
+				{
+					reqv[i]->error = "probe failure";
+					serve_begin (tmpfd);
+					serve_end (srv, reqv[i], "error", out, tmpfd);
+					reqv[i]->fd = -1;
+				}
+			scan_free (&s);
 		}
 	}
+	val = 0;
 
-	/* Cleans up */
-	close (protofd);
-	close (icmpfd);
-	return val > 0 ? 0 : -2;
-
-error:
-	close (protofd);
+out:
+	free (batch);
+	if (srv != NULL)
+		server_close (srv);
+	if (out != -1)
+		close (out);
+	if (tmp != NULL)
+		fclose (tmp);
+	for (unsigned i = 0; i < sizeof (fds) / sizeof (fds[0]); i++)
+		if (fds[i] != -1)
+			close (fds[i]);
 	close (icmpfd);
-	return -1;
+	return val;
 }
 
 
@@ -1218,27 +3611,47 @@ usage (const char *path)
 
 	puts (_("\n"
 "  -A  send TCP ACK probes\n"
+"  -a  adapt the timeout to round-trip times of previous hops\n"
+"  -B  only report changes from the traces in a file (baseline)\n"
+"  -b  report RTT shifts beyond this many ms from the baseline (default: 10)\n"
+"  -C  serve trace requests from a Unix socket\n"
+"  -D  convert binary trace records from a file to other formats\n"
 "  -d  enable socket debugging\n"
 "  -E  set TCP Explicit Congestion Notification bits in TCP packets\n"
+"  -e  display ICMPv6 extensions (MPLS labels, interface information)\n"
 "  -f  specify the initial hop limit (default: 1)\n"
+"  -G  write the graph of all hops to a file ([dot:|csv:|binary:]file)\n"
 "  -g  insert a route segment within a \"Type 0\" routing header\n"
+"  -H  summarize round-trip times and losses of each hop\n"
 "  -h  display this help and exit\n"
 "  -I  use ICMPv6 Echo Request packets as probes\n"
 "  -i  force outgoing network interface\n"
+"  -j  probe all destinations at once, with this many receiver threads\n"
+"  -K  use a Segment Routing Header (SRv6) for route segments\n"
+"  -k  start at this hop limit, skipping hops known from previous targets\n"
 "  -l  display incoming packets hop limit\n"
+"  -M  discover the path MTU to every hop\n"
 "  -m  set the maximum hop limit (default: 30)\n"
 "  -N  perform reverse name lookups on the addresses of every hop\n"
 "  -n  don't perform reverse name lookup on addresses\n"
+"  -O  select output format: text (default), json, binary or none\n"
 "  -p  override destination port\n"
 "  -q  override the number of probes per hop (default: 3)\n"
+"  -R  limit the rate of probes per second (implies -j 1)\n"
 "  -r  do not route packets\n"
 "  -S  send TCP SYN probes\n"
 "  -s  specify the source IPv6 address of probe packets\n"
+"  -T  trace every destination listed in a file\n"
 "  -t  set traffic class of probe packets\n"
 "  -U  send UDP probes (default)\n"
+"  -u  use io_uring to send and receive probes (implies -j 1)\n"
 "  -V  display program version and exit\n"
 /*"  -v, --verbose  display all kind of ICMPv6 errors\n"*/
 "  -w  override the timeout for response in seconds (default: 5)\n"
+"  -X  probe a simulated network described in a topology file\n"
+"  -Y  compile the prefix table from -y to a binary image file and exit\n"
+"  -y  annotate hops with origin AS numbers from a prefix table file\n"
+"  -Z  probe hops that rate-limit their replies again, more slowly\n"
 "  -z  specify a time to wait (in ms) between each probes (default: 0)\n"
 	));
 
@@ -1294,35 +3707,55 @@ parse_plen (const char *str)
 static const struct option opts[] = 
 {
 	{ "ack",      no_argument,       NULL, 'A' },
+	{ "adaptive", no_argument,       NULL, 'a' },
+	{ "baseline", required_argument, NULL, 'B' },
+	{ "rtt-shift", required_argument, NULL, 'b' },
+	{ "server",   required_argument, NULL, 'C' },
+	{ "decode",   required_argument, NULL, 'D' },
 	{ "debug",    no_argument,       NULL, 'd' },
 	{ "ecn",      no_argument,       NULL, 'E' },
+	{ "extensions", no_argument,     NULL, 'e' },
 	// -F is a stub
 	{ "first",    required_argument, NULL, 'f' },
+	{ "graph",    required_argument, NULL, 'G' },
 	{ "segment",  required_argument, NULL, 'g' },
+	{ "histogram", no_argument,      NULL, 'H' },
 	{ "help",     no_argument,       NULL, 'h' },
 	{ "icmp",     no_argument,       NULL, 'I' },
 	{ "iface",    required_argument, NULL, 'i' },
+	{ "threads",  required_argument, NULL, 'j' },
+	{ "srh",      no_argument,       NULL, 'K' },
+	{ "stop-set", required_argument, NULL, 'k' },
 	{ "hlim",     no_argument,       NULL, 'l' },
+	{ "pmtu",     no_argument,       NULL, 'M' },
 	{ "max",      required_argument, NULL, 'm' },
 	// -N is not really a stub, should have a long name
 	{ "numeric",  no_argument,       NULL, 'n' },
+	{ "format",   required_argument, NULL, 'O' },
 	{ "port",     required_argument, NULL, 'p' },
 	{ "retry",    required_argument, NULL, 'q' },
+	{ "rate",     required_argument, NULL, 'R' },
 	{ "noroute",  no_argument,       NULL, 'r' },
 	{ "syn",      no_argument,       NULL, 'S' },
 	{ "source",   required_argument, NULL, 's' },
+	{ "targets",  required_argument, NULL, 'T' },
 	{ "tclass",   required_argument, NULL, 't' },
 	{ "udp",      no_argument,       NULL, 'U' },
+	{ "io-uring", no_argument,       NULL, 'u' },
 	{ "version",  no_argument,       NULL, 'V' },
 	/*{ "verbose",  no_argument,       NULL, 'v' },*/
 	{ "wait",     required_argument, NULL, 'w' },
+	{ "asn-compile", required_argument, NULL, 'Y' },
+	{ "asn",      required_argument, NULL, 'y' },
 	// -x is a stub
+	{ "simulate", required_argument, NULL, 'X' },
+	{ "pace",     no_argument,       NULL, 'Z' },
 	{ "delay",    required_argument, NULL, 'z' },
 	{ NULL,       0,                 NULL, 0   }
 };
 
 
-static const char optstr[] = "AdEFf:g:hIi:Llm:Nnp:q:rSs:t:UVw:xz:" "P:";
+static const char optstr[] = "AaB:b:C:D:dEeFf:G:g:HhIi:j:Kk:LlMm:NnO:p:q:R:rSs:T:t:UuVw:xX:Y:y:Zz:" "P:";
 
 int
 main (int argc, char *argv[])
@@ -1330,12 +3763,18 @@ main (int argc, char *argv[])
 	if (prepare_sockets () || setuid (getuid ()))
 		return 1;
 
+	ident = getident ();
+
 	setlocale (LC_ALL, "");
 	bindtextdomain (PACKAGE, LOCALEDIR);
 	textdomain (PACKAGE);
 
 	const char *dsthost, *srchost = NULL, *dstport = "33434", *srcport = NULL;
-	size_t plen = 60;
+	const char *decodename = NULL, *asnname = NULL, *asnimage = NULL;
+	const char *targetname = NULL, *graphname = NULL, *baselinename = NULL;
+	const char *simname = NULL, *servername = NULL;
+	bool doubletree = false;
+	size_t plen = 0;
 	unsigned retries = 3, wait = 5, delay = 0, minhlim = 1, maxhlim = 30;
 	int val;
 
@@ -1347,6 +3786,32 @@ main (int argc, char *argv[])
 				type = &ack_type;
 				break;
 
+			case 'a':
+				adaptive = true;
+				break;
+
+			case 'B':
+				baselinename = optarg;
+				break;
+
+			case 'C':
+				servername = optarg;
+				break;
+
+			case 'b':
+			{
+				char *end;
+				unsigned long l = strtoul (optarg, &end, 0);
+				if (*end || l > 1000000)
+					return quick_usage (argv[0]);
+				rtt_shift = (int64_t)l * 1000000;
+				break;
+			}
+
+			case 'D':
+				decodename = optarg;
+				break;
+
 			case 'd':
 				debug = true;
 				break;
@@ -1355,6 +3820,10 @@ main (int argc, char *argv[])
 				ecn = true;
 				break;
 
+			case 'e':
+				show_ext = true;
+				break;
+
 			case 'F': // stub (don't fragment)
 				break;
 
@@ -1363,6 +3832,10 @@ main (int argc, char *argv[])
 					return 1;
 				break;
 
+			case 'G':
+				graphname = optarg;
+				break;
+
 			case 'g':
 				if (rt_segc >= 127)
 				{
@@ -1374,6 +3847,10 @@ main (int argc, char *argv[])
 				rt_segv[rt_segc++] = optarg;
 				break;
 
+			case 'H':
+				summary = true;
+				break;
+
 			case 'h':
 				return usage (argv[0]);
 
@@ -1386,6 +3863,30 @@ main (int argc, char *argv[])
 				ifname[IFNAMSIZ - 1] = '\0';
 				break;
 
+			case 'j':
+			{
+				char *end;
+				unsigned long l = strtoul (optarg, &end, 0);
+				if (*end || (l < 1) || (l > 64))
+					return quick_usage (argv[0]);
+				scan_threads = l;
+				break;
+			}
+
+			case 'K':
+				rt_type = TRACE_RTHDR_SRH;
+				break;
+
+			case 'k':
+			{
+				unsigned hlim = parse_hlim (optarg);
+				if (hlim == (unsigned)(-1))
+					return 1;
+				stop_hlim = hlim;
+				doubletree = true;
+				break;
+			}
+
 			/* We should really have a generic option and
 			 * use getprotobyname() instead. Semantics of -L
 			 * will likely change in future versions!! */
@@ -1397,6 +3898,10 @@ main (int argc, char *argv[])
 				show_hlim = true;
 				break;
 
+			case 'M':
+				pmtu = true;
+				break;
+
 			case 'm':
 				if ((maxhlim = parse_hlim (optarg)) == (unsigned)(-1))
 					return 1;
@@ -1414,6 +3919,26 @@ main (int argc, char *argv[])
 				niflags |= NI_NUMERICHOST | NI_NUMERICSERV;
 				break;
 
+			case 'O':
+				if (!strcmp (optarg, "text"))
+					format = TRACE_FORMAT_TEXT;
+				else
+				if (!strcmp (optarg, "json"))
+					format = TRACE_FORMAT_JSON;
+				else
+				if (!strcmp (optarg, "binary"))
+					format = TRACE_FORMAT_BINARY;
+				else
+				if (!strcmp (optarg, "none"))
+					format = TRACE_FORMAT_NONE;
+				else
+				{
+					fprintf (stderr, _("%s: invalid output format\n"),
+					         optarg);
+					return 1;
+				}
+				break;
+
 			case 'P':
 				srcport = optarg;
 				break;
@@ -1426,7 +3951,7 @@ main (int argc, char *argv[])
 			{
 				char *end;
 				unsigned long l = strtoul (optarg, &end, 0);
-				if (*end || l > 255)
+				if (*end || l > 1000000)
 					return quick_usage (argv[0]);
 				retries = l;
 				break;
@@ -1436,6 +3961,16 @@ main (int argc, char *argv[])
 				dontroute = true;
 				break;
 
+			case 'R':
+			{
+				char *end;
+				unsigned long l = strtoul (optarg, &end, 0);
+				if (*end || (l < 1) || (l > 1000000000))
+					return quick_usage (argv[0]);
+				scan_rate = l;
+				break;
+			}
+
 			case 'S':
 				type = &syn_type;
 				break;
@@ -1444,6 +3979,10 @@ main (int argc, char *argv[])
 				srchost = optarg;
 				break;
 
+			case 'T':
+				targetname = optarg;
+				break;
+
 			case 't':
 			{
 				char *end;
@@ -1458,6 +3997,10 @@ main (int argc, char *argv[])
 				type = &udp_type;
 				break;
 
+			case 'u':
+				scan_uring = true;
+				break;
+
 			case 'V':
 				return version ();
 
@@ -1471,9 +4014,25 @@ main (int argc, char *argv[])
 				break;
 			}
 
+			case 'X':
+				simname = optarg;
+				break;
+
 			case 'x': // stub: no IPv6 checksums
 				break;
 
+			case 'Y':
+				asnimage = optarg;
+				break;
+
+			case 'y':
+				asnname = optarg;
+				break;
+
+			case 'Z':
+				pace = true;
+				break;
+
 			case 'z':
 			{
 				char *end;
@@ -1493,10 +4052,162 @@ main (int argc, char *argv[])
 	if (type == NULL)
 		type = &udp_type;
 
+	if (format == TRACE_FORMAT_TEXT)
+		setvbuf (stdout, NULL, _IONBF, 0);
+
+	if (asnname != NULL)
+	{
+		asn = asn_open (asnname);
+		if (asn == NULL)
+			return 1;
+	}
+	else
+	if (asnimage != NULL)
+		return quick_usage (argv[0]);
+
+	if (asnimage != NULL)
+	{
+		drop_sockets ();
+		val = asn_compile (asn, asnimage);
+		asn_close (asn);
+		return val ? 1 : 0;
+	}
+
+	if (decodename != NULL)
+	{
+		drop_sockets ();
+		val = decode (decodename);
+		asn_close (asn);
+		return val ? 1 : 0;
+	}
+
+	FILE *targets = NULL;
+	if (targetname != NULL)
+	{
+		targets = strcmp (targetname, "-") ? fopen (targetname, "r") : stdin;
+		if (targets == NULL)
+		{
+			perror (targetname);
+			return 1;
+		}
+		dsthost = NULL;
+	}
+	else
+	if (servername != NULL)
+		dsthost = NULL;
+	else
 	if (optind >= argc)
 		return quick_usage (argv[0]);
+	else
+		dsthost = argv[optind++];
+
+	if ((servername != NULL)
+	 && ((targetname != NULL) || (baselinename != NULL) || summary
+	  || doubletree || pmtu || (format == TRACE_FORMAT_BINARY)))
+	{
+		fprintf (stderr, _("%s: -C cannot be used with -B, -H, -k, -M, -T or "
+		                   "binary output\n"), argv[0]);
+		return quick_usage (argv[0]);
+	}
+	if ((servername != NULL) && (scan_threads == 0))
+		scan_threads = 1;
+
+	if (((scan_rate > 0) || scan_uring) && (scan_threads == 0))
+		scan_threads = 1;
+	if ((scan_threads > 0) && (doubletree || pmtu))
+	{
+		fprintf (stderr,
+		         _("%s: -k and -M cannot be used with -j, -R or -u\n"),
+		         argv[0]);
+		return quick_usage (argv[0]);
+	}
+
+	if ((baselinename != NULL)
+	 && (doubletree || (scan_threads > 0) || (format == TRACE_FORMAT_BINARY)))
+	{
+		fprintf (stderr, _("%s: -B cannot be used with -k, -j, -R, -u or "
+		                   "binary output\n"), argv[0]);
+		return quick_usage (argv[0]);
+	}
+
+	if (summary
+	 && (doubletree || (scan_threads > 0) || (baselinename != NULL)
+	  || (graphname != NULL) || (format == TRACE_FORMAT_BINARY)))
+	{
+		fprintf (stderr, _("%s: -H cannot be used with -k, -j, -R, -u, -B, "
+		                   "-G or binary output\n"), argv[0]);
+		return quick_usage (argv[0]);
+	}
+
+	if ((retries > 255) && !summary)
+	{
+		fprintf (stderr, _("%s: more than 255 probes per hop require -H\n"),
+		         argv[0]);
+		return quick_usage (argv[0]);
+	}
+
+	if ((baselinename != NULL) && ((baseline = baseline_open (baselinename)) == NULL))
+	{
+		perror (baselinename);
+		return 1;
+	}
+
+	if ((simname != NULL) && scan_uring)
+	{
+		fprintf (stderr, _("%s: -u cannot be used with -X\n"), argv[0]);
+		return quick_usage (argv[0]);
+	}
+
+	if ((simname != NULL) && ((sim = sim_open (simname)) == NULL))
+		return 1;
+
+	if (resolve_segments (rt_segv, rt_segc, rt_addrv))
+		return 1;
+	rt_curc = rt_segc;
+
+	if (doubletree && ((stopset = stopset_create ()) == NULL))
+	{
+		perror ("stopset_create");
+		return 1;
+	}
+
+	/* Opens the graph file now, not to lose the traces later */
+	enum graph_format graphfmt = GRAPH_FORMAT_DOT;
+	FILE *graphfile = NULL;
+	if (graphname != NULL)
+	{
+		static const struct
+		{
+			char prefix[8];
+			enum graph_format fmt;
+		} prefixes[] =
+		{
+			{ "dot:",    GRAPH_FORMAT_DOT },
+			{ "csv:",    GRAPH_FORMAT_CSV },
+			{ "binary:", GRAPH_FORMAT_BINARY },
+		};
+
+		for (unsigned i = 0; i < sizeof (prefixes) / sizeof (prefixes[0]);
+		     i++)
+		{
+			size_t len = strlen (prefixes[i].prefix);
+			if (!strncmp (graphname, prefixes[i].prefix, len))
+			{
+				graphfmt = prefixes[i].fmt;
+				graphname += len;
+				break;
+			}
+		}
 
-	dsthost = argv[optind++];
+		graphfile = strcmp (graphname, "-")
+			? fopen (graphname, (graphfmt == GRAPH_FORMAT_BINARY) ? "wb" : "w")
+			: stdout;
+		if ((graphfile == NULL) || ((graph = graph_create ()) == NULL))
+		{
+			perror (graphname);
+			return 1;
+		}
+	}
 
 	if (optind < argc)
 	{
@@ -1508,7 +4219,44 @@ main (int argc, char *argv[])
 	if (optind < argc)
 		return quick_usage (argv[0]);
 
-	setvbuf (stdout, NULL, _IONBF, 0);
-	return -traceroute (dsthost, dstport, srchost, srcport, wait, delay,
-	                    retries, plen, minhlim, maxhlim);
+	if (servername != NULL)
+	{
+		trace_request_t defaults =
+		{
+			.fd = -1,
+			.type = type,
+			.min_ttl = minhlim,
+			.max_ttl = maxhlim,
+			.retries = retries,
+			.timeout = wait,
+		};
+
+		snprintf (defaults.port, sizeof (defaults.port), "%s", dstport);
+		val = -serve (servername, &defaults, srchost, srcport, plen);
+	}
+	else
+		val = -traceroute (dsthost, targets, dstport, srchost, srcport,
+		                   wait, delay, retries, plen, minhlim, maxhlim);
+	if ((targets != NULL) && (targets != stdin))
+		fclose (targets);
+
+	if (graph != NULL)
+	{
+		fflush (stdout);
+		if (graph_write (graph, graphfile, graphfmt)
+		 | ((graphfile != stdout) ? fclose (graphfile) : fflush (graphfile)))
+		{
+			perror (graphname);
+			val = 1;
+		}
+		graph_destroy (graph);
+	}
+	if (stopset != NULL)
+		stopset_destroy (stopset);
+	if (baseline != NULL)
+		baseline_close (baseline);
+	if (sim != NULL)
+		sim_close (sim);
+	asn_close (asn);
+	return val;
 }
@@ -20,12 +20,22 @@
 #ifndef NDISC6_TRACEROUTE_H
 # define NDISC6_TRACEROUTE_H
 
-typedef ssize_t (*trace_send_t) (int fd, unsigned ttl, unsigned n,
+# include <stdio.h> // FILE
+# include <time.h> // struct timespec
+# include <netinet/in.h> // struct sockaddr_in6
+
+/*
+ * Every probe carries a 16-bits probe ID, which the engine maps back to
+ * its hop limit and attempt number, and the 16-bits identifier of the
+ * process (ident). Parsers set *id to the probe ID, and *ttl to the
+ * hop limit if the probe encodes it; either may be left to -1 if unknown.
+ */
+typedef ssize_t (*trace_send_t) (int fd, unsigned ttl, uint16_t id,
                                  size_t plen, uint16_t port);
 
 typedef ssize_t (*trace_parser_t) (const void *restrict data, size_t len,
                                    int *restrict ttl,
-                                   unsigned *restrict n, uint16_t port);
+                                   int *restrict id, uint16_t port);
 
 typedef struct tracetype
 {
@@ -36,20 +46,287 @@ typedef struct tracetype
 	trace_parser_t parse_resp, parse_err;
 } tracetype;
 
+#define TRACE_TIMEOUT     0
+#define TRACE_OK          1 // TTL exceeded, echo reply, port unreachable...
+#define TRACE_CLOSED      2
+#define TRACE_OPEN        3
+#define TRACE_NOROUTE 0x100 // !N network unreachable
+#define TRACE_ADMIN   0x101 // !A administratively prohibited
+#define TRACE_BSCOPE  0X102 // !S beyond scope of source address
+#define TRACE_NOHOST  0x103 // !H address unreachable
+#define TRACE_TOOBIG  0x200 // packet too big
+//#define TRACE_NOSUP   0x400 // header field error
+#define TRACE_NOPROTO 0x401 // !P unrecognized next header
+//#define TRACE_NOOPT 0x402 // unrecognized option
+
+#define TRACE_MPLS_MAX 8 // maximum MPLS label stack depth kept
+
+/* RFC 5837 interface information (one object per hop response) */
+typedef struct
+{
+	uint8_t             ctype; // C-Type: role and fields present (0: none)
+	uint32_t            index; // ifIndex
+	uint32_t            mtu;
+	struct in6_addr     addr;  // IPv4-mapped if the address is IPv4
+	char                name[64];
+} trace_iface_t;
+
+#define TRACE_IFACE_ROLE(ctype)  ((ctype) >> 6)
+#define TRACE_IFACE_INDEX 0x08
+#define TRACE_IFACE_ADDR  0x04
+#define TRACE_IFACE_NAME  0x02
+#define TRACE_IFACE_MTU   0x01
+
+typedef struct
+{
+	struct sockaddr_in6 addr;  // hop address
+	struct timespec     sent;  // request date
+	struct timespec     rcvd;  // reply date
+	int                 rhlim; // received hop limit
+	unsigned            result;// 0: no reply, 1: ok, 2: closed, 3: open
+	unsigned            mtu;   // probe size (path MTU discovery)
+	unsigned            mpls_count; // MPLS label stack depth (RFC 4950)
+	uint32_t            mpls[TRACE_MPLS_MAX]; // label stack entries
+	trace_iface_t       iface; // interface information (RFC 5837)
+} tracetest_t;
+
+/*
+ * Binary output records.
+ * Each record is TRACE_RECORD_SIZE bytes long, in network byte order:
+ *   0  version (TRACE_RECORD_VERSION)
+ *   1  kind (TRACE_RECORD_*)
+ *   2  hop limit
+ *   3  reserved (zero)
+ *   4  attempt number (16-bits)
+ *   6  result code (16-bits, TRACE_*)
+ *   8  IPv6 address (16 bytes)
+ *  24  received hop limit (16-bits, 0xffff if unknown)
+ *  26  destination port (16-bits, zero if none)
+ *  28  extra (32-bits, probe size with path MTU discovery)
+ *  32  sent time (64-bits, nanoseconds)
+ *  40  received time (64-bits, nanoseconds)
+ *
+ * A trace record starts every traceroute. Its address is the destination,
+ * its hop limit the maximum hop limit, its received hop limit the initial
+ * hop limit, its attempt number the number of probes per hop, its result
+ * the probes protocol number, its destination port the base destination
+ * port of the probes, its extra field the packet length, and its sent
+ * time the wall clock time when the traceroute started.
+ *
+ * A hop record follows for every probe. Times are from the monotonic clock.
+ *
+ * An MPLS record follows a hop record for every label stack entry from
+ * the ICMPv6 extensions (RFC 4950) of the response, top of the stack first.
+ * Its hop limit and attempt number are those of the hop record, and its
+ * extra field holds the raw label stack entry.
+ */
+#define TRACE_RECORD_SIZE    48
+#define TRACE_RECORD_VERSION 1
+
+#define TRACE_RECORD_TRACE   1
+#define TRACE_RECORD_HOP     2
+#define TRACE_RECORD_MPLS    3
+
+typedef struct trace_record
+{
+	uint8_t             kind;
+	uint8_t             hlim;
+	uint16_t            attempt;
+	uint16_t            result;
+	struct in6_addr     addr;
+	int                 rhlim;
+	uint16_t            port;
+	uint32_t            extra;
+	uint64_t            sent;
+	uint64_t            rcvd;
+} trace_record_t;
+
+/* Stored trace (see -B): addresses and smallest RTT of every hop */
+#define TRACE_PATH_ADDRS 8 // maximum addresses kept per hop
+
+typedef struct trace_path_hop
+{
+	struct in6_addr     addr[TRACE_PATH_ADDRS];
+	unsigned            count;
+	int64_t             rtt; // nanoseconds, -1 if unknown
+} trace_path_hop_t;
+
+typedef struct trace_path
+{
+	struct in6_addr     dst;
+	unsigned            reached; // destination hop limit, 0 if unreached
+	unsigned            hops;
+	trace_path_hop_t   *hop; // hops entries, from hop limit 1
+} trace_path_t;
+
+/* Difference between a trace and its baseline */
+#define TRACE_CHANGE_NONE    0 // path unchanged
+#define TRACE_CHANGE_NEW     1 // new hop address
+#define TRACE_CHANGE_GONE    2 // disappeared hop address
+#define TRACE_CHANGE_RTT     3 // RTT shift (nanoseconds)
+#define TRACE_CHANGE_REACHED 4 // destination hop limit (0 if unreached)
+
+typedef struct trace_change
+{
+	unsigned            kind;
+	unsigned            ttl;
+	struct in6_addr     addr;
+	int64_t             before, after;
+} trace_change_t;
+
+/* Round-trip time histogram (see -H), with logarithmic buckets */
+#define TRACE_HIST_SUB 32 // sub-buckets per power of two
+#define TRACE_HIST_BUCKETS (TRACE_HIST_SUB * 23) // up to 2^27 microseconds
+
+typedef struct trace_hist
+{
+	uint32_t            count[TRACE_HIST_BUCKETS];
+	unsigned long       answered, lost;
+	int64_t             max; // nanoseconds
+} trace_hist_t;
+
+/* Trace request to the service mode (see -C) */
+typedef struct trace_request
+{
+	int                 fd; // client connection
+	const tracetype    *type;
+	char                host[256];
+	char                port[32];
+	unsigned            min_ttl, max_ttl, retries, timeout;
+	const char         *error; // why the request is invalid, or NULL
+} trace_request_t;
+
+typedef struct asn_table asn_table_t;
+typedef struct trace_baseline trace_baseline_t;
+typedef struct trace_stopset trace_stopset_t;
+typedef struct trace_graph trace_graph_t;
+typedef struct trace_uring trace_uring_t;
+typedef struct trace_sim trace_sim_t;
+typedef struct trace_server trace_server_t;
+typedef void (*trace_uring_cb) (void *opaque, int fd, void *data, size_t len,
+                                const struct sockaddr_in6 *from, int hlim);
+
+enum trace_format
+{
+	TRACE_FORMAT_TEXT,
+	TRACE_FORMAT_JSON,
+	TRACE_FORMAT_BINARY,
+	TRACE_FORMAT_NONE,
+};
+
+enum graph_format
+{
+	GRAPH_FORMAT_DOT,
+	GRAPH_FORMAT_CSV,
+	GRAPH_FORMAT_BINARY,
+};
+
 # ifdef __cplusplus
 extern "C" {
 # endif
 
 ssize_t send_payload (int fd, const void *payload, size_t length, int hlim);
 
+int icmp_parse (const tracetype *type, void *data, size_t len,
+                tracetest_t *res, int *id, int *hlim,
+                const struct sockaddr_in6 *dst);
+int proto_parse (const tracetype *type, const void *data, size_t len,
+                 tracetest_t *res, int *id, int *hlim,
+                 const struct sockaddr_in6 *dst);
+int err_parse (const tracetype *type, unsigned icmp_type, unsigned icmp_code,
+               uint32_t info, const void *data, size_t len,
+               tracetest_t *res, int *id, int *hlim,
+               const struct sockaddr_in6 *dst);
+
+int trace_record_write (FILE *out, const trace_record_t *rec);
+int trace_record_read (FILE *in, trace_record_t *rec);
+
+void json_write_trace (FILE *out, const char *name,
+                       const struct sockaddr_in6 *dst,
+                       const struct in6_addr *segv, unsigned segc,
+                       int protocol, unsigned min_ttl, unsigned max_ttl,
+                       unsigned retries, size_t plen);
+void json_write_hop (FILE *out, const tracetest_t *line, unsigned ttl,
+                     unsigned retries, const asn_table_t *asn);
+int binary_write_trace (FILE *out, const struct sockaddr_in6 *dst,
+                        int protocol, unsigned min_ttl, unsigned max_ttl,
+                        unsigned retries, size_t plen);
+int binary_write_hop (FILE *out, const tracetest_t *line, unsigned ttl,
+                      unsigned retries);
+void json_write_change (FILE *out, const trace_change_t *c);
+void json_write_summary (FILE *out, unsigned ttl,
+                         const trace_path_hop_t *hop, const trace_hist_t *h);
+void json_write_end (FILE *out, const char *status, const char *error);
+
+asn_table_t *asn_open (const char *path);
+void asn_close (asn_table_t *t);
+int asn_compile (const asn_table_t *t, const char *path);
+bool asn_lookup (const asn_table_t *t, const struct in6_addr *addr,
+                 uint32_t *asn, struct in6_addr *prefix, unsigned *plen);
+
+trace_baseline_t *baseline_open (const char *path);
+void baseline_close (trace_baseline_t *b);
+const trace_path_t *baseline_lookup (const trace_baseline_t *b,
+                                     const struct in6_addr *dst);
+bool path_hop_has (const trace_path_hop_t *hop, const struct in6_addr *addr);
+
+void hist_add (trace_hist_t *h, int64_t rtt);
+int64_t hist_percentile (const trace_hist_t *h, unsigned pct);
+
+trace_stopset_t *stopset_create (void);
+void stopset_destroy (trace_stopset_t *s);
+bool stopset_contains (const trace_stopset_t *s, unsigned hlim,
+                       const struct in6_addr *addr);
+int stopset_add (trace_stopset_t *s, unsigned hlim,
+                 const struct in6_addr *addr);
+
+trace_graph_t *graph_create (void);
+void graph_destroy (trace_graph_t *g);
+int graph_add_trace (trace_graph_t *g, const struct in6_addr *src,
+                     const tracetest_t *tab, unsigned first, unsigned last,
+                     unsigned retries);
+int graph_write (trace_graph_t *g, FILE *out, enum graph_format fmt);
+
+trace_uring_t *uring_create (unsigned depth, size_t maxlen,
+                             trace_uring_cb cb, void *opaque);
+void uring_destroy (trace_uring_t *u);
+int uring_recv (trace_uring_t *u, int fd);
+int uring_send (trace_uring_t *u, int fd, const struct sockaddr_in6 *dst,
+                const void *data, size_t len, int hlim);
+int uring_wait (trace_uring_t *u, const struct timespec *deadline);
+int uring_flush (trace_uring_t *u);
+int uring_error (const trace_uring_t *u);
+
+trace_sim_t *sim_open (const char *path);
+void sim_close (trace_sim_t *sim);
+int sim_socket (trace_sim_t *sim, int protocol);
+int sim_bind (trace_sim_t *sim, int fd, const struct sockaddr_in6 *addr);
+int sim_connect (trace_sim_t *sim, int fd, const struct sockaddr_in6 *dst);
+int sim_getsockname (trace_sim_t *sim, int fd, struct sockaddr_in6 *addr);
+int sim_send (trace_sim_t *sim, int fd, const struct sockaddr_in6 *dst,
+              const void *data, size_t len, int hlim);
+ssize_t sim_recv (trace_sim_t *sim, int fd, void *buf, size_t len,
+                  struct sockaddr_in6 *addr, int *hlim);
+
+trace_server_t *server_open (const char *path,
+                             const trace_request_t *defaults);
+void server_close (trace_server_t *s);
+int server_poll (trace_server_t *s, int timeout);
+bool server_pop (trace_server_t *s, trace_request_t *req);
+void server_done (trace_server_t *s, int fd, const void *reply, size_t len);
+
 # ifdef __cplusplus
 }
 #endif
 
 extern bool ecn;
 extern uint16_t sport;
+extern uint16_t ident;
 
 extern const tracetype udp_type, udplite_type, echo_type, syn_type, ack_type;
+extern const tracetype udp_dgram_type, echo_dgram_type;
+
+#define TRACE_RTHDR_SRH 4 // Segment Routing Header (RFC 8754)
 
 #ifndef IPPROTO_UDPLITE
 # define IPPROTO_UDPLITE 136